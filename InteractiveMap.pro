@@ -17,26 +17,12 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 SOURCES += \
     desktop.cpp \
-    main.cpp \
-    map/details/details.cpp \
-    map/details/detailstext.cpp \
-    map/dialogs/legendinfodialog.cpp \
-    map/helpers/qgraphicsbuttonitem.cpp \
-    map/helpers/spritesheet.cpp \
-    map/helpers/texteditor.cpp \
-    map/interactivemap.cpp \
-    map/regionofinterest.cpp
+    main.cpp
 
 HEADERS += \
-    desktop.h \
-    map/details/details.h \
-    map/details/detailstext.h \
-    map/dialogs/legendinfodialog.h \
-    map/helpers/qgraphicsbuttonitem.h \
-    map/helpers/spritesheet.h \
-    map/helpers/texteditor.h \
-    map/interactivemap.h \
-    map/regionofinterest.h
+    desktop.h
+
+include(map/map.pri)
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
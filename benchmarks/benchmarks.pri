@@ -0,0 +1,24 @@
+# Common setup of the benchmarks: console applications, built with the sources of the map.
+
+QT       += core gui
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+CONFIG += c++11 c++14 c++17 console
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+include($$PWD/../map/map.pri)
+
+INCLUDEPATH += $$PWD/common
+
+SOURCES += \
+    $$PWD/common/heapusage.cpp \
+    $$PWD/common/legacyregion.cpp \
+    $$PWD/common/testmap.cpp
+
+HEADERS += \
+    $$PWD/common/heapusage.h \
+    $$PWD/common/legacyregion.h \
+    $$PWD/common/testmap.h
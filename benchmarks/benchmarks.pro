@@ -0,0 +1,9 @@
+# Benchmarks of the map, each of them prints the figures before and after the optimization, it checks.
+# They are built separately from the application: qmake benchmarks/benchmarks.pro
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    mapload \
+    regionlayer \
+    regionmemory
@@ -0,0 +1,38 @@
+#include "heapusage.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#elif defined(Q_OS_WIN)
+#include <malloc.h>
+#elif defined(Q_OS_MACOS)
+#include <malloc/malloc.h>
+#endif
+
+qint64 HeapUsage::allocated()
+{
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 info = mallinfo2();
+    return qint64(info.uordblks);
+#else
+    struct mallinfo info = mallinfo();
+    return qint64(quint32(info.uordblks));
+#endif
+#elif defined(Q_OS_WIN)
+    // The heap is walked block by block, so it's measured only before and after the measured objects are made.
+    qint64 bytes = 0;
+    _HEAPINFO entry;
+    entry._pentry = nullptr;
+    while (_heapwalk(&entry) == _HEAPOK)
+        if (entry._useflag == _USEDENTRY)
+            bytes += qint64(entry._size);
+
+    return bytes;
+#elif defined(Q_OS_MACOS)
+    malloc_statistics_t statistics;
+    malloc_zone_statistics(nullptr, &statistics);
+    return qint64(statistics.size_in_use);
+#else
+    return -1;
+#endif
+}
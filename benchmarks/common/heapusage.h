@@ -0,0 +1,21 @@
+#ifndef HEAPUSAGE_H
+#define HEAPUSAGE_H
+
+#include <QtGlobal>
+
+// HeapUsage tells, how many bytes are allocated on the heap of the process right now.
+// It's used to measure the real memory of the objects (with the private data of Qt classes, that sizeof doesn't see):
+// the heap is measured before and after the objects are made, and the difference is divided by their count.
+// - glibc: the allocated bytes of all the arenas (mallinfo2, or mallinfo on older versions);
+// - Windows: the used blocks of the CRT heap (_heapwalk);
+// - macOS: the bytes in use of the default malloc zone.
+// On the other platforms it returns -1. It counts the allocations of all the threads, so the benchmarks measure it,
+// while no other threads are running.
+
+class HeapUsage
+{
+public:
+    static qint64 allocated();
+};
+
+#endif // HEAPUSAGE_H
@@ -0,0 +1,153 @@
+#include "legacyregion.h"
+
+#include <QTextStream>
+#include <QFileInfo>
+#include <QFile>
+
+#include <QPainter>
+
+namespace
+{
+    int filesRead = 0;
+}
+
+LegacyRegion::LegacyRegion(QGraphicsItem *parent)
+    : QGraphicsPathItem(parent), m_pen(Qt::white)
+{
+    setShape(RegionOfInterest::ShapeType::RECTANGLE, QRectF(0,0,0,0));
+
+    connect(&m_animationTimer, SIGNAL(timeout()), this, SLOT(onAnimationTick()));
+    m_animationTimer.start(1000/14);
+}
+
+LegacyRegion::LegacyRegion(const LegacyRegion &rhs, QGraphicsItem *parent)
+    : QGraphicsPathItem(parent), m_pen(Qt::white)
+{
+    setShape(rhs.m_shapeType, rhs.boundingRect());
+    setPos(rhs.pos());
+    setContents(rhs.m_attachedContents);
+    setLocalMap(rhs.m_attachedLocalMap);
+
+    connect(&m_animationTimer, SIGNAL(timeout()), this, SLOT(onAnimationTick()));
+    m_animationTimer.start(1000/14);
+}
+
+void LegacyRegion::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget)
+{
+    Q_UNUSED(option);
+    Q_UNUSED(widget);
+
+    painter->setPen(m_pen);
+    painter->drawPath(m_shape);
+}
+
+QRectF LegacyRegion::boundingRect() const
+{
+    return m_shape.boundingRect();
+}
+
+QPainterPath LegacyRegion::shape() const
+{
+    return m_shape;
+}
+
+void LegacyRegion::load(const RegionRecord &record)
+{
+    setShape(record.shapeType, record.bounds);
+    setPos(record.position);
+    setContents(record.contents);
+    setLocalMap(record.localMap);
+}
+
+void LegacyRegion::setShape(const RegionOfInterest::ShapeType &type, const QRectF &bounds)
+{
+    m_shapeType = type;
+    m_shape = QPainterPath();
+
+    switch (type)
+    {
+        case RegionOfInterest::ShapeType::RECTANGLE:
+        m_shape.addRect(bounds);
+        break;
+
+        case RegionOfInterest::ShapeType::ROUNDED_RECTANGLE:
+        m_shape.addRoundedRect(bounds, 10, 10);
+        break;
+
+        case RegionOfInterest::ShapeType::CIRCLE:
+        {
+            int radius = qMin(int(bounds.width() / 2), int(bounds.height() / 2));
+            m_shape.addEllipse(bounds.center().toPoint(), radius, radius);
+        }
+        break;
+
+        case RegionOfInterest::ShapeType::ELLIPSE:
+        m_shape.addEllipse(bounds);
+        break;
+    }
+}
+
+void LegacyRegion::setContents(const QString &filename)
+{
+    m_attachedContents = filename;
+    m_name = generateNameFor(filename);
+    m_text.clear();
+    setToolTip(m_name);
+
+    if (filename.isEmpty())
+        return;
+
+    ++filesRead;
+
+    QFile file (filename);
+    if (file.open(QIODevice::ReadOnly))
+    {
+        QTextStream stream (&file);
+        m_text = stream.readAll();
+
+        file.close();
+    }
+}
+
+void LegacyRegion::setLocalMap(const QString &localMap)
+{
+    m_attachedLocalMap = localMap;
+}
+
+int LegacyRegion::readCount()
+{
+    return filesRead;
+}
+
+QString LegacyRegion::generateNameFor(const QString &fullPath)
+{
+    QFileInfo fi (fullPath);
+    if (!fi.exists())
+        return "";
+
+    QString name = fi.fileName();
+    name.truncate(name.indexOf(fi.suffix()) - 1);
+
+    return name;
+}
+
+void LegacyRegion::onAnimationTick()
+{
+    if (m_state != RegionOfInterest::State::ACTIVE)
+        return;
+
+    if (forward)
+    {
+        m_pen.setWidth(m_pen.width() + 1);
+        if (m_pen.width() == 7)
+            forward = false;
+    }
+    else
+    {
+        m_pen.setWidth(m_pen.width() - 1);
+        if (m_pen.width() == 1)
+            forward = true;
+    }
+
+    update();
+}
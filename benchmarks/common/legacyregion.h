@@ -0,0 +1,60 @@
+#ifndef LEGACYREGION_H
+#define LEGACYREGION_H
+
+#include <QGraphicsPathItem>
+#include <QString>
+
+#include <QTimer>
+#include <QPen>
+
+#include "io/mapdocument.h"
+
+// LegacyRegion is the region, as it was before the regions were slimmed down and loaded in one pass.
+// It's kept only for the benchmarks, so they report the figures before and after the changes on the same machine:
+// - QObject with its own animation timer, pen and shape path;
+// - the name, the paths and the legend text are stored by every region;
+// - the legend is read, when the contents are set, and the copy reads it again (as the old loading did).
+
+class LegacyRegion : public QObject, public QGraphicsPathItem
+{
+    Q_OBJECT
+
+public:
+    LegacyRegion(QGraphicsItem* parent = nullptr);
+    LegacyRegion(const LegacyRegion& rhs, QGraphicsItem* parent = nullptr);
+
+    void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget = Q_NULLPTR) override;
+    QRectF boundingRect() const override;
+    QPainterPath shape() const override;
+
+    // The same, that reading the region from the old stream did.
+    void load (const RegionRecord& record);
+
+    void setShape (const RegionOfInterest::ShapeType& type, const QRectF& bounds);
+    void setContents (const QString& filename);
+    void setLocalMap (const QString& localMap);
+
+    // Count of the legends, read by all the legacy regions.
+    static int readCount();
+
+private:
+    static QString generateNameFor (const QString& fullPath);
+
+    RegionOfInterest::ShapeType m_shapeType = RegionOfInterest::ShapeType::RECTANGLE;
+    QPainterPath m_shape;
+    RegionOfInterest::State m_state = RegionOfInterest::State::IDLE;
+    QPen m_pen;
+
+    QString m_name;
+    QString m_attachedLocalMap;
+    QString m_attachedContents;
+    QString m_text;
+
+    QTimer m_animationTimer;
+    bool forward = true;
+
+public slots:
+    void onAnimationTick();
+};
+
+#endif // LEGACYREGION_H
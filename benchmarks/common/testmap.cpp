@@ -0,0 +1,52 @@
+#include "testmap.h"
+
+#include <QTextStream>
+#include <QFile>
+#include <QtMath>
+
+QStringList TestMap::writeLegends(const QString &directory, int count, int bytes)
+{
+    QStringList legends;
+    for (int i = 0; i < count; ++i)
+    {
+        QString filename = QString("%1/legend_%2.txt").arg(directory).arg(i);
+
+        QFile file (filename);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+            continue;
+
+        // Paragraphs of plain text, like the chronicles of the real legends.
+        QTextStream stream (&file);
+        QString paragraph = QString("Legend %1: the chronicle of the region. ").arg(i).repeated(4) + "\n";
+        for (int written = 0; written < bytes; written += paragraph.size())
+            stream << paragraph;
+
+        legends.append(filename);
+    }
+
+    return legends;
+}
+
+QVector<RegionRecord> TestMap::regions(int count, const QRectF &area, const QStringList &legends)
+{
+    QVector<RegionRecord> regions;
+    regions.reserve(count);
+
+    int columns = qMax(1, qCeil(qSqrt(count)));
+    int rows = qMax(1, (count + columns - 1) / columns);
+    qreal width  = area.width()  / columns;
+    qreal height = area.height() / rows;
+
+    for (int i = 0; i < count; ++i)
+    {
+        RegionRecord record;
+        record.shapeType = static_cast<RegionOfInterest::ShapeType>(i % 4);
+        record.position  = area.topLeft() + QPointF((i % columns) * width, (i / columns) * height);
+        record.bounds    = QRectF(0, 0, width * 0.8, height * 0.8);
+        record.contents  = legends.isEmpty() ? QString() : legends.at(i % legends.size());
+
+        regions.append(record);
+    }
+
+    return regions;
+}
@@ -0,0 +1,22 @@
+#ifndef TESTMAP_H
+#define TESTMAP_H
+
+#include <QStringList>
+#include <QString>
+#include <QVector>
+#include <QRectF>
+
+#include "io/mapdocument.h"
+
+// TestMap makes the synthetic maps for the benchmarks:
+// - the legend files are written into the given directory, the regions share them (as the real maps do);
+// - the regions are laid out in a grid over the area, the shape types are mixed.
+
+class TestMap
+{
+public:
+    static QStringList writeLegends (const QString& directory, int count, int bytes);
+    static QVector<RegionRecord> regions (int count, const QRectF& area, const QStringList& legends);
+};
+
+#endif // TESTMAP_H
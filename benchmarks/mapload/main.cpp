@@ -0,0 +1,114 @@
+#include <QApplication>
+#include <QTemporaryDir>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QSet>
+
+#include "interactivemap.h"
+#include "io/imfformat.h"
+#include "legend/legendloader.h"
+
+#include "legacyregion.h"
+#include "testmap.h"
+
+// Loads the same map in the legacy way (each region is read into the temporary one, then copied,
+// and both of them read the legend) and with InteractiveMap, and prints the count of legend files read by each.
+// Only this process reads the legends here, so the counters see nothing, but the load.
+// Usage: mapload [regions] [legends]
+
+namespace
+{
+    // The jobs of the map (legends, prefetching) deliver their results through the event loop.
+    void processEventsFor(int milliseconds)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.elapsed() < milliseconds)
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // The map is never shown, so no display is needed.
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication application (argc, argv);
+    QStringList arguments = application.arguments();
+
+    int count       = arguments.size() > 1 ? arguments.at(1).toInt() : 2000;
+    int legendCount = arguments.size() > 2 ? arguments.at(2).toInt() : 200;
+
+    QTemporaryDir directory;
+    QRectF area (0, 0, 30000, 20000);
+
+    MapDocument document;
+    document.regions = TestMap::regions(count, area, TestMap::writeLegends(directory.path(), legendCount, 4096));
+
+    QString filename = directory.path() + "/map.imf";
+    if (!ImfFormat::writeFile(filename, document))
+    {
+        QTextStream(stdout) << "Can't write the map into " << filename << "\n";
+        return 1;
+    }
+
+    // Legacy loading: the region is read into the temporary one, then the copy is added to the map.
+    QElapsedTimer timer;
+    timer.start();
+
+    MapDocument legacyDocument;
+    ImfFormat::readFile(filename, legacyDocument);
+
+    QVector<LegacyRegion*> legacy;
+    LegacyRegion current;
+    for (const RegionRecord& record : qAsConst(legacyDocument.regions))
+    {
+        current.load(record);
+        legacy.append(new LegacyRegion(current));
+    }
+
+    qint64 legacyTime = timer.elapsed();
+    int legacyReads = LegacyRegion::readCount();
+    qDeleteAll(legacy);
+
+    // Current loading: the regions are built once, the legends are read, when they are shown.
+    int readsBefore = LegendLoader::readCount();
+    timer.restart();
+
+    InteractiveMap map;
+    map.loadFrom(filename);
+
+    qint64 loadTime = timer.elapsed();
+    processEventsFor(500);
+    int loadReads = LegendLoader::readCount() - readsBefore;
+
+    // Showing the legend of every region once: the shared legends are read once for all of their regions.
+    QSet<QString> legends;
+    for (const RegionRecord& record : qAsConst(document.regions))
+        legends.insert(record.contents);
+
+    LegendLoader loader;
+    int delivered = 0;
+    QObject::connect(&loader, &LegendLoader::loaded, [&delivered]() { ++delivered; });
+
+    readsBefore = LegendLoader::readCount();
+    for (const RegionRecord& record : qAsConst(document.regions))
+        loader.request(record.contents);
+
+    timer.restart();
+    while (delivered < legends.size() && timer.elapsed() < 10000)
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+
+    int shownReads = LegendLoader::readCount() - readsBefore;
+
+    QTextStream out (stdout);
+    out << QString("Regions: %1, legends: %2\n").arg(count).arg(legends.size());
+    out << QString("Before: legacy load          %1 legend reads (%2 per region), %3 ms\n")
+           .arg(legacyReads).arg(double(legacyReads) / qMax(1, count), 0, 'f', 1).arg(legacyTime);
+    out << QString("After:  load                 %1 legend reads, %2 ms\n").arg(loadReads).arg(loadTime);
+    out << QString("After:  every legend shown   %1 legend reads (%2 per region)\n")
+           .arg(shownReads).arg(double(shownReads) / qMax(1, count), 0, 'f', 2);
+
+    return 0;
+}
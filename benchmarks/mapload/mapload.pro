@@ -0,0 +1,8 @@
+# Legend files, read by one load of the map: the legacy loading and the current one.
+
+include(../benchmarks.pri)
+
+TARGET = mapload
+
+SOURCES += \
+    main.cpp
@@ -0,0 +1,90 @@
+#include <QApplication>
+#include <QGraphicsScene>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QPainter>
+#include <QImage>
+
+#include "regionofinterest.h"
+#include "regions/regionstore.h"
+#include "regions/regionlayer.h"
+
+#include "legacyregion.h"
+#include "testmap.h"
+
+// Renders the same regions as the scene of the map does: one item per region (the legacy and the slim items)
+// and one region layer over the store, and prints the average time of the frame, that shows all of them.
+// Usage: regionlayer [regions] [frames]
+
+namespace
+{
+    // The whole area is drawn into the image of the window size, the first frame is not counted
+    // (it builds the index of the scene).
+    double frameTime(QGraphicsScene& scene, const QRectF& area, int frames)
+    {
+        QImage image (1920, 1280, QImage::Format_ARGB32_Premultiplied);
+
+        QElapsedTimer timer;
+        for (int frame = -1; frame < frames; ++frame)
+        {
+            if (frame == 0)
+                timer.start();
+
+            image.fill(Qt::black);
+            QPainter painter (&image);
+            scene.render(&painter, QRectF(image.rect()), area);
+        }
+
+        return double(timer.nsecsElapsed()) / 1e6 / qMax(1, frames);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // The scene is rendered into the image, so no display is needed.
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication application (argc, argv);
+    QStringList arguments = application.arguments();
+
+    int count  = arguments.size() > 1 ? arguments.at(1).toInt() : 20000;
+    int frames = arguments.size() > 2 ? arguments.at(2).toInt() : 20;
+
+    QRectF area (0, 0, 30000, 20000);
+    QVector<RegionRecord> records = TestMap::regions(count, area, QStringList());
+
+    QGraphicsScene legacyScene (area);
+    for (const RegionRecord& record : qAsConst(records))
+    {
+        LegacyRegion* region = new LegacyRegion();
+        region->load(record);
+        legacyScene.addItem(region);
+    }
+
+    QGraphicsScene itemScene (area);
+    for (const RegionRecord& record : qAsConst(records))
+        itemScene.addItem(new RegionOfInterest(record.shapeType, record.bounds, record.position, record.contents, record.localMap));
+
+    RegionStore store (area);
+    for (const RegionRecord& record : qAsConst(records))
+        store.add(record);
+
+    QGraphicsScene layerScene (area);
+    RegionLayer* layer = new RegionLayer(&store);
+    layer->setBounds(area);
+    layerScene.addItem(layer);
+
+    double legacyTime = frameTime(legacyScene, area, frames);
+    double itemTime   = frameTime(itemScene,   area, frames);
+    double layerTime  = frameTime(layerScene,  area, frames);
+
+    QTextStream out (stdout);
+    out << QString("Regions: %1, frames: %2 (all the regions are visible)\n").arg(count).arg(frames);
+    out << QString("Before: legacy items  %1 ms per frame\n").arg(legacyTime, 0, 'f', 2);
+    out << QString("After:  items         %1 ms per frame\n").arg(itemTime, 0, 'f', 2);
+    out << QString("After:  region layer  %1 ms per frame (%2x faster, than the items)\n")
+           .arg(layerTime, 0, 'f', 2).arg(itemTime / qMax(layerTime, 0.001), 0, 'f', 1);
+
+    return 0;
+}
@@ -0,0 +1,8 @@
+# Frame time of the regions: drawn by the items (legacy and slim ones) and by the batched region layer.
+
+include(../benchmarks.pri)
+
+TARGET = regionlayer
+
+SOURCES += \
+    main.cpp
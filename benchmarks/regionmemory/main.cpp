@@ -0,0 +1,102 @@
+#include <QApplication>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QVector>
+
+#include <functional>
+
+#include "regionofinterest.h"
+#include "regions/regionstore.h"
+
+#include "heapusage.h"
+#include "legacyregion.h"
+#include "testmap.h"
+
+// Measures the memory of one region on the heap (with the private data of Qt classes, that sizeof doesn't see)
+// for the legacy item, the slim item and the record of the store, and prints how much smaller the new ones are.
+// Usage: regionmemory [regions] [legends] [legend bytes]
+
+namespace
+{
+    // Bytes per region: the heap is measured before and after the regions are made. No other threads run meanwhile.
+    qint64 measure(int count, const std::function<void()>& make, const std::function<void()>& release)
+    {
+        qint64 before = HeapUsage::allocated();
+        make();
+        qint64 after = HeapUsage::allocated();
+        release();
+
+        if (before < 0 || after < 0)
+            return -1;
+
+        return (after - before) / qMax(1, count);
+    }
+
+    QString ratio(qint64 before, qint64 after)
+    {
+        return (before > 0 && after > 0) ? QString::number(double(before) / after, 'f', 1) + "x" : QString("unknown");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // The items are never shown, so no display is needed.
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication application (argc, argv);
+    QStringList arguments = application.arguments();
+
+    int count       = arguments.size() > 1 ? arguments.at(1).toInt() : 20000;
+    int legendCount = arguments.size() > 2 ? arguments.at(2).toInt() : 200;
+    int legendBytes = arguments.size() > 3 ? arguments.at(3).toInt() : 4096;
+
+    QTextStream out (stdout);
+    if (HeapUsage::allocated() < 0)
+    {
+        out << "The heap can't be measured on this platform\n";
+        return 1;
+    }
+
+    QTemporaryDir directory;
+    QRectF area (0, 0, 30000, 20000);
+    QVector<RegionRecord> records = TestMap::regions(count, area, TestMap::writeLegends(directory.path(), legendCount, legendBytes));
+
+    // The containers are allocated beforehand, so only the regions themselves are measured.
+    QVector<LegacyRegion*> legacy;
+    legacy.reserve(count);
+    qint64 legacyBytes = measure(count, [&]()
+    {
+        for (const RegionRecord& record : qAsConst(records))
+        {
+            LegacyRegion* region = new LegacyRegion();
+            region->load(record);
+            legacy.append(region);
+        }
+    }, [&]() { qDeleteAll(legacy); legacy.clear(); });
+
+    QVector<RegionOfInterest*> items;
+    items.reserve(count);
+    qint64 itemBytes = measure(count, [&]()
+    {
+        for (const RegionRecord& record : qAsConst(records))
+            items.append(new RegionOfInterest(record.shapeType, record.bounds, record.position, record.contents, record.localMap));
+    }, [&]() { qDeleteAll(items); items.clear(); });
+
+    RegionStore* store = nullptr;
+    qint64 estimate = 0;
+    qint64 recordBytes = measure(count, [&]()
+    {
+        store = new RegionStore(area);
+        for (const RegionRecord& record : qAsConst(records))
+            store->add(record);
+    }, [&]() { estimate = store->memoryUsage() / qMax(1, store->size()); delete store; });
+
+    out << QString("Regions: %1, legends: %2 of %3 bytes").arg(count).arg(legendCount).arg(legendBytes) << "\n";
+    out << QString("Before: legacy item   %1 bytes per region").arg(legacyBytes) << "\n";
+    out << QString("After:  item          %1 bytes per region (%2 smaller)").arg(itemBytes).arg(ratio(legacyBytes, itemBytes)) << "\n";
+    out << QString("After:  store record  %1 bytes per region (%2 smaller, estimated by the store: %3)")
+           .arg(recordBytes).arg(ratio(legacyBytes, recordBytes)).arg(estimate) << "\n";
+
+    return 0;
+}
@@ -0,0 +1,8 @@
+# Memory, taken by one region: the legacy item, the slim item and the record of the store.
+
+include(../benchmarks.pri)
+
+TARGET = regionmemory
+
+SOURCES += \
+    main.cpp
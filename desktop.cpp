@@ -1,10 +1,46 @@
 #include "desktop.h"
 
+#include <QCoreApplication>
 #include <QGridLayout>
 #include <QFileDialog>
+#include <QMessageBox>
+#include <QRunnable>
+#include <QPointer>
 
 #include <QDebug>
 
+namespace
+{
+    // PackJob builds the bundle (which reads and copies the whole tree of maps) and passes the result back to GUI thread.
+    class PackJob : public QRunnable
+    {
+    public:
+        PackJob(Desktop* desktop, const QString& rootMap, const QString& bundle)
+            : m_desktop(desktop), m_rootMap(rootMap), m_bundle(bundle)
+        {
+        }
+
+        void run() override
+        {
+            QString error;
+            bool packed = MapBundle::pack(m_rootMap, m_bundle, &error);
+
+            QPointer<Desktop> desktop = m_desktop;
+            QString bundle = m_bundle;
+            QMetaObject::invokeMethod(QCoreApplication::instance(), [desktop, bundle, packed, error]()
+            {
+                if (desktop)
+                    desktop->onPacked(bundle, packed, error);
+            }, Qt::QueuedConnection);
+        }
+
+    private:
+        QPointer<Desktop> m_desktop;
+        QString m_rootMap;
+        QString m_bundle;
+    };
+}
+
 Desktop::Desktop(QWidget *parent)
     : QWidget(parent)
 {
@@ -20,6 +56,7 @@ Desktop::~Desktop()
 void Desktop::init()
 {
     m_map = new InteractiveMap(this);
+    m_packPool.setMaxThreadCount(1);
 }
 
 void Desktop::makeUI()
@@ -30,6 +67,8 @@ void Desktop::makeUI()
     pb_modeIndicator = new QPushButton("View mode");
     pb_updateRegions = new QPushButton("Update");
     pb_fillWithTestData = new QPushButton("Fill");
+    pb_packMap = new QPushButton("Pack map...");
+    pb_importMask = new QPushButton("Import mask...");
 
     pb_modeIndicator->setCheckable(true);
 
@@ -44,6 +83,8 @@ void Desktop::makeUI()
     connect(cb_regionTypeSelector, SIGNAL(activated(int)), this, SLOT(onActivated(int)));
     connect(pb_updateRegions, SIGNAL(clicked()), this, SLOT(onUpdateRegions()));
     connect(pb_fillWithTestData, SIGNAL(clicked()), this, SLOT(onFill()));
+    connect(pb_packMap, SIGNAL(clicked()), this, SLOT(onPackMap()));
+    connect(pb_importMask, SIGNAL(clicked()), this, SLOT(onImportMask()));
     connect(m_map, SIGNAL(resizeDesktop(int, int)), this, SLOT(onResizeDesktop(int, int)));
 
     m_layout = new QGridLayout (this);
@@ -55,6 +96,8 @@ void Desktop::makeUI()
     m_layout->addWidget(cb_regionTypeSelector, 5, 3, 1, 1);
     m_layout->addWidget(pb_updateRegions, 5, 1, 1, 1);
     m_layout->addWidget(pb_fillWithTestData, 5, 0, 1, 1);
+    m_layout->addWidget(pb_packMap, 5, 2, 1, 1);
+    m_layout->addWidget(pb_importMask, 6, 0, 1, 1);
 
     setLayout(m_layout);
     // setFixedSize(m_map.width(), m_map.height());
@@ -70,6 +113,8 @@ void Desktop::clear()
     pb_modeIndicator->deleteLater();
     pb_updateRegions->deleteLater();
     pb_fillWithTestData->deleteLater();
+    pb_packMap->deleteLater();
+    pb_importMask->deleteLater();
     cb_regionTypeSelector->deleteLater();
     m_layout->deleteLater();
 }
@@ -97,11 +142,51 @@ void Desktop::onSaveMap()
 void Desktop::onLoadMap()
 {
     QString filename = QFileDialog::getOpenFileName(nullptr, "Load interactive map from...",
-                                                    QString(), "Interactive Map Format (*.imf)");
+                                                    QString(), "Interactive Map Format (*.imf);;Interactive Map Bundle (*.imb)");
 
     loadFrom(filename);
 }
 
+void Desktop::onPackMap()
+{
+    QString rootMap = QFileDialog::getOpenFileName(nullptr, "Take the root map to pack...",
+                                                   QString(), "Interactive Map Format (*.imf)");
+    if (rootMap.isEmpty())
+        return;
+
+    QString bundle = QFileDialog::getSaveFileName(nullptr, "Save map bundle as...",
+                                                  QString(), "Interactive Map Bundle (*.imb)");
+    if (bundle.isEmpty())
+        return;
+
+    // The button is enabled again, when the bundle is written.
+    pb_packMap->setEnabled(false);
+    m_map->showStatus(QString("Packing map into bundle: %1").arg(bundle));
+    m_packPool.start(new PackJob(this, rootMap, bundle));
+}
+
+void Desktop::onPacked(const QString &bundle, bool packed, const QString &error)
+{
+    pb_packMap->setEnabled(true);
+
+    if (packed)
+    {
+        m_map->showStatus(QString("Packed map into bundle: %1").arg(bundle));
+        return;
+    }
+
+    m_map->showStatus(QString("Can't pack map into bundle: %1").arg(bundle));
+    QMessageBox::warning(this, "Pack map", error);
+}
+
+void Desktop::onImportMask()
+{
+    QString filename = QFileDialog::getOpenFileName(nullptr, "Take the mask image (each colour is a region)...",
+                                                    QString(), "Images (*.png *.bmp *.gif)");
+
+    m_map->importMask(filename);
+}
+
 void Desktop::onPlaceMap()
 {
     QString filename = QFileDialog::getOpenFileName(nullptr, "Take an image to use a background map",
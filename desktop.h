@@ -15,6 +15,7 @@
 #include <QComboBox>
 #include <QPushButton>
 #include <QGridLayout>
+#include <QThreadPool>
 
 class Desktop : public QWidget
 {
@@ -44,12 +45,19 @@ private:
     QPushButton *pb_modeIndicator; // toggle button to start\end the editing
     QPushButton *pb_updateRegions; // helper button to update region data without need to restart the app
     QPushButton *pb_fillWithTestData; // helper button to fill the scene with test data
+    QPushButton *pb_packMap; // pack the tree of maps into a single bundle file
+    QPushButton *pb_importMask; // make regions from the colour-coded mask image
     QComboBox   *cb_regionTypeSelector; // selector for path type, that are used to draw regions of interest
     QGridLayout *m_layout;
 
+    // Bundles are packed off GUI thread, one at a time.
+    QThreadPool m_packPool;
+
 public slots:
     void onSaveMap();
     void onLoadMap();
+    void onPackMap();
+    void onImportMask();
     void onPlaceMap();
     void onActivated(int);
 
@@ -57,6 +65,7 @@ public slots:
     void onResizeDesktop(int width, int height);
     void onUpdateRegions();
     void onFill();
+    void onPacked (const QString& bundle, bool packed, const QString& error);
 
 };
 #endif // DESKTOP_H
@@ -0,0 +1,654 @@
+#include "tiledbackground.h"
+
+#include <QStyleOptionGraphicsItem>
+#include <QCoreApplication>
+#include <QImageIOHandler>
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QMutex>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QPointer>
+#include <QPainter>
+#include <QScopedPointer>
+#include <QStandardPaths>
+#include <QTemporaryFile>
+#include <QVector>
+#include <QDir>
+
+#include <QtMath>
+#include <QDebug>
+
+#include "../io/mapbundle.h"
+
+// Tiles of all backgrounds are decoded by the same pool, so switching the maps doesn't spawn new threads.
+Q_GLOBAL_STATIC(QThreadPool, decoderPool)
+
+struct TiledBackground::SourceImage
+{
+    // The part of the image, that is requested by the job, which waits for the whole image to be decoded.
+    struct Request
+    {
+        QRect clip;
+        QSize size;
+        QSharedPointer<QAtomicInt> tileCancelled;
+        std::function<void(const QImage&)> done;
+    };
+
+    // The mutex guards only the fields, the image itself is decoded without holding it.
+    // The spilled image uses the pixels of the mapped file, so the file is released after the image.
+    QMutex mutex;
+    QScopedPointer<QTemporaryFile> spill;
+    QImage image;
+    bool decoded = false;
+    bool decoding = false;
+    QVector<Request> waiting;
+};
+
+namespace
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    // The whole map doesn't fit into the default allocation limit of Qt 6, but the limit is global for all the readers.
+    // So it's raised only while the whole images are read and restored, when the last of them is done.
+    class AllocationLimit
+    {
+    public:
+        AllocationLimit(const QSize& size)
+        {
+            int megabytes = int(qint64(size.width()) * size.height() * 4 / (1024 * 1024)) + 1;
+
+            QMutexLocker locker (&s_mutex);
+            if (s_reads++ == 0)
+                s_saved = QImageReader::allocationLimit();
+            if (s_saved > 0 && QImageReader::allocationLimit() < megabytes)
+                QImageReader::setAllocationLimit(megabytes);
+        }
+
+        ~AllocationLimit()
+        {
+            QMutexLocker locker (&s_mutex);
+            if (--s_reads == 0)
+                QImageReader::setAllocationLimit(s_saved);
+        }
+
+    private:
+        static QMutex s_mutex;
+        static int s_reads;
+        static int s_saved;
+    };
+
+    QMutex AllocationLimit::s_mutex;
+    int AllocationLimit::s_reads = 0;
+    int AllocationLimit::s_saved = 0;
+#endif
+
+    // DecodeJob reads part of the image (or the whole image) already downscaled to the requested size,
+    // and passes the result back to GUI thread, where QPixmap could be made.
+    class DecodeJob : public QRunnable
+    {
+    public:
+        DecodeJob(const QString& filename, const QRect& clip, const QSize& size,
+                  const QSharedPointer<QAtomicInt>& cancelled, const QSharedPointer<QAtomicInt>& tileCancelled,
+                  const QSharedPointer<TiledBackground::SourceImage>& source, int budget, std::function<void(const QImage&)> done)
+            : m_filename(filename), m_clip(clip), m_size(size), m_cancelled(cancelled), m_tileCancelled(tileCancelled),
+              m_source(source), m_budget(budget), m_done(done)
+        {
+        }
+
+        void run() override
+        {
+            if (isCancelled())
+                return;
+
+            // The image could be in the mounted bundle.
+            QScopedPointer<QIODevice> device (MapBundle::openResource(m_filename));
+            QImageReader reader (device.data());
+
+            if (!reader.supportsOption(QImageIOHandler::ClipRect))
+            {
+                // Otherwise each tile would decode the whole image, so it's decoded only once and shared by all the tiles.
+                decodeWhole(reader);
+                return;
+            }
+
+            if (m_clip.isValid())
+                reader.setClipRect(m_clip);
+            reader.setScaledSize(m_size);
+
+            QImage image = reader.read();
+            if (image.isNull())
+                qDebug() << "Can't decode background image: " << m_filename << m_clip << reader.errorString();
+
+            if (!isCancelled())
+                deliver(image, m_done);
+        }
+
+    private:
+        bool isCancelled() const
+        {
+            return m_cancelled->loadAcquire() || (m_tileCancelled && m_tileCancelled->loadAcquire());
+        }
+
+        static void deliver(const QImage& image, std::function<void(const QImage&)> done)
+        {
+            QMetaObject::invokeMethod(QCoreApplication::instance(), [done, image]() { done(image); }, Qt::QueuedConnection);
+        }
+
+        static QImage cut(const QImage& whole, const QRect& clip, const QSize& size)
+        {
+            if (whole.isNull())
+                return QImage();
+
+            // The part of the image is used in place (the whole image could be mapped from the disk, copying it
+            // for the top levels would bring all of it into memory), only the tile itself is made.
+            QRect rect = clip.isValid() ? clip.intersected(whole.rect()) : whole.rect();
+            if (rect.isEmpty())
+                return QImage();
+
+            QImage part;
+            if (whole.depth() >= 8)
+            {
+                part = QImage(whole.constScanLine(rect.top()) + rect.left() * (whole.depth() / 8),
+                              rect.width(), rect.height(), whole.bytesPerLine(), whole.format());
+                part.setColorTable(whole.colorTable());
+            }
+            else
+                part = whole.copy(rect);
+
+            // The tile shouldn't refer to the pixels of the whole image, which could be released before the tile.
+            return part.size() == size ? part.copy() : part.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        }
+
+        void decodeWhole(QImageReader& reader)
+        {
+            // The first job decodes the image. The others don't wait for it on the mutex (and don't hold the threads of the pool),
+            // they leave their requests, and the first job cuts their tiles, when the image is ready.
+            QImage whole;
+            bool decoded;
+            {
+                QMutexLocker locker (&m_source->mutex);
+                if (m_source->decoding)
+                {
+                    m_source->waiting.append({m_clip, m_size, m_tileCancelled, m_done});
+                    return;
+                }
+
+                decoded = m_source->decoded;
+                if (decoded)
+                    whole = m_source->image;
+                else
+                    m_source->decoding = true;
+            }
+
+            if (decoded)
+            {
+                if (!isCancelled())
+                    deliver(cut(whole, m_clip, m_size), m_done);
+                return;
+            }
+
+            if (!m_cancelled->loadAcquire())
+            {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+                AllocationLimit limit (reader.size());
+#endif
+                whole = reader.read();
+                if (whole.isNull())
+                    qDebug() << "Can't decode background image: " << m_filename << reader.errorString();
+            }
+
+            // The image is kept in memory for the next tiles, only if it fits into the memory budget of the background.
+            // Otherwise it's spilled into the mapped file. If even that fails, the image isn't decoded again
+            // (that would happen for every batch of tiles), the tiles, that aren't requested yet, show the preview.
+            bool fits = qint64(whole.width()) * whole.height() * whole.depth() / 8 / 1024 <= m_budget;
+
+            QScopedPointer<QTemporaryFile> spill;
+            QImage mapped;
+            if (!whole.isNull() && !fits && !m_cancelled->loadAcquire())
+            {
+                spill.reset(spillToDisk(whole));
+                if (spill)
+                    mapped = mappedImage(whole, spill.data());
+            }
+
+            QVector<TiledBackground::SourceImage::Request> waiting;
+            {
+                QMutexLocker locker (&m_source->mutex);
+                m_source->decoding = false;
+                if (!whole.isNull() && fits)
+                    m_source->image = whole;
+                else if (!mapped.isNull())
+                {
+                    m_source->spill.reset(spill.take());
+                    m_source->image = mapped;
+                }
+                else if (!whole.isNull())
+                    qWarning() << "Background image doesn't fit into the memory budget and can't be spilled to disk,"
+                               << "only its preview is shown: " << m_filename;
+
+                // The decoding, that was cancelled before the image was read, isn't done.
+                if (!m_cancelled->loadAcquire() || !whole.isNull())
+                    m_source->decoded = true;
+
+                waiting.swap(m_source->waiting);
+            }
+
+            if (m_cancelled->loadAcquire())
+                return;
+
+            for (const TiledBackground::SourceImage::Request& request : waiting)
+                if (!request.tileCancelled || !request.tileCancelled->loadAcquire())
+                    deliver(cut(whole, request.clip, request.size), request.done);
+
+            if (!isCancelled())
+                deliver(cut(whole, m_clip, m_size), m_done);
+        }
+
+        // Writes the pixels of the decoded image into the temporary file in the cache directory.
+        static QTemporaryFile* spillToDisk(const QImage& whole)
+        {
+            QString directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/backgrounds";
+            if (!QDir().mkpath(directory))
+                return nullptr;
+
+            QScopedPointer<QTemporaryFile> file (new QTemporaryFile(directory + "/background-XXXXXX.raw"));
+            if (!file->open())
+                return nullptr;
+
+            for (int y = 0; y < whole.height(); ++y)
+                if (file->write(reinterpret_cast<const char*>(whole.constScanLine(y)), whole.bytesPerLine()) != whole.bytesPerLine())
+                    return nullptr;
+
+            if (!file->flush())
+                return nullptr;
+
+            return file.take();
+        }
+
+        // The image over the mapped pixels (read only, so it's never detached into memory).
+        static QImage mappedImage(const QImage& whole, QTemporaryFile* spill)
+        {
+            const uchar* pixels = spill->map(0, qint64(whole.bytesPerLine()) * whole.height());
+            if (!pixels)
+                return QImage();
+
+            QImage image (pixels, whole.width(), whole.height(), whole.bytesPerLine(), whole.format());
+            image.setColorTable(whole.colorTable());
+
+            return image;
+        }
+
+        QString m_filename;
+        QRect m_clip;
+        QSize m_size;
+        QSharedPointer<QAtomicInt> m_cancelled;
+        QSharedPointer<QAtomicInt> m_tileCancelled;
+        QSharedPointer<TiledBackground::SourceImage> m_source;
+        int m_budget;
+        std::function<void(const QImage&)> m_done;
+    };
+}
+
+TiledBackground::TiledBackground(QGraphicsItem *parent)
+    : QGraphicsItem (parent)
+{
+    // We need the exact exposed rectangle to decode only the visible tiles.
+    setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+    setMemoryBudget(DEFAULT_BUDGET);
+
+    m_cancelled = QSharedPointer<QAtomicInt>::create(0);
+}
+
+TiledBackground::~TiledBackground()
+{
+    cancelDecoding();
+}
+
+void TiledBackground::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget)
+{
+    Q_UNUSED(widget);
+
+    if (m_imageSize.isEmpty())
+        return;
+
+    // Choose the level of the pyramid, that corresponds to the current scale of the view.
+    // Tiles of this level cover (TILE_SIZE * 2^level) pixels of original image each.
+    // Jobs of the tiles, that aren't visible anymore, are dropped, when the view is scrolled or zoomed.
+    QRectF visible = painter->worldTransform().inverted().mapRect(QRectF(painter->viewport())).intersected(boundingRect());
+    int level = levelFor(QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform()));
+    level = levelWithinBudget(level, visible);
+    int span = TILE_SIZE << level;
+
+    if (visible != m_visibleRect || level != m_visibleLevel)
+        cancelHiddenTiles(visible, level);
+
+    QRectF exposed = option->exposedRect.intersected(boundingRect());
+    if (exposed.isEmpty())
+        return;
+
+    int firstColumn = qFloor(exposed.left() / span);
+    int firstRow    = qFloor(exposed.top()  / span);
+    int lastColumn  = qCeil (exposed.right()  / span) - 1;
+    int lastRow     = qCeil (exposed.bottom() / span) - 1;
+
+    for (int row = firstRow; row <= lastRow; ++row)
+        for (int column = firstColumn; column <= lastColumn; ++column)
+        {
+            QPixmap* pixmap = m_tiles.object(keyFor(level, column, row));
+            if (pixmap)
+            {
+                painter->drawPixmap(QRectF(sourceRectFor(level, column, row)), *pixmap, QRectF(pixmap->rect()));
+                continue;
+            }
+
+            // The tile isn't decoded yet: show something coarser in its place and ask the pool for it.
+            drawFallback(painter, level, column, row);
+            requestTile(level, column, row);
+        }
+}
+
+QRectF TiledBackground::boundingRect() const
+{
+    return QRectF(QPointF(0, 0), m_imageSize);
+}
+
+bool TiledBackground::setSource(const QString &filename)
+{
+    // Only the header of the image is read here, the pixels are decoded in the thread pool.
+    QScopedPointer<QIODevice> device (MapBundle::openResource(filename));
+    QImageReader reader (device.data());
+    QSize size = reader.size();
+    if (!size.isValid())
+    {
+        qDebug() << "Can't read background image size: " << filename << reader.errorString();
+        return false;
+    }
+
+    setSource(filename, size, QImage());
+    return true;
+}
+
+void TiledBackground::setSource(const QString &filename, const QSize &imageSize, const QImage &preview)
+{
+    // Jobs of the previous source aren't needed anymore.
+    cancelDecoding();
+    m_cancelled = QSharedPointer<QAtomicInt>::create(0);
+    ++m_generation;
+
+    prepareGeometryChange();
+
+    m_source = filename;
+    m_imageSize = imageSize;
+    m_preview = QPixmap::fromImage(preview);
+    m_tiles.clear();
+    m_pendingTiles.clear();
+    m_failedTiles.clear();
+    m_visibleLevel = -1;
+    m_sourceImage = QSharedPointer<SourceImage>::create();
+
+    // The top level of the pyramid should fit into a single tile.
+    m_maxLevel = 0;
+    while ((qMax(m_imageSize.width(), m_imageSize.height()) >> m_maxLevel) > TILE_SIZE)
+        ++m_maxLevel;
+
+    // Preview goes first (with higher priority), so the user sees the map almost immediately.
+    if (m_preview.isNull())
+    {
+        QPointer<TiledBackground> self (this);
+        int generation = m_generation;
+        decode(QRect(), m_imageSize.scaled(PREVIEW_SIZE, PREVIEW_SIZE, Qt::KeepAspectRatio), 1, [self, generation](const QImage& image)
+        {
+            if (!self || self->m_generation != generation || image.isNull())
+                return;
+
+            self->updateTileBudget();
+            self->m_preview = QPixmap::fromImage(image);
+            self->update();
+        });
+    }
+
+    update();
+}
+
+const QString &TiledBackground::source() const
+{
+    return m_source;
+}
+
+const QSize &TiledBackground::imageSize() const
+{
+    return m_imageSize;
+}
+
+bool TiledBackground::hasPreview() const
+{
+    return !m_preview.isNull();
+}
+
+void TiledBackground::setMemoryBudget(int megabytes)
+{
+    m_memoryBudget = qMax(1, megabytes);
+    updateTileBudget();
+
+    // With the new budget these tiles may fit.
+    m_failedTiles.clear();
+}
+
+int TiledBackground::memoryBudget() const
+{
+    return m_memoryBudget;
+}
+
+void TiledBackground::trim(int megabytes)
+{
+    // The background isn't shown anymore, so its queued tiles aren't needed, and the results of running ones are dropped.
+    // The preview job (if any) goes on, the cached background needs it to be shown instantly.
+    for (const QSharedPointer<QAtomicInt>& cancelled : qAsConst(m_pendingTiles))
+        cancelled->storeRelease(1);
+    m_pendingTiles.clear();
+    m_visibleLevel = -1;
+
+    // The whole decoded image (of the formats without clip support) is way bigger than the tiles, so it goes first.
+    // Running jobs keep their own reference to it. The spilled image takes no memory, so it's kept (it isn't decoded again).
+    bool spilled;
+    {
+        QMutexLocker locker (&m_sourceImage->mutex);
+        spilled = !m_sourceImage->spill.isNull();
+    }
+
+    if (!spilled)
+        m_sourceImage = QSharedPointer<SourceImage>::create();
+
+    // QCache drops the least recently used tiles to fit into the new budget.
+    setMemoryBudget(megabytes);
+}
+
+int TiledBackground::memoryUsage() const
+{
+    int preview = m_preview.width() * m_preview.height() * m_preview.depth() / 8 / 1024;
+    return m_tiles.totalCost() + preview + sourceImageCost();
+}
+
+int TiledBackground::sourceImageCost() const
+{
+    if (!m_sourceImage)
+        return 0;
+
+    // The spilled image lives in the mapped file, the system pages it in and out.
+    QMutexLocker locker (&m_sourceImage->mutex);
+    if (!m_sourceImage->spill.isNull())
+        return 0;
+
+    const QImage& image = m_sourceImage->image;
+    return int(qint64(image.width()) * image.height() * image.depth() / 8 / 1024);
+}
+
+void TiledBackground::updateTileBudget()
+{
+    // The whole decoded image (if it's kept) takes its part of the budget, the tiles get the rest.
+    // QCache drops the least recently used tiles, when the budget gets smaller.
+    m_tiles.setMaxCost(qMax(TILE_SIZE * TILE_SIZE * 4 / 1024, m_memoryBudget * 1024 - sourceImageCost()));
+}
+
+int TiledBackground::levelFor(qreal scale) const
+{
+    // When the view is zoomed out by 2^n, the tiles of the n-th level have the same density as the screen.
+    if (scale <= 0.0f || scale >= 1.0f)
+        return 0;
+
+    int level = qFloor(std::log2(1.0f / scale));
+    return qBound(0, level, m_maxLevel);
+}
+
+int TiledBackground::levelWithinBudget(int level, const QRectF &visible) const
+{
+    // If the visible tiles don't fit into the budget together, each decoded tile would evict another visible one,
+    // and the view would request them again and again. So the coarser level is used in this case.
+    const int tileCost = TILE_SIZE * TILE_SIZE * 4 / 1024;
+    for (; level < m_maxLevel; ++level)
+    {
+        int span = TILE_SIZE << level;
+        qint64 columns = qCeil(visible.right()  / span) - qFloor(visible.left() / span) + 1;
+        qint64 rows    = qCeil(visible.bottom() / span) - qFloor(visible.top()  / span) + 1;
+        if (columns * rows * tileCost <= m_tiles.maxCost())
+            break;
+    }
+
+    return level;
+}
+
+quint64 TiledBackground::keyFor(int level, int column, int row) const
+{
+    return (quint64(level) << 48) | (quint64(row) << 24) | quint64(column);
+}
+
+QRect TiledBackground::sourceRectFor(int level, int column, int row) const
+{
+    int span = TILE_SIZE << level;
+
+    return QRect(column * span, row * span, span, span).intersected(QRect(QPoint(0, 0), m_imageSize));
+}
+
+bool TiledBackground::drawFallback(QPainter *painter, int level, int column, int row)
+{
+    QRect target = sourceRectFor(level, column, row);
+    if (target.isEmpty())
+        return false;
+
+    // Look for the closest coarser tile, that covers the same area, and draw the corresponding part of it.
+    for (int coarser = level + 1; coarser <= m_maxLevel; ++coarser)
+    {
+        int shift = coarser - level;
+        int parentColumn = column >> shift;
+        int parentRow    = row    >> shift;
+
+        QPixmap* parent = m_tiles.object(keyFor(coarser, parentColumn, parentRow));
+        if (!parent)
+            continue;
+
+        QRect parentRect = sourceRectFor(coarser, parentColumn, parentRow);
+        qreal factor = 1.0f / (1 << coarser);
+        QRectF source ((target.x() - parentRect.x()) * factor, (target.y() - parentRect.y()) * factor,
+                       target.width() * factor, target.height() * factor);
+
+        painter->drawPixmap(QRectF(target), *parent, source);
+        return true;
+    }
+
+    // There are no coarser tiles, so use the preview (if it's ready).
+    if (m_preview.isNull())
+        return false;
+
+    qreal fx = qreal(m_preview.width())  / m_imageSize.width();
+    qreal fy = qreal(m_preview.height()) / m_imageSize.height();
+    painter->drawPixmap(QRectF(target), m_preview, QRectF(target.x() * fx, target.y() * fy, target.width() * fx, target.height() * fy));
+
+    return true;
+}
+
+void TiledBackground::requestTile(int level, int column, int row)
+{
+    quint64 key = keyFor(level, column, row);
+    if (m_pendingTiles.contains(key) || m_failedTiles.contains(key))
+        return;
+
+    QRect source = sourceRectFor(level, column, row);
+    if (source.isEmpty())
+        return;
+
+    QSharedPointer<QAtomicInt> cancelled = QSharedPointer<QAtomicInt>::create(0);
+    m_pendingTiles.insert(key, cancelled);
+
+    // Decode only the part of the image, that is covered by this tile, already downscaled to the level resolution.
+    // Image handlers, that support these options (jpeg, for example), don't decode the whole image.
+    QSize size (qMax(1, qCeil(source.width()  / qreal(1 << level))),
+                qMax(1, qCeil(source.height() / qreal(1 << level))));
+
+    QPointer<TiledBackground> self (this);
+    int generation = m_generation;
+    decode(source, size, 0, [self, generation, key, source, cancelled](const QImage& image)
+    {
+        // The tile could be cancelled (and even requested again) after the job was finished.
+        if (!self || self->m_generation != generation || cancelled->loadAcquire())
+            return;
+
+        self->m_pendingTiles.remove(key);
+        if (image.isNull())
+        {
+            self->m_failedTiles.insert(key);
+            return;
+        }
+
+        // The whole image could be decoded for this tile, then it takes its part of the budget.
+        self->updateTileBudget();
+
+        QPixmap* pixmap = new QPixmap(QPixmap::fromImage(image));
+        int cost = qMax(1, pixmap->width() * pixmap->height() * pixmap->depth() / 8 / 1024);
+
+        // QCache takes the ownership and deletes the pixmap immediately, if it doesn't fit into budget.
+        // Requesting such tile again would decode it forever, so the fallback stays in its place.
+        if (!self->m_tiles.insert(key, pixmap, cost))
+        {
+            self->m_failedTiles.insert(key);
+            return;
+        }
+
+        self->update(QRectF(source));
+    }, cancelled);
+}
+
+void TiledBackground::cancelHiddenTiles(const QRectF &visible, int level)
+{
+    m_visibleRect = visible;
+    m_visibleLevel = level;
+
+    // Only the tiles of the current level, that intersect the view, are worth decoding.
+    for (auto it = m_pendingTiles.begin(); it != m_pendingTiles.end(); )
+    {
+        int tileLevel  = int(it.key() >> 48);
+        int tileRow    = int((it.key() >> 24) & 0xFFFFFF);
+        int tileColumn = int(it.key() & 0xFFFFFF);
+
+        if (tileLevel == level && QRectF(sourceRectFor(tileLevel, tileColumn, tileRow)).intersects(visible))
+        {
+            ++it;
+            continue;
+        }
+
+        it.value()->storeRelease(1);
+        it = m_pendingTiles.erase(it);
+    }
+}
+
+void TiledBackground::decode(const QRect &clip, const QSize &size, int priority, std::function<void (const QImage &)> done,
+                             const QSharedPointer<QAtomicInt>& cancelled)
+{
+    decoderPool()->start(new DecodeJob(m_source, clip, size, m_cancelled, cancelled, m_sourceImage, m_memoryBudget * 1024, done), priority);
+}
+
+void TiledBackground::cancelDecoding()
+{
+    // Queued jobs will return without decoding, the results of running ones will be dropped.
+    if (m_cancelled)
+        m_cancelled->storeRelease(1);
+}
@@ -0,0 +1,116 @@
+#ifndef TILEDBACKGROUND_H
+#define TILEDBACKGROUND_H
+
+#include <QObject>
+#include <QGraphicsItem>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <QPixmap>
+#include <QImage>
+#include <QCache>
+#include <QSize>
+#include <QHash>
+#include <QSet>
+
+#include <functional>
+
+// TiledBackground is used to draw the background map instead of one giant QPixmap.
+// Our world maps are about 30k x 20k pixels, so a single pixmap blows past both memory and texture limits.
+// Instead of this, the image is represented as a pyramid of square tiles:
+// - level 0 contains the tiles of original resolution,
+// - each next level is downscaled twice, so the top level fits into a single tile.
+// When painting, we choose the level, that matches the current scale of the view,
+// and decode \ paint only the tiles, that intersect the exposed rectangle.
+// Decoded tiles are stored in LRU cache, that is limited by configurable memory budget.
+//
+// Decoding never happens on GUI thread:
+// 1. When the source is set, the low resolution preview is decoded first and stretched over the whole map
+//    (unless it is passed together with the source, e.g. by the prefetcher of local maps).
+// 2. Missing tiles are requested from the thread pool, while they are decoding, coarser tiles or preview are drawn instead.
+// 3. When the source is replaced (or the item is removed), all the pending jobs are cancelled.
+//    Jobs of the tiles, that have left the view (or belong to another level), are cancelled on the next paint.
+//
+// Formats like jpeg decode the part of the image, that is covered by a tile, but the others (png, for example)
+// can only decode the whole image. For them the image is decoded once per source and the tiles are cut from it:
+// - the whole image, that fits into the memory budget, is kept in memory and counted in the budget;
+// - the larger one is spilled into the temporary file, which is mapped, and the decoded image is released,
+//   so the tiles are cut from the pages, that the system brings in (it stays, when the background is trimmed);
+// - if it can't be spilled, it isn't decoded again: only the preview is shown, and the failure is reported.
+
+class TiledBackground : public QObject, public QGraphicsItem
+{
+    Q_OBJECT
+
+public:
+    static constexpr int TILE_SIZE = 256;
+    static constexpr int PREVIEW_SIZE = 1024;
+    static constexpr int DEFAULT_BUDGET = 256; // megabytes
+
+    TiledBackground(QGraphicsItem* parent = nullptr);
+    ~TiledBackground();
+
+    void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget = Q_NULLPTR) override;
+    QRectF boundingRect() const override;
+
+    bool setSource (const QString& filename);
+    void setSource (const QString& filename, const QSize& imageSize, const QImage& preview);
+    const QString& source() const;
+    const QSize& imageSize() const;
+    bool hasPreview() const;
+
+    void setMemoryBudget (int megabytes);
+    int memoryBudget() const;
+
+    // Keeps only the preview and the most recent tiles, that fit into the given budget (e.g. before caching the background).
+    // Pending tile jobs are cancelled, the tiles are requested again, when the background is painted.
+    // The restored budget is applied by setMemoryBudget.
+    void trim (int megabytes);
+
+    // Memory, that is taken by the preview, decoded tiles and the whole decoded image (in kilobytes).
+    int memoryUsage() const;
+
+    // The whole image, decoded once for the formats, that can't decode a part of it.
+    struct SourceImage;
+
+private:
+    int levelFor (qreal scale) const;
+    int levelWithinBudget (int level, const QRectF& visible) const;
+    quint64 keyFor (int level, int column, int row) const;
+    QRect sourceRectFor (int level, int column, int row) const;
+
+    bool drawFallback (QPainter* painter, int level, int column, int row);
+    void requestTile (int level, int column, int row);
+    void cancelHiddenTiles (const QRectF& visible, int level);
+    void decode (const QRect& clip, const QSize& size, int priority, std::function<void(const QImage&)> done,
+                 const QSharedPointer<QAtomicInt>& cancelled = QSharedPointer<QAtomicInt>());
+    void cancelDecoding();
+    int sourceImageCost() const;
+    void updateTileBudget();
+
+    QString m_source;
+    QSize m_imageSize;
+    int m_maxLevel = 0;
+
+    // Low resolution image of the whole map, that is shown, until the tiles are ready.
+    QPixmap m_preview;
+
+    // Tiles are keyed by {level, column, row}, cost is measured in kilobytes.
+    // They get the part of the budget, that isn't taken by the whole decoded image.
+    QCache<quint64, QPixmap> m_tiles;
+    int m_memoryBudget = DEFAULT_BUDGET;
+
+    // Each pending tile has its own flag, so the job could be dropped, when the tile isn't visible anymore.
+    QHash<quint64, QSharedPointer<QAtomicInt>> m_pendingTiles;
+    QRectF m_visibleRect;
+    int m_visibleLevel = -1;
+
+    // Tiles, that couldn't be decoded or cached, aren't requested again, the fallback is drawn instead.
+    QSet<quint64> m_failedTiles;
+
+    // Each source gets its own flag, so the jobs of replaced source stop as soon as possible.
+    QSharedPointer<QAtomicInt> m_cancelled;
+    QSharedPointer<SourceImage> m_sourceImage;
+    int m_generation = 0;
+};
+
+#endif // TILEDBACKGROUND_H
@@ -1,7 +1,7 @@
 #include "details.h"
 
 #include <QPainter>
-#include <QDebug>
+#include <QFileInfo>
 
 Details::Details(QGraphicsItem* parent)
     : QGraphicsRectItem(parent)
@@ -9,8 +9,6 @@ Details::Details(QGraphicsItem* parent)
     defaults();
     makeUI();
     hide();
-
-    prepareAnimation();
 }
 
 Details::~Details()
@@ -37,6 +35,15 @@ QPainterPath Details::shape() const
     return m_shape;
 }
 
+QVariant Details::itemChange(QGraphicsItem::GraphicsItemChange change, const QVariant &value)
+{
+    // Hidden panel doesn't need to be animated at all.
+    if (change == ItemVisibleHasChanged)
+        updateAnimation();
+
+    return QGraphicsRectItem::itemChange(change, value);
+}
+
 void Details::setFont(const QFont& font)
 {
     m_detailsText->setFont(font);
@@ -59,12 +66,12 @@ void Details::setRegionOfInterest(RegionOfInterest *roi)
 {
     m_roi = roi;
 
+    // The text of the previous region is dropped, the text of this one comes with {setContents}.
+    m_detailsText->setText(QString());
     if (m_roi)
-    {
-        m_detailsText->setPlainText(m_roi->details());
         m_detailsText->setToolTip(m_roi->attachedFile());
-    }
 
+    updateAnimation();
     update();
 }
 
@@ -74,20 +81,8 @@ bool Details::containsAllTheText()
     if (!m_roi)
         return true;
 
-    int symbols_total = m_roi->details().size();
-    int char_width  = QFontMetrics(m_detailsText->font()).averageCharWidth();
-    int char_height = QFontMetrics(m_detailsText->font()).height();
-    int symbols_per_line = m_detailsText->textWidth() / char_width; // px size
-
-    int lines = symbols_total / symbols_per_line;
-    int maxLines = m_detailsText->boundingRect().height() / char_height;
-
-    qDebug() << "SPL:" << symbols_per_line;
-    qDebug() << "Lines: " << lines;
-    qDebug() << "DTBR: " << m_detailsText->boundingRect();
-    qDebug() << "Can contain: " << maxLines;
-
-    return (lines <= maxLines);
+    // The height of the text is estimated, until its paragraphs are laid out (the ones in the panel are laid out right away).
+    return m_detailsText->boundingRect().height() <= m_detailsRect.height();
 }
 
 bool Details::textIsMoving()
@@ -143,9 +138,15 @@ void Details::moveTo(qreal x, qreal y, bool updateText)
     update();
 }
 
-void Details::updateContents()
+void Details::setContents(const QString &text)
 {
-    m_detailsText->setPlainText(m_roi->details());
+    // HTML legends are shown as rich text, the others as plain text.
+    QString suffix = m_roi ? QFileInfo(m_roi->attachedFile()).suffix().toLower() : QString();
+    if (suffix == "html" || suffix == "htm")
+        m_detailsText->setHtml(text);
+    else
+        m_detailsText->setText(text);
+
     update();
 }
 
@@ -204,18 +205,26 @@ void Details::createShape(const Details::Shape &shape)
                            m_shape.boundingRect().height() - 40 - 20);
 }
 
-void Details::prepareAnimation()
+void Details::updateAnimation()
+{
+    // The text, that fits into the panel, is not scrolled (and not repainted) at all.
+    if (isVisible() && m_roi && m_detailsText->isLaidOut() && !containsAllTheText())
+        startAnimation(FPS);
+    else
+        stopAnimation();
+}
+
+void Details::onTextLaidOut()
 {
-    int fps = 30;
+    // The text, that fits, stays at the top of the panel.
+    if (containsAllTheText())
+        m_detailsText->setPos(m_detailsRect.topLeft());
 
-    connect(&m_animationTimer, SIGNAL(timeout()), this, SLOT(onAnimationTick()));
-    m_animationTimer.start(1000/fps);
+    updateAnimation();
 }
 
 void Details::onAnimationTick()
 {
-    // if (containsAllTheText()) return;
-
     // these are called once each timer tick (currently at 30 fps)
     moveTextBy(0.0f, -0.3f);
 
@@ -252,4 +261,6 @@ void Details::makeText()
     m_detailsText = new DetailsText(m_detailsRect, this);
     m_detailsText->setPos(m_detailsRect.topLeft());
     m_detailsText->setTextWidth(m_shape.boundingRect().width());
+
+    connect(m_detailsText, SIGNAL(laidOut()), this, SLOT(onTextLaidOut()));
 }
@@ -8,6 +8,7 @@
 
 #include "../regionofinterest.h"
 #include "../helpers/qgraphicsbuttonitem.h"
+#include "../helpers/animationclock.h"
 #include "detailstext.h"
 
 // Details class represents rectangle item, that is used to draw the legend data from the file. It should:
@@ -15,7 +16,7 @@
 // 2.                  to store the text
 // 3.                  to replace the text
 
-class Details : public QObject, public QGraphicsRectItem
+class Details : public QObject, public QGraphicsRectItem, public Animated
 {
     Q_OBJECT
 
@@ -28,6 +29,7 @@ public:
     void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget = Q_NULLPTR) override;
     QRectF boundingRect() const override;
     QPainterPath shape() const override;
+    QVariant itemChange(GraphicsItemChange change, const QVariant &value) override;
 
     // Region specifics
     void setFont  (const QFont& font);
@@ -42,8 +44,8 @@ public:
     void moveTextBy(qreal dx, qreal dy);
     void moveTo(qreal x, qreal y, bool updateText);
 
-    // Contents update
-    void updateContents();
+    // Contents update (the text of the attached region is passed, when the loader delivers it)
+    void setContents (const QString& text);
 
     // Buttons
     QGraphicsButtonItem* moveUpButton();
@@ -78,12 +80,15 @@ private:
     // Background and Foreground
     QColor m_backgroundColor = "#bbb";
 
-    // Animation
-    void prepareAnimation();
-    QTimer m_animationTimer;
+    // Animation (the text scrolls only while the panel is visible and shows some region)
+    static constexpr int FPS = 30;
+    void updateAnimation();
+
+public:
+    void onAnimationTick() override;
 
 public slots:
-    void onAnimationTick();
+    void onTextLaidOut();
 };
 
 #endif // DETAILS_H
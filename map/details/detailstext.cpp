@@ -1,29 +1,416 @@
 #include "detailstext.h"
 
+#include <QStyleOptionGraphicsItem>
+#include <QAbstractTextDocumentLayout>
+#include <QCryptographicHash>
+#include <QCoreApplication>
+#include <QFontMetricsF>
+#include <QRunnable>
+#include <QMutex>
+#include <QPointer>
 #include <QPainter>
-#include <QDebug>
+
+#include <algorithm>
+#include <functional>
+
+namespace
+{
+    // Paragraph indices and documents of the recently shown legends (cost is in bytes).
+    // Documents are shared with the items, that show them, so they outlive the eviction, while they are shown.
+    struct LayoutCache
+    {
+        QMutex mutex;
+        QCache<QString, DetailsText::Paragraphs> indices {16 * 1024 * 1024};
+        QCache<QString, QSharedPointer<QTextDocument>> documents {32 * 1024 * 1024};
+    };
+
+    Q_GLOBAL_STATIC(LayoutCache, layoutCache)
+
+    // LayoutJob indexes the paragraphs of plain text or lays out rich text (or takes them from the cache).
+    class LayoutJob : public QRunnable
+    {
+    public:
+        typedef std::function<void(const DetailsText::Layout&)> Done;
+
+        LayoutJob(const QString& text, bool rich, const QFont& font, qreal width, Done done)
+            : m_text(text), b_rich(rich), m_font(font), m_width(width), m_done(done)
+        {
+        }
+
+        void run() override
+        {
+            // The key doesn't depend on the length of the text.
+            QString hash = QCryptographicHash::hash(m_text.toUtf8(), QCryptographicHash::Md5).toHex();
+
+            DetailsText::Layout layout;
+            if (b_rich)
+                layout.document = document(QString("%1:%2:%3").arg(hash).arg(m_font.key()).arg(m_width));
+            else
+                layout.paragraphs = paragraphs(hash);
+
+            Done done = m_done;
+            QMetaObject::invokeMethod(QCoreApplication::instance(), [done, layout]() { done(layout); }, Qt::QueuedConnection);
+        }
+
+    private:
+        DetailsText::Paragraphs paragraphs(const QString& key)
+        {
+            {
+                QMutexLocker locker (&layoutCache->mutex);
+                if (DetailsText::Paragraphs* cached = layoutCache->indices.object(key))
+                    return *cached;
+            }
+
+            DetailsText::Paragraphs paragraphs = DetailsText::index(m_text);
+
+            QMutexLocker locker (&layoutCache->mutex);
+            int cost = qMax(1, paragraphs.size() * int(sizeof(DetailsText::Paragraph)));
+            layoutCache->indices.insert(key, new DetailsText::Paragraphs(paragraphs), cost);
+
+            return paragraphs;
+        }
+
+        QSharedPointer<QTextDocument> document(const QString& key)
+        {
+            {
+                QMutexLocker locker (&layoutCache->mutex);
+                if (QSharedPointer<QTextDocument>* cached = layoutCache->documents.object(key))
+                    return *cached;
+            }
+
+            // The document is parsed and laid out here, then it is handed over to the GUI thread
+            // (and deleted there, when neither the cache nor the items need it).
+            QTextDocument* document = new QTextDocument();
+            document->setDefaultFont(m_font);
+            document->setTextWidth(m_width);
+            document->setHtml(m_text);
+            document->size();
+            document->moveToThread(QCoreApplication::instance()->thread());
+
+            QSharedPointer<QTextDocument> shared (document, &QObject::deleteLater);
+
+            // The document takes roughly a few times more, than its source.
+            QMutexLocker locker (&layoutCache->mutex);
+            int cost = qMax(1, m_text.size() * int(sizeof(QChar)) * 4);
+            layoutCache->documents.insert(key, new QSharedPointer<QTextDocument>(shared), cost);
+
+            return shared;
+        }
+
+        QString m_text;
+        bool b_rich;
+        QFont m_font;
+        qreal m_width;
+        Done m_done;
+    };
+}
 
 DetailsText::DetailsText(const QRectF& bounds, QGraphicsItem* parent)
-    : QGraphicsTextItem(parent)
+    : QGraphicsObject(parent)
 {
     m_bounds = bounds;
 
+    // Only the exposed paragraphs are drawn, the paragraphs are laid out, when the text is moved through the window.
+    setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+    setFlag(QGraphicsItem::ItemSendsGeometryChanges);
+
+    // Legends are indexed one at a time, the latest one wins.
+    m_pool.setMaxThreadCount(1);
 }
 
 DetailsText::~DetailsText()
 {
+    ++m_generation;
+    m_pool.clear();
+    m_pool.waitForDone();
+}
 
+QRectF DetailsText::boundingRect() const
+{
+    return QRectF(0.0f, 0.0f, m_width, m_height);
 }
 
 void DetailsText::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget)
 {
-    painter->setFont(font());
+    Q_UNUSED(widget);
+
+    QRectF exposed = option->exposedRect.intersected(boundingRect());
+    if (exposed.isEmpty())
+        return;
+
+    // Rich text is painted right from the laid out document, only its exposed part.
+    if (m_document)
+    {
+        QAbstractTextDocumentLayout::PaintContext context;
+        context.clip = exposed;
+        context.palette.setColor(QPalette::Text, m_foregroundColor);
+
+        painter->save();
+        painter->setClipRect(exposed, Qt::IntersectClip);
+        m_document->documentLayout()->draw(painter, context);
+        painter->restore();
+        return;
+    }
+
+    if (m_paragraphs.isEmpty())
+        return;
+
+    painter->save();
+    painter->setRenderHint(QPainter::TextAntialiasing);
     painter->setPen(m_foregroundColor);
 
-    painter->drawText(boundingRect(), toPlainText(), QTextOption(Qt::AlignHCenter));
+    // The paragraphs outside of the window (if the panel shows them) are drawn at their estimated place.
+    for (int index = paragraphAt(exposed.top()); index < m_paragraphs.size() && m_tops.at(index) < exposed.bottom(); ++index)
+    {
+        if (QTextLayout* layout = paragraphLayout(index))
+            layout->draw(painter, QPointF(0.0f, m_tops.at(index)));
+    }
+
+    painter->restore();
+}
+
+QVariant DetailsText::itemChange(GraphicsItemChange change, const QVariant &value)
+{
+    // Scrolling moves the item, so the paragraphs, that come into the window, are laid out.
+    if (change == QGraphicsItem::ItemPositionHasChanged)
+        layoutWindow();
+
+    return QGraphicsObject::itemChange(change, value);
+}
+
+void DetailsText::setText(const QString &text)
+{
+    setContents(text, false);
+}
+
+void DetailsText::setHtml(const QString &html)
+{
+    setContents(html, true);
+}
+
+void DetailsText::setContents(const QString &text, bool rich)
+{
+    if (text == m_text && rich == b_rich)
+        return;
+
+    m_text = text;
+    b_rich = rich;
+    rebuild();
+}
+
+void DetailsText::setFont(const QFont &font)
+{
+    m_font = font;
+    rebuild();
+}
+
+const QFont &DetailsText::font() const
+{
+    return m_font;
+}
+
+void DetailsText::setTextWidth(qreal width)
+{
+    m_width = width;
+    rebuild();
+}
+
+qreal DetailsText::textWidth() const
+{
+    return m_width;
 }
 
 void DetailsText::setForeground(const QColor &color)
 {
     m_foregroundColor = color;
+    update();
+}
+
+bool DetailsText::isLaidOut() const
+{
+    return !m_paragraphs.isEmpty() || !m_document.isNull();
+}
+
+DetailsText::Paragraphs DetailsText::index(const QString &text)
+{
+    Paragraphs paragraphs;
+
+    int start = 0;
+    while (start <= text.size())
+    {
+        int end = text.indexOf(QLatin1Char('\n'), start);
+        if (end < 0)
+            end = text.size();
+
+        int length = end - start;
+        if (length > 0 && text.at(end - 1) == QLatin1Char('\r'))
+            --length;
+
+        paragraphs.append({start, length});
+        start = end + 1;
+    }
+
+    return paragraphs;
+}
+
+qreal DetailsText::layoutParagraph(QTextLayout &layout, qreal width)
+{
+    // Lines are wrapped by words and centered, as the legends were always drawn.
+    layout.setTextOption(QTextOption(Qt::AlignHCenter));
+
+    qreal height = 0.0f;
+    layout.beginLayout();
+    for (QTextLine line = layout.createLine(); line.isValid(); line = layout.createLine())
+    {
+        line.setLineWidth(width);
+        line.setPosition(QPointF(0.0f, height));
+        height += line.height();
+    }
+    layout.endLayout();
+
+    return height;
+}
+
+void DetailsText::rebuild()
+{
+    // The previous layout is outdated, nothing is drawn, until the new one is ready.
+    prepareGeometryChange();
+    m_document.clear();
+    m_paragraphs.clear();
+    m_heights.clear();
+    m_tops.clear();
+    m_exact.clear();
+    m_layouts.clear();
+    m_height = 0.0f;
+
+    int generation = ++m_generation;
+    m_pool.clear();
+
+    if (m_text.isEmpty())
+        return;
+
+    QPointer<DetailsText> self (this);
+    m_pool.start(new LayoutJob(m_text, b_rich, m_font, m_width, [self, generation](const Layout& layout)
+    {
+        if (!self || self->m_generation != generation)
+            return;
+
+        self->prepareGeometryChange();
+        self->m_document = layout.document;
+        self->m_paragraphs = layout.paragraphs;
+
+        if (layout.document)
+            self->m_height = layout.document->size().height();
+        else
+            self->estimate();
+
+        self->layoutWindow();
+        self->update();
+        emit self->laidOut();
+    }));
+}
+
+void DetailsText::estimate()
+{
+    // Nothing is shaped here: the paragraph takes as many lines, as the characters of average width need.
+    QFontMetricsF metrics (m_font);
+    int perLine = qMax(1, int(m_width / qMax<qreal>(1.0f, metrics.averageCharWidth())));
+
+    int count = m_paragraphs.size();
+    m_heights.resize(count);
+    m_tops.resize(count + 1);
+    m_exact = QBitArray(count);
+
+    m_tops[0] = 0.0f;
+    for (int index = 0; index < count; ++index)
+    {
+        int lines = qMax(1, (m_paragraphs.at(index).length + perLine - 1) / perLine);
+        m_heights[index] = lines * metrics.height();
+        m_tops[index + 1] = m_tops.at(index) + m_heights.at(index);
+    }
+
+    m_height = m_tops.last();
+}
+
+void DetailsText::layoutWindow()
+{
+    if (b_layingOut || m_paragraphs.isEmpty() || m_width <= 0.0f)
+        return;
+
+    b_layingOut = true;
+
+    // Moving the text could bring more paragraphs into the window, so it's repeated (a few times at most).
+    for (int pass = 0; pass < 4; ++pass)
+    {
+        QRectF window = mapRectFromParent(m_bounds);
+        int count = m_paragraphs.size();
+        int first = paragraphAt(window.top());
+
+        // The growth of the paragraphs, that are laid out above the first one, that was laid out before (the anchor).
+        int anchor = -1;
+        qreal above = 0.0f;
+        bool changed = false;
+
+        int index = first;
+        for (; index < count && m_tops.at(index) < window.bottom(); ++index)
+        {
+            if (m_exact.testBit(index))
+            {
+                if (anchor < 0)
+                    anchor = index;
+            }
+            else if (QTextLayout* layout = paragraphLayout(index))
+            {
+                QTextLine last = layout->lineAt(layout->lineCount() - 1);
+                qreal height = last.isValid() ? last.y() + last.height() : 0.0f;
+                if (anchor < 0)
+                    above += height - m_heights.at(index);
+
+                m_heights[index] = height;
+                m_exact.setBit(index);
+                changed = true;
+            }
+
+            m_tops[index + 1] = m_tops.at(index) + m_heights.at(index);
+        }
+
+        if (!changed)
+            break;
+
+        // The paragraphs below the window are only shifted.
+        for (; index < count; ++index)
+            m_tops[index + 1] = m_tops.at(index) + m_heights.at(index);
+
+        prepareGeometryChange();
+        m_height = m_tops.last();
+
+        // The lines, that were shown already, stay in place.
+        if (anchor > first && !qFuzzyIsNull(above))
+            moveBy(0.0f, -above);
+
+        update();
+    }
+
+    b_layingOut = false;
+}
+
+int DetailsText::paragraphAt(qreal y) const
+{
+    // The tops are sorted, the paragraph is the last one, that starts above y.
+    int index = int(std::upper_bound(m_tops.constBegin(), m_tops.constEnd(), y) - m_tops.constBegin()) - 1;
+    return qBound(0, index, m_paragraphs.size() - 1);
+}
+
+QTextLayout* DetailsText::paragraphLayout(int index)
+{
+    if (QTextLayout* cached = m_layouts.object(index))
+        return cached;
+
+    // The paragraph longer than the budget evicts all the others, but it is still kept, while it's shown.
+    const Paragraph& paragraph = m_paragraphs.at(index);
+    QTextLayout* layout = new QTextLayout(m_text.mid(paragraph.start, paragraph.length), m_font);
+    layoutParagraph(*layout, m_width);
+
+    m_layouts.insert(index, layout, qBound(1, paragraph.length, LAYOUT_BUDGET));
+    return layout;
 }
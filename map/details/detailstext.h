@@ -1,22 +1,108 @@
 #ifndef DETAILSTEXT_H
 #define DETAILSTEXT_H
 
-#include <QGraphicsTextItem>
+#include <QGraphicsObject>
+#include <QSharedPointer>
+#include <QTextDocument>
+#include <QThreadPool>
+#include <QTextLayout>
+#include <QBitArray>
+#include <QVector>
+#include <QCache>
+#include <QFont>
 
-class DetailsText : public QGraphicsTextItem
+// DetailsText draws the legend text of the details panel. The legends could be huge, so the text is virtualized:
+// - only the paragraph index (the offsets of the paragraphs in the text, that is the positions of the newlines)
+//   is built off the GUI thread, so setting the text costs the same for the legends of any length;
+//   the index doesn't depend on the font and the width, it is cached for each text ({laidOut} is emitted, when it's ready);
+// - the paragraphs are laid out, when they get into the visible window (the bounds of the panel), and their layouts
+//   are kept in LRU cache, that is limited by LAYOUT_BUDGET characters; the paragraphs, that weren't shown yet,
+//   have the estimated height, so the height of the text gets exact, as it is scrolled;
+// - when the paragraphs, that come into the window from the top, are laid out, the text is moved by their change of height,
+//   so the lines, that are shown already, stay in place;
+// - painting draws only the laid out paragraphs, that intersect the exposed part.
+// HTML legends are parsed and laid out into QTextDocument off the GUI thread as well. The documents are kept
+// in the LRU cache with the budget in bytes, so selecting the region again doesn't parse its legend again,
+// and only the exposed part of the document is painted.
+
+class DetailsText : public QGraphicsObject
 {
+    Q_OBJECT
+
 public:
+    // Paragraph: its place in the text (without the line break).
+    struct Paragraph
+    {
+        int start;
+        int length;
+    };
+    typedef QVector<Paragraph> Paragraphs;
+
+    // Indexed text: the paragraphs of plain text or the document of rich text.
+    struct Layout
+    {
+        Paragraphs paragraphs;
+        QSharedPointer<QTextDocument> document;
+    };
+
     DetailsText(const QRectF& bounds, QGraphicsItem* parent = nullptr);
     ~DetailsText();
 
+    QRectF boundingRect() const override;
     void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget) override;
 
+    void setText(const QString& text);
+    void setHtml(const QString& html);
+    void setFont(const QFont& font);
+    const QFont& font() const;
+    void setTextWidth(qreal width);
+    qreal textWidth() const;
     void setForeground(const QColor& color);
+    bool isLaidOut() const;
+
+    // Splits the text into paragraphs by the newlines (could be called from any thread).
+    static Paragraphs index (const QString& text);
+    static qreal layoutParagraph (QTextLayout& layout, qreal width);
+
+protected:
+    QVariant itemChange(GraphicsItemChange change, const QVariant &value) override;
 
 private:
+    void setContents(const QString& text, bool rich);
+    void rebuild();
+    void estimate();
+    void layoutWindow();
+    int paragraphAt (qreal y) const;
+    QTextLayout* paragraphLayout (int index);
+
     QRectF m_bounds;
 
     QColor m_foregroundColor;
+    QFont  m_font;
+    qreal  m_width = 0.0f;
+
+    QString m_text;
+    bool b_rich = false;
+    QSharedPointer<QTextDocument> m_document;
+    qreal m_height = 0.0f;
+
+    // The paragraphs, their heights (exact for the laid out ones) and tops (one more, the last one is the height of the text).
+    Paragraphs m_paragraphs;
+    QVector<qreal> m_heights;
+    QVector<qreal> m_tops;
+    QBitArray m_exact;
+    bool b_layingOut = false;
+
+    // Cost is measured in characters.
+    static constexpr int LAYOUT_BUDGET = 256 * 1024;
+    QCache<int, QTextLayout> m_layouts {LAYOUT_BUDGET};
+
+    // Results of the jobs, started before the last change of text, are dropped.
+    QThreadPool m_pool;
+    int m_generation = 0;
+
+signals:
+    void laidOut();
 };
 
 #endif // DETAILSTEXT_H
@@ -0,0 +1,125 @@
+#include "animationclock.h"
+
+#include <limits>
+
+Q_GLOBAL_STATIC(AnimationClock, globalClock)
+
+// Animated
+Animated::~Animated()
+{
+    // Objects could be destroyed on application exit, when the clock is already gone.
+    if (globalClock.exists())
+        globalClock->unsubscribe(this);
+}
+
+void Animated::startAnimation(int fps)
+{
+    AnimationClock::instance()->subscribe(this, fps);
+}
+
+void Animated::stopAnimation()
+{
+    if (globalClock.exists())
+        globalClock->unsubscribe(this);
+}
+
+bool Animated::isAnimating() const
+{
+    return globalClock.exists() && globalClock->isSubscribed(const_cast<Animated*>(this));
+}
+
+// AnimationClock
+AnimationClock::AnimationClock(QObject *parent)
+    : QObject(parent)
+{
+    m_clock.start();
+
+    m_timer.setSingleShot(true);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(onTimeout()));
+}
+
+AnimationClock::~AnimationClock()
+{
+    m_timer.stop();
+}
+
+AnimationClock *AnimationClock::instance()
+{
+    return globalClock();
+}
+
+void AnimationClock::subscribe(Animated *target, int fps)
+{
+    if (!target || fps <= 0)
+        return;
+
+    // Subscribing again just changes the frame rate.
+    int interval = qMax(1, 1000 / fps);
+    Subscription subscription {interval, m_clock.elapsed() + interval};
+
+    m_subscriptions.insert(target, subscription);
+    schedule();
+}
+
+void AnimationClock::unsubscribe(Animated *target)
+{
+    if (m_subscriptions.remove(target) == 0)
+        return;
+
+    schedule();
+}
+
+bool AnimationClock::isSubscribed(Animated *target) const
+{
+    return m_subscriptions.contains(target);
+}
+
+int AnimationClock::subscribers() const
+{
+    return m_subscriptions.size();
+}
+
+bool AnimationClock::isIdle() const
+{
+    return !m_timer.isActive();
+}
+
+void AnimationClock::schedule()
+{
+    if (m_subscriptions.isEmpty())
+    {
+        m_timer.stop();
+        return;
+    }
+
+    qint64 nearest = std::numeric_limits<qint64>::max();
+    for (auto it = m_subscriptions.constBegin(); it != m_subscriptions.constEnd(); ++it)
+        nearest = qMin(nearest, it.value().nextTick);
+
+    m_timer.start(int(qMax<qint64>(0, nearest - m_clock.elapsed())));
+}
+
+void AnimationClock::onTimeout()
+{
+    qint64 now = m_clock.elapsed();
+
+    // Subscribers could subscribe or unsubscribe (themselves or others) inside of the tick,
+    // so iterate over the copy and check, whether each of them is still here.
+    const QList<Animated*> targets = m_subscriptions.keys();
+    for (Animated* target : targets)
+    {
+        auto it = m_subscriptions.find(target);
+        if (it == m_subscriptions.end() || it.value().nextTick > now)
+            continue;
+
+        // If the subscriber fell behind (for example, GUI thread was busy), don't try to catch up.
+        it.value().nextTick += it.value().interval;
+        if (it.value().nextTick <= now)
+            it.value().nextTick = now + it.value().interval;
+
+        target->onAnimationTick();
+    }
+
+    schedule();
+}
@@ -0,0 +1,65 @@
+#ifndef ANIMATIONCLOCK_H
+#define ANIMATIONCLOCK_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QHash>
+
+// Animated is the base for everything, that is driven by the shared animation clock
+// (active regions, scrolling details, playing spritesheets).
+// Instead of owning a timer, the object subscribes to the clock only while it is really animating,
+// and the clock calls {onAnimationTick} with the requested frame rate.
+
+class Animated
+{
+public:
+    virtual ~Animated();
+
+    virtual void onAnimationTick() = 0;
+
+    void startAnimation (int fps);
+    void stopAnimation ();
+    bool isAnimating () const;
+};
+
+// AnimationClock is the single timer of the application.
+// - each subscriber has its own interval, so 14 fps regions and 30 fps details could be driven together;
+// - the timer is single shot and always scheduled to the nearest subscriber, so there are no idle wakeups;
+// - when there are no subscribers, the timer is stopped completely.
+
+class AnimationClock : public QObject
+{
+    Q_OBJECT
+
+public:
+    AnimationClock(QObject* parent = nullptr);
+    ~AnimationClock();
+
+    static AnimationClock* instance();
+
+    void subscribe (Animated* target, int fps);
+    void unsubscribe (Animated* target);
+    bool isSubscribed (Animated* target) const;
+
+    int subscribers() const;
+    bool isIdle() const;
+
+private:
+    struct Subscription
+    {
+        int interval;
+        qint64 nextTick;
+    };
+
+    void schedule();
+
+    QHash<Animated*, Subscription> m_subscriptions;
+    QElapsedTimer m_clock;
+    QTimer m_timer;
+
+public slots:
+    void onTimeout();
+};
+
+#endif // ANIMATIONCLOCK_H
@@ -0,0 +1,322 @@
+#ifndef QUADTREE_H
+#define QUADTREE_H
+
+#include <QRectF>
+#include <QVector>
+#include <QHash>
+#include <QList>
+
+// QuadTree is a spatial index over bounding rectangles of arbitrary values (pointers or ids).
+// It is used to find regions of interest by point, rectangle or radius without scanning all of them.
+// - the tree is loose: each node accepts the rectangles, that fit into its bounds enlarged by half of its size
+//   on every side, so the rectangles, that straddle the borders of quadrants (e.g. on grid-aligned maps),
+//   still go down to the quadrant of their center instead of piling up in the parent;
+// - each value is stored in the deepest node, that accepts its rectangle;
+// - when a leaf node gets more than {capacity} values, it is split into four quadrants;
+//   when the values of the split node drop to the half of capacity, its quadrants are merged back;
+// - values, that lay outside of the root bounds, are stored in the root node;
+// - the rectangles are compared as closed ones, so the points and the lines (zero-area rectangles) are found too;
+// - the node of each value is remembered, so update and removal don't need to search the tree.
+
+template <typename T>
+class QuadTree
+{
+public:
+    QuadTree(const QRectF& bounds = QRectF(), int capacity = 16, int maxDepth = 12)
+        : m_bounds(bounds), m_capacity(capacity), m_maxDepth(maxDepth)
+    {
+        m_root = new Node(m_bounds, 0, nullptr);
+    }
+
+    ~QuadTree()
+    {
+        delete m_root;
+    }
+
+    QuadTree(const QuadTree&) = delete;
+    QuadTree& operator= (const QuadTree&) = delete;
+
+    const QRectF& bounds() const
+    {
+        return m_bounds;
+    }
+
+    void setBounds(const QRectF& bounds)
+    {
+        // When bounds are changed, the whole tree should be rebuilt.
+        QVector<Entry> entries;
+        collect(m_root, entries);
+
+        m_bounds = bounds;
+        clear();
+
+        for (const Entry& entry : entries)
+            insert(entry.value, entry.rect);
+    }
+
+    int size() const
+    {
+        return m_locations.size();
+    }
+
+    bool contains(const T& value) const
+    {
+        return m_locations.contains(value);
+    }
+
+    void clear()
+    {
+        delete m_root;
+        m_root = new Node(m_bounds, 0, nullptr);
+        m_locations.clear();
+    }
+
+    void insert(const T& value, const QRectF& rect)
+    {
+        if (m_locations.contains(value))
+            remove(value);
+
+        QRectF normalized = rect.normalized();
+
+        Node* node = m_root;
+        while (!node->isLeaf())
+        {
+            Node* child = node->childAccepting(normalized);
+            if (!child)
+                break;
+
+            node = child;
+        }
+
+        node->entries.append(Entry{value, normalized});
+        m_locations.insert(value, node);
+
+        for (Node* parent = node; parent; parent = parent->parent)
+            ++parent->count;
+
+        if (node->isLeaf() && node->entries.size() > m_capacity && node->depth < m_maxDepth)
+            split(node);
+    }
+
+    void update(const T& value, const QRectF& rect)
+    {
+        // Most of the moves are small, so check, whether the value could stay in the same node.
+        QRectF normalized = rect.normalized();
+        Node* node = m_locations.value(value, nullptr);
+        if (node && node != m_root && encloses(node->loose, normalized) && (node->isLeaf() || !node->childAccepting(normalized)))
+        {
+            for (Entry& entry : node->entries)
+                if (entry.value == value)
+                {
+                    entry.rect = normalized;
+                    return;
+                }
+        }
+
+        insert(value, rect);
+    }
+
+    bool remove(const T& value)
+    {
+        Node* node = m_locations.take(value);
+        if (!node)
+            return false;
+
+        for (int i = 0; i < node->entries.size(); ++i)
+            if (node->entries.at(i).value == value)
+            {
+                node->entries.remove(i);
+                break;
+            }
+
+        // The highest node, that holds few enough values, takes the values of its quadrants.
+        Node* sparse = nullptr;
+        for (Node* parent = node; parent; parent = parent->parent)
+        {
+            --parent->count;
+            if (!parent->isLeaf() && parent->count <= m_capacity / 2)
+                sparse = parent;
+        }
+
+        if (sparse)
+            merge(sparse);
+
+        return true;
+    }
+
+    QList<T> query(const QPointF& point) const
+    {
+        QList<T> result;
+        query(m_root, [&point](const QRectF& rect)
+        {
+            return rect.left() <= point.x() && point.x() <= rect.right() && rect.top() <= point.y() && point.y() <= rect.bottom();
+        }, result);
+
+        return result;
+    }
+
+    QList<T> query(const QRectF& area) const
+    {
+        QList<T> result;
+        QRectF normalized = area.normalized();
+        query(m_root, [&normalized](const QRectF& rect) { return overlaps(rect, normalized); }, result);
+
+        return result;
+    }
+
+    QList<T> query(const QPointF& center, qreal radius) const
+    {
+        // The rectangle intersects the circle, when the closest point of the rectangle is not farther than radius.
+        QList<T> result;
+        query(m_root, [&center, radius](const QRectF& rect)
+        {
+            qreal dx = qMax(qMax(rect.left() - center.x(), 0.0), center.x() - rect.right());
+            qreal dy = qMax(qMax(rect.top()  - center.y(), 0.0), center.y() - rect.bottom());
+
+            return dx*dx + dy*dy <= radius*radius;
+        }, result);
+
+        return result;
+    }
+
+private:
+    struct Entry
+    {
+        T value;
+        QRectF rect;
+    };
+
+    // QRectF treats zero-area rectangles as null ones (they neither contain nor intersect anything),
+    // so the rectangles are compared here as closed ones.
+    static bool overlaps(const QRectF& a, const QRectF& b)
+    {
+        return a.left() <= b.right() && b.left() <= a.right() && a.top() <= b.bottom() && b.top() <= a.bottom();
+    }
+
+    static bool encloses(const QRectF& outer, const QRectF& inner)
+    {
+        return outer.left() <= inner.left() && inner.right() <= outer.right() && outer.top() <= inner.top() && inner.bottom() <= outer.bottom();
+    }
+
+    struct Node
+    {
+        Node(const QRectF& nodeBounds, int nodeDepth, Node* parentNode)
+            : bounds(nodeBounds), depth(nodeDepth), parent(parentNode)
+        {
+            // Loose bounds: the node takes the rectangles, that are centered in it and not larger than it.
+            qreal dx = bounds.width()  / 2.0;
+            qreal dy = bounds.height() / 2.0;
+            loose = bounds.adjusted(-dx, -dy, dx, dy);
+        }
+
+        ~Node()
+        {
+            for (Node* child : children)
+                delete child;
+        }
+
+        bool isLeaf() const
+        {
+            return children[0] == nullptr;
+        }
+
+        Node* childAccepting(const QRectF& rect) const
+        {
+            // Only the quadrant of the center could accept the rectangle.
+            QPointF center = rect.center();
+            QPointF middle = bounds.center();
+            Node* child = children[(center.x() < middle.x() ? 0 : 1) + (center.y() < middle.y() ? 0 : 2)];
+
+            return encloses(child->loose, rect) ? child : nullptr;
+        }
+
+        QRectF bounds;
+        QRectF loose;
+        int depth;
+        int count = 0; // values in the node and all of its quadrants
+        Node* parent;
+        QVector<Entry> entries;
+        Node* children[4] = {nullptr, nullptr, nullptr, nullptr};
+    };
+
+    void split(Node* node)
+    {
+        qreal x = node->bounds.x();
+        qreal y = node->bounds.y();
+        qreal w = node->bounds.width()  / 2.0;
+        qreal h = node->bounds.height() / 2.0;
+
+        node->children[0] = new Node(QRectF(x,     y,     w, h), node->depth + 1, node);
+        node->children[1] = new Node(QRectF(x + w, y,     w, h), node->depth + 1, node);
+        node->children[2] = new Node(QRectF(x,     y + h, w, h), node->depth + 1, node);
+        node->children[3] = new Node(QRectF(x + w, y + h, w, h), node->depth + 1, node);
+
+        // Move down the values, that fit into quadrants. The others (larger than a quadrant) stay in this node.
+        QVector<Entry> entries;
+        entries.swap(node->entries);
+
+        for (const Entry& entry : entries)
+        {
+            Node* child = node->childAccepting(entry.rect);
+            Node* target = child ? child : node;
+
+            target->entries.append(entry);
+            m_locations.insert(entry.value, target);
+
+            if (child)
+                ++child->count;
+        }
+    }
+
+    void merge(Node* node)
+    {
+        // The values of the quadrants are moved into this node, which becomes the leaf again.
+        QVector<Entry> entries;
+        for (Node* child : node->children)
+            collect(child, entries);
+
+        for (Node*& child : node->children)
+        {
+            delete child;
+            child = nullptr;
+        }
+
+        for (const Entry& entry : entries)
+            m_locations.insert(entry.value, node);
+
+        node->entries += entries;
+    }
+
+    template <typename Predicate>
+    void query(const Node* node, const Predicate& matches, QList<T>& result) const
+    {
+        for (const Entry& entry : node->entries)
+            if (matches(entry.rect))
+                result.append(entry.value);
+
+        if (node->isLeaf())
+            return;
+
+        for (const Node* child : node->children)
+            if (child->count > 0 && matches(child->loose))
+                query(child, matches, result);
+    }
+
+    void collect(const Node* node, QVector<Entry>& entries) const
+    {
+        entries += node->entries;
+
+        if (!node->isLeaf())
+            for (const Node* child : node->children)
+                collect(child, entries);
+    }
+
+    QRectF m_bounds;
+    int m_capacity;
+    int m_maxDepth;
+
+    Node* m_root;
+    QHash<T, Node*> m_locations;
+};
+
+#endif // QUADTREE_H
@@ -0,0 +1,145 @@
+#ifndef SHAPEGEOMETRY_H
+#define SHAPEGEOMETRY_H
+
+#include <QPointF>
+#include <QRectF>
+#include <QtMath>
+
+#include "../regionofinterest.h"
+
+// ShapeGeometry answers the hit-testing questions for the built-in shapes of regions in closed form,
+// so picking and rubber-band selection never build or walk QPainterPath elements.
+// The shapes are exactly the ones, that RegionOfInterest makes from its bounds:
+// - RECTANGLE:         the bounds;
+// - ROUNDED_RECTANGLE: the bounds with corners rounded by 10 px (clamped to the half of the side);
+// - ELLIPSE:           the ellipse inscribed into the bounds;
+// - CIRCLE:            the circle in the (integer) center of the bounds with the radius of the half of shorter side.
+// Each shape is a specialization of {Shape}, the run-time shape type is dispatched to them once per test.
+
+class ShapeGeometry
+{
+public:
+    typedef RegionOfInterest::ShapeType ShapeType;
+
+    // The point and rectangle are in the coordinates of the bounds.
+    static bool contains (ShapeType type, const QRectF& bounds, const QPointF& point);
+    static bool intersects (ShapeType type, const QRectF& bounds, const QRectF& rect);
+
+    template <ShapeType T>
+    struct Shape;
+
+private:
+    template <typename Test>
+    static bool dispatch (ShapeType type, Test test)
+    {
+        switch (type)
+        {
+            case ShapeType::RECTANGLE:         return test(Shape<ShapeType::RECTANGLE>());
+            case ShapeType::ROUNDED_RECTANGLE: return test(Shape<ShapeType::ROUNDED_RECTANGLE>());
+            case ShapeType::ELLIPSE:           return test(Shape<ShapeType::ELLIPSE>());
+            case ShapeType::CIRCLE:            return test(Shape<ShapeType::CIRCLE>());
+        }
+
+        return false;
+    }
+
+    // The closest distance (along each axis) between the rectangle and the core rectangle.
+    static QPointF gap (const QRectF& core, const QRectF& rect)
+    {
+        qreal dx = qMax(qMax(core.left() - rect.right(), rect.left() - core.right()), 0.0);
+        qreal dy = qMax(qMax(core.top() - rect.bottom(), rect.top() - core.bottom()), 0.0);
+        return QPointF(dx, dy);
+    }
+
+    // Any of the shapes is the core rectangle, expanded by the ellipse with radii {rx, ry} (Minkowski sum),
+    // so the rectangle touches the shape, when it is not farther from the core, than the ellipse allows.
+    static bool touches (const QRectF& core, qreal rx, qreal ry, const QRectF& rect)
+    {
+        QPointF d = gap(core, rect);
+        if (rx <= 0.0 || ry <= 0.0)
+            return d.x() <= 0.0 && d.y() <= 0.0;
+
+        qreal nx = d.x() / rx, ny = d.y() / ry;
+        return nx*nx + ny*ny <= 1.0;
+    }
+
+    static QRectF pointRect (const QPointF& point)
+    {
+        return QRectF(point, point);
+    }
+};
+
+template <>
+struct ShapeGeometry::Shape<RegionOfInterest::ShapeType::RECTANGLE>
+{
+    bool contains (const QRectF& bounds, const QPointF& point) const
+    {
+        return bounds.contains(point);
+    }
+
+    bool intersects (const QRectF& bounds, const QRectF& rect) const
+    {
+        return bounds.intersects(rect);
+    }
+};
+
+template <>
+struct ShapeGeometry::Shape<RegionOfInterest::ShapeType::ROUNDED_RECTANGLE>
+{
+    bool contains (const QRectF& bounds, const QPointF& point) const
+    {
+        return bounds.contains(point) && intersects(bounds, pointRect(point));
+    }
+
+    bool intersects (const QRectF& bounds, const QRectF& rect) const
+    {
+        const qreal radius = 10.0;
+        qreal rx = qMin(radius, bounds.width()  / 2.0);
+        qreal ry = qMin(radius, bounds.height() / 2.0);
+        return touches(bounds.adjusted(rx, ry, -rx, -ry), rx, ry, rect);
+    }
+};
+
+template <>
+struct ShapeGeometry::Shape<RegionOfInterest::ShapeType::ELLIPSE>
+{
+    bool contains (const QRectF& bounds, const QPointF& point) const
+    {
+        return intersects(bounds, pointRect(point));
+    }
+
+    bool intersects (const QRectF& bounds, const QRectF& rect) const
+    {
+        QPointF center = bounds.center();
+        return touches(QRectF(center, center), bounds.width() / 2.0, bounds.height() / 2.0, rect);
+    }
+};
+
+template <>
+struct ShapeGeometry::Shape<RegionOfInterest::ShapeType::CIRCLE>
+{
+    bool contains (const QRectF& bounds, const QPointF& point) const
+    {
+        return intersects(bounds, pointRect(point));
+    }
+
+    bool intersects (const QRectF& bounds, const QRectF& rect) const
+    {
+        QPointF center = bounds.center().toPoint();
+        qreal radius = qMin(int(bounds.width() / 2), int(bounds.height() / 2));
+        return touches(QRectF(center, center), radius, radius, rect);
+    }
+};
+
+// Defined after all the specializations, since the dispatch instantiates them.
+inline bool ShapeGeometry::contains(ShapeType type, const QRectF &bounds, const QPointF &point)
+{
+    return dispatch(type, [&](auto shape) { return shape.contains(bounds, point); });
+}
+
+inline bool ShapeGeometry::intersects(ShapeType type, const QRectF &bounds, const QRectF &rect)
+{
+    return dispatch(type, [&](auto shape) { return shape.intersects(bounds, rect); });
+}
+
+#endif // SHAPEGEOMETRY_H
@@ -31,8 +31,22 @@ void Spritesheet::prepareAnimation(int fps)
 {
     m_fps = fps;
 
-    connect(&m_animationTimer, SIGNAL(timeout()), this, SLOT(onAnimationTick()));
-    m_animationTimer.start(1000/m_fps);
+    play();
+}
+
+void Spritesheet::play()
+{
+    startAnimation(m_fps);
+}
+
+void Spritesheet::stop()
+{
+    stopAnimation();
+}
+
+bool Spritesheet::isPlaying() const
+{
+    return isAnimating();
 }
 
 void Spritesheet::onAnimationTick()
@@ -5,9 +5,10 @@
 
 #include <QGraphicsItem>
 #include <QImage>
-#include <QTimer>
 
-class Spritesheet : public QObject
+#include "animationclock.h"
+
+class Spritesheet : public QObject, public Animated
 {
     Q_OBJECT
 
@@ -16,6 +17,11 @@ public:
 
     const QImage& currentFrame() const;
 
+    // Only playing spritesheets are subscribed to the animation clock.
+    void play();
+    void stop();
+    bool isPlaying() const;
+
 private:
     void setFPS (int fps);
     void loadFromFile(const QString& filename, int width, int height);
@@ -33,12 +39,11 @@ private:
     int m_frameHeight;
 
     bool forward = true;
-    QTimer m_animationTimer;
 
 signals:
 
-public slots:
-    void onAnimationTick();
+public:
+    void onAnimationTick() override;
 
 };
 
@@ -0,0 +1,59 @@
+#include "stringpool.h"
+
+Q_GLOBAL_STATIC(StringPool, pathPool)
+
+StringPool::StringPool()
+{
+    clear();
+}
+
+StringPool *StringPool::paths()
+{
+    return pathPool();
+}
+
+quint32 StringPool::intern(const QString &string)
+{
+    if (string.isEmpty())
+        return 0;
+
+    auto it = m_ids.constFind(string);
+    if (it != m_ids.constEnd())
+        return it.value();
+
+    quint32 id = quint32(m_strings.size());
+    m_strings.append(string);
+    m_ids.insert(string, id);
+
+    return id;
+}
+
+const QString &StringPool::string(quint32 id) const
+{
+    return m_strings.at(int(id));
+}
+
+int StringPool::size() const
+{
+    return m_strings.size();
+}
+
+void StringPool::clear()
+{
+    m_strings.clear();
+    m_ids.clear();
+
+    m_strings.append(QString());
+}
+
+qint64 StringPool::memoryUsage(const QSet<quint32> &ids) const
+{
+    // The table and the hash share the same string data, the hash node holds the key, the id and two pointers.
+    qint64 bytes = 0;
+    for (quint32 id : ids)
+        if (id != 0 && int(id) < m_strings.size())
+            bytes += sizeof(QString) + m_strings.at(int(id)).capacity() * sizeof(QChar)
+                   + sizeof(QString) + sizeof(quint32) + 3 * sizeof(void*);
+
+    return bytes;
+}
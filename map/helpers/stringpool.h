@@ -0,0 +1,37 @@
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+
+#include <QVector>
+#include <QString>
+#include <QHash>
+#include <QSet>
+
+// StringPool interns the strings, that are repeated a lot (paths of legends and local maps),
+// so each of them is stored once, and the users keep only 4-byte ids.
+// Id 0 is always the empty string.
+// The paths of the regions (both the items and the store) are interned into the shared pool, so the ids stay valid
+// for the whole run of the application: it is never cleared, and it's used only by GUI thread.
+
+class StringPool
+{
+public:
+    StringPool();
+
+    static StringPool* paths();
+
+    quint32 intern (const QString& string);
+    const QString& string (quint32 id) const;
+
+    int size() const;
+    void clear();
+
+    // Approximate memory, taken by the given strings and their entries in the lookup table (in bytes).
+    // The pool is shared by all the maps, so each of them counts only the strings, it refers to.
+    qint64 memoryUsage (const QSet<quint32>& ids) const;
+
+private:
+    QVector<QString> m_strings;
+    QHash<QString, quint32> m_ids;
+};
+
+#endif // STRINGPOOL_H
@@ -1,14 +1,59 @@
 #include "interactivemap.h"
 
-#include <QGraphicsPixmapItem>
-
 #include <QMouseEvent>
+#include <QHelpEvent>
+#include <QToolTip>
+#include <QPainter>
 #include <QDataStream>
 #include <QDateTime>
 #include <QFileInfo>
+#include <QCoreApplication>
+#include <QRunnable>
+#include <QPointer>
 
 #include <QDebug>
 
+#include "io/imfformat.h"
+
+namespace
+{
+    // SaveJob generates the label raster for the document (when it needs one) and writes the map file,
+    // then passes the saved document back to GUI thread.
+    class SaveJob : public QRunnable
+    {
+    public:
+        SaveJob(InteractiveMap* map, const QString& filename, const MapDocument& document, const QRectF& labelArea, int version)
+            : m_map(map), m_filename(filename), m_document(document), m_labelArea(labelArea), m_version(version)
+        {
+        }
+
+        void run() override
+        {
+            if (!m_labelArea.isEmpty())
+                m_document.labels = LabelRaster::generate(m_document.regions, m_labelArea);
+
+            bool written = ImfFormat::writeFile(m_filename, m_document);
+
+            QPointer<InteractiveMap> map = m_map;
+            QString filename = m_filename;
+            MapDocument saved = m_document;
+            int version = m_version;
+            QMetaObject::invokeMethod(QCoreApplication::instance(), [map, filename, saved, written, version]()
+            {
+                if (map)
+                    map->onSaved(filename, saved, written, version);
+            }, Qt::QueuedConnection);
+        }
+
+    private:
+        QPointer<InteractiveMap> m_map;
+        QString m_filename;
+        MapDocument m_document;
+        QRectF m_labelArea;
+        int m_version;
+    };
+}
+
 InteractiveMap::InteractiveMap(QWidget *parent)
     : QGraphicsView (parent)
 {
@@ -17,12 +62,29 @@ InteractiveMap::InteractiveMap(QWidget *parent)
     makeDetails();
     makeButtons();
     makeRegions();
+    makeLegends();
+    makeMapCache();
 }
 
 InteractiveMap::~InteractiveMap()
 {
     clearObjects();
     clearScene();
+
+    delete m_mapPrefetcher;
+    m_mapPrefetcher = nullptr;
+
+    delete m_mapCache;
+    m_mapCache = nullptr;
+
+    delete m_regionIndex;
+    m_regionIndex = nullptr;
+
+    delete m_regionStore;
+    m_regionStore = nullptr;
+
+    delete m_labelRaster;
+    m_labelRaster = nullptr;
 }
 
 void InteractiveMap::keyPressEvent(QKeyEvent *event)
@@ -87,9 +149,8 @@ void InteractiveMap::keyPressEvent(QKeyEvent *event)
             m_currentScale = 1.0f;
         }
 
-        // And dont forget to update the top items positions, when any of the zoom events take place
-        updateDetailsPositions(true);
-        updateButtons();
+        // HUD stays in place, only the regions around the viewport change.
+        scheduleVirtualRegions();
     }
 }
 
@@ -120,8 +181,7 @@ void InteractiveMap::wheelEvent(QWheelEvent *event)
         }
     }
 
-    updateDetailsPositions(true);
-    updateButtons();
+    scheduleVirtualRegions();
 }
 
 void InteractiveMap::mousePressEvent(QMouseEvent *event)
@@ -134,16 +194,19 @@ void InteractiveMap::mousePressEvent(QMouseEvent *event)
         {
             if (event->button() == Qt::LeftButton)
             {
-                QGraphicsItem *item = itemAt(event->localPos().toPoint());
+                QGraphicsItem *item = m_hud->itemAt(event->localPos(), QTransform());
 
-                // Grab the item on {mouse position}.
+                // Grab the item on {mouse position} (buttons and details are in HUD, the regions are in the map).
                 // Since QGraphicsItem is a base class for all its descendants,
                 // just use the {dynamic_cast} to check, whether the item is of the needed type.
-                QGraphicsPixmapItem *background = dynamic_cast<QGraphicsPixmapItem*>(item);
+                // Regions are looked up using spatial index, unless the cursor is over buttons or details.
                 QGraphicsButtonItem *button     = dynamic_cast<QGraphicsButtonItem*>(item);
-                RegionOfInterest *region        = dynamic_cast<RegionOfInterest*>   (item);
                 Details *details                = dynamic_cast<Details*>            (item);
                 DetailsText *detailsText        = dynamic_cast<DetailsText*>        (item);
+                RegionOfInterest *region        = (button || details || detailsText) ? nullptr : regionAt(mapToScene(event->pos()));
+
+                if (region)
+                    item = region;
 
                 bool anyDraggableObjects = region || details || detailsText;
 
@@ -225,8 +288,7 @@ void InteractiveMap::mousePressEvent(QMouseEvent *event)
             // If user clicked on an item on the scene, and it is of type {RegionOfInterest}, remove it from the list and from the scene.
             if (event->button() == Qt::RightButton)
             {
-                QGraphicsItem* item = m_scene->itemAt(mapToScene(event->pos()), QTransform());
-                RegionOfInterest* region = dynamic_cast<RegionOfInterest*>(item);
+                RegionOfInterest* region = regionAt(mapToScene(event->pos()));
 
                 if (region)
                     removeRegion(region);
@@ -242,40 +304,23 @@ void InteractiveMap::mouseMoveEvent(QMouseEvent *event)
     {
         case Mode::VIEW:
         {
-            // Play with this: details should update this position without the text inside, when moving the map.
-            //                                                     with    the text inside, when clicking on another region.
-            // Another boolean parameter will fit for this.
-            if (m_selectedItem != m_details)
-                updateDetailsPositions(false);
-
-            updateButtons();
-
             // Do various stuff with items, when mouse moves over them in view mode.
             // Here we change the state of items, that is dependent on mouse movement (make them active or idle, hovered or default etc).
             // This can be used to change visuals or logic depending on state.
             // For example, when using atlas of spritesheets, we could set another state,
             //              change active spritesheet and use timer to activate the animation reaction on mouse hover.
-            QGraphicsItem* item = m_scene->itemAt(mapToScene(event->pos()), QTransform());
+            QGraphicsItem* item = m_hud->itemAt(event->localPos(), QTransform());
             QGraphicsButtonItem* button = dynamic_cast<QGraphicsButtonItem*>(item);
-            RegionOfInterest*    region = dynamic_cast<RegionOfInterest*>(item);
-
-            // Recover the default state of buttons (if they were hovered, for example).
-            defaultButtons();
-            defaultRegions();
+            RegionOfInterest*    region = button ? nullptr : regionAt(mapToScene(event->pos()));
 
-            if (button)
-            {
-                // There is no transition from pressed to hovered state.
-                if (!button->isPressed())
-                    button->setState(QGraphicsButtonItem::State::HOVERED);                
-            }
-
-            else if (region)
-                region->setState(RegionOfInterest::State::ACTIVE);
+            // Only the previous and the new hover targets change their state (if they differ at all),
+            // so the cost of mouse move doesn't depend on the count of buttons and regions.
+            hoverButton(button);
+            hoverRegion(region);
 
             // When we are moving items, we calculate the delta between current and previous mouse position,
             // And use it to move shapes (bounding rectangles or member variable shape bounding rectangles).
-            else if (b_movingItem)
+            if (b_movingItem)
             {
                 QPoint mouseCurrentPosition = event->screenPos().toPoint();
                 QPoint delta = mouseCurrentPosition - m_mouseOldPosition;
@@ -284,11 +329,18 @@ void InteractiveMap::mouseMoveEvent(QMouseEvent *event)
                 if (m_details->textIsMoving())
                     m_details->moveTextBy(0.0f, 1.0f*delta.y());
                 else
-                    m_selectedItem->moveBy(delta.x() / m_currentScale, delta.y() / m_currentScale);
-
-                m_scene->update();
+                {
+                    // The label raster describes the regions, as they were placed, so it is outdated now.
+                    // It is dropped once, when the region starts moving (or after the raster was saved meanwhile).
+                    if (m_labelRaster->isValid() && !delta.isNull() && dynamic_cast<RegionOfInterest*>(m_selectedItem))
+                        dropLabels();
+
+                    // HUD items are moved in viewport pixels, the regions in scene units.
+                    qreal scale = (m_selectedItem->scene() == m_hud) ? 1.0f : m_currentScale;
+                    m_selectedItem->moveBy(delta.x() / scale, delta.y() / scale);
+                }
             }
-            else
+            else if (!button && !region)
                 QGraphicsView::mouseMoveEvent(event);
         }
         break;
@@ -311,7 +363,11 @@ void InteractiveMap::mouseReleaseEvent(QMouseEvent *event)
     {
         case Mode::VIEW:
         {
-            updateButtons();
+            // Pressed buttons are released here (the one under cursor stays hovered).
+            QGraphicsButtonItem* pressedButton = findButton(QGraphicsButtonItem::State::PRESSED);
+            if (pressedButton)
+                pressedButton->setState(pressedButton == m_hoveredButton ? QGraphicsButtonItem::State::HOVERED
+                                                                         : QGraphicsButtonItem::State::IDLE);
 
             // Reaction on mouse release, when we were moving an item.
             if (b_movingItem)
@@ -362,19 +418,17 @@ void InteractiveMap::mouseReleaseEvent(QMouseEvent *event)
 
                 if (b_selectRegions)
                 {
-                    QList<QGraphicsItem*> selectedItems = m_scene->items(mapToScene(m_rubberBand->geometry()));
-                    if (selectedItems.isEmpty())
+                    QRectF selection = mapToScene(m_rubberBand->geometry()).boundingRect();
+                    materializeRegionsIn(selection);
+
+                    QList<RegionOfInterest*> selectedRegions = regionsIn(selection);
+                    if (selectedRegions.isEmpty())
                         deselectAllRegions();
 
-                    findButton("Statusbar")->setText(QString("Selected: %1").arg(selectedItems.size()));
+                    findButton("Statusbar")->setText(QString("Selected: %1").arg(selectedRegions.size()));
 
-                    for (int i = 0; i < selectedItems.size(); ++i)
-                    {
-                        RegionOfInterest* roi = dynamic_cast<RegionOfInterest*>(selectedItems.at(i));
-                        if (roi)
-                            roi->setState(RegionOfInterest::State::ACTIVE);
-                            // selectRegion(roi);
-                    }
+                    for (int i = 0; i < selectedRegions.size(); ++i)
+                        setRegionState(selectedRegions.at(i), RegionOfInterest::State::ACTIVE);
 
                     b_selectRegions = false;
                 }
@@ -390,8 +444,7 @@ void InteractiveMap::mouseDoubleClickEvent(QMouseEvent *event)
     {
         case Mode::VIEW:
         {
-            QGraphicsItem *item = itemAt(event->localPos().toPoint());
-            RegionOfInterest* region = dynamic_cast<RegionOfInterest*>(item);
+            RegionOfInterest* region = regionAt(mapToScene(event->pos()));
 
             // When user doubleclicked on some region with attached local map,
             // Loads the attached local map and store it in a history list,
@@ -403,8 +456,7 @@ void InteractiveMap::mouseDoubleClickEvent(QMouseEvent *event)
 
         case Mode::EDITOR:
         {
-            QGraphicsItem *item = itemAt(event->localPos().toPoint());
-            RegionOfInterest* region = dynamic_cast<RegionOfInterest*>(item);
+            RegionOfInterest* region = regionAt(mapToScene(event->pos()));
 
             if (region)
             {
@@ -415,10 +467,17 @@ void InteractiveMap::mouseDoubleClickEvent(QMouseEvent *event)
                 LegendInfoDialog dialog (region);
                 if (QDialog::Accepted == dialog.exec())
                 {
+                    // The dialog could have rewritten the legend file, so forget its previous text.
+                    m_legendLoader->invalidate(dialog.contentsFilename());
+
                     region->setContents(dialog.contentsFilename());
                     region->setLocalMap(dialog.localMapFilename());
+                    m_legendLoader->watch(region->attachedFile());
+
+                    if (region == m_selectedRegion)
+                        m_details->setRegionOfInterest(region);
 
-                    m_details->updateContents();
+                    requestContents(region);
                 }
             }
             else
@@ -433,6 +492,78 @@ void InteractiveMap::mouseDoubleClickEvent(QMouseEvent *event)
     }
 }
 
+void InteractiveMap::resizeEvent(QResizeEvent *event)
+{
+    QGraphicsView::resizeEvent(event);
+
+    // HUD is laid out only, when the viewport changes its size.
+    m_hud->setSceneRect(viewport()->rect());
+    updateDetailsPositions(false);
+    updateButtons();
+
+    scheduleVirtualRegions();
+}
+
+void InteractiveMap::scrollContentsBy(int dx, int dy)
+{
+    QGraphicsView::scrollContentsBy(dx, dy);
+
+    // The viewport is scrolled by copying its pixels, so HUD is copied with the map:
+    // it is drawn again, where it is and where it was copied to.
+    QRegion hud;
+    const QList<QGraphicsItem*> items = m_hud->items();
+    for (QGraphicsItem* item : items)
+    {
+        if (item->parentItem() || !item->isVisible())
+            continue;
+
+        QRect bounds = item->sceneBoundingRect().toAlignedRect();
+        hud += bounds;
+        hud += bounds.translated(dx, dy);
+    }
+    viewport()->update(hud);
+
+    scheduleVirtualRegions();
+}
+
+void InteractiveMap::drawForeground(QPainter *painter, const QRectF &rect)
+{
+    QGraphicsView::drawForeground(painter, rect);
+
+    // HUD is drawn without the transformation of the view, only the exposed part of it.
+    QRectF exposed = mapFromScene(rect).boundingRect();
+
+    painter->save();
+    painter->resetTransform();
+    m_hud->render(painter, exposed, exposed);
+    painter->restore();
+}
+
+bool InteractiveMap::viewportEvent(QEvent *event)
+{
+    // Regions don't keep their tooltips: the name of the legend is made, only when the tooltip is shown.
+    // HUD isn't shown by any view, so the tooltips of its items are shown here as well.
+    if (event->type() == QEvent::ToolTip)
+    {
+        QHelpEvent* help = static_cast<QHelpEvent*>(event);
+
+        QString text;
+        if (QGraphicsItem* item = m_hud->itemAt(help->pos(), QTransform()))
+            text = item->toolTip();
+        else if (RegionOfInterest* region = regionAt(mapToScene(help->pos())))
+            text = region->name();
+
+        if (text.isEmpty())
+            QToolTip::hideText();
+        else
+            QToolTip::showText(help->globalPos(), text, viewport());
+
+        return true;
+    }
+
+    return QGraphicsView::viewportEvent(event);
+}
+
 void InteractiveMap::clearScene()
 {
     m_scene->deleteLater();
@@ -446,6 +577,9 @@ void InteractiveMap::clearObjects()
 
     removeBackground();
     removeAllRegions();
+
+    if (m_legendLoader)
+        m_legendLoader->unwatchAll();
 }
 
 void InteractiveMap::removeBackground()
@@ -463,23 +597,58 @@ void InteractiveMap::removeAllRegions()
 {
     while (!m_regions->isEmpty())
         removeRegion(m_regions->last());
+
+    m_regionStore->clear();
+    m_regionIds.clear();
+    m_liveRegions.clear();
+    m_regionSlots.clear();
+    m_regionLayer->showAllRegions();
+    m_regionLayer->setVisible(false);
+
+    qDeleteAll(m_regionPool);
+    m_regionPool.clear();
+
+    dropLabels();
+    m_labels = LabelData();
 }
 
 void InteractiveMap::removeSelectedRegions()
 {
-    for (int i = 0; i < m_regions->size(); ++i)
-    {
-        RegionOfInterest* roi = m_regions->at(i);
-        if (roi->state() == RegionOfInterest::State::ACTIVE)
-            removeRegion(roi);
-    }
+    const QList<RegionOfInterest*> selected = m_activeRegions.values();
+    for (RegionOfInterest* roi : selected)
+        removeRegion(roi);
 }
 
 void InteractiveMap::removeRegion(RegionOfInterest *region)
 {
-    if (region && m_regions->contains(region))
+    if (region && m_regionIndex->contains(region))
     {
-        m_regions->removeOne(region);
+        // Details should not refer to the removed region.
+        if (region == m_selectedRegion)
+        {
+            m_selectedRegion = nullptr;
+            m_details->setRegionOfInterest(nullptr);
+            m_details->hide();
+        }
+
+        if (region == m_hoveredRegion)
+            m_hoveredRegion = nullptr;
+
+        m_activeRegions.remove(region);
+        m_regionIndex->remove(region);
+        region->setIndex(nullptr);
+        dropLabels();
+
+        // In virtualization mode the region is removed from the store as well.
+        if (m_regionIds.contains(region))
+        {
+            int id = m_regionIds.take(region);
+            m_liveRegions.remove(id);
+            m_regionLayer->showRegion(id);
+            m_regionStore->remove(id);
+        }
+
+        detachRegion(region);
         m_scene->removeItem(region);
 
         delete region;
@@ -489,43 +658,31 @@ void InteractiveMap::removeRegion(RegionOfInterest *region)
 
 void InteractiveMap::updateDetailsPositions(bool updateText)
 {
+    // Details are in HUD, so the position is in viewport coordinates.
     if (m_details)
     {
         int shift = 20;
-        QPointF viewport = mapToScene(this->viewport()->width() - m_details->boundingRect().width() - shift, shift);
-        m_details->moveTo(viewport.x(), viewport.y(), updateText);
+        m_details->moveTo(viewport()->width() - m_details->boundingRect().width() - shift, shift, updateText);
     }
 }
 
 void InteractiveMap::updateButtons()
 {
-    // Since "buttons" are just the graphics items with special use, they behave just like other items.
-    // When we move the viewport, they stay on the same scene positions as before, so we need to move them accordingly.
-    // For this we use this method.
-    // There are some nuances, that should be covered for this case:
-    // 1. Conversions between scene and viewport coordinates. For this we use mapTo.. \ mapFrom.. methods of QGraphicsView class.
-    // 2. Scaling the distances, when zoom in or zoom out is used. Just divide the distance by current scale factor to place the item at the correct position.
+    // Buttons are in HUD, which is not moved or scaled with the map, so they are placed in viewport coordinates
+    // and only, when the size of viewport changes.
 
     QGraphicsButtonItem* addRegionButton = findButton("Add region");
     QGraphicsButtonItem* globalMapButton  = findButton("Global map");
     QGraphicsButtonItem* statusbarButton = findButton("Statusbar");
 
     if (addRegionButton && globalMapButton && statusbarButton)
-    {        
-        int vw = viewport()->geometry().width();
+    {
         int vh = viewport()->geometry().height();
         int arbw = addRegionButton->boundingRect().width();
 
-        QPointF viewport = mapToScene(0.0f, 0.0f);
-        int vx = viewport.x();
-        int vy = viewport.y();
-
-        addRegionButton->moveTo(vx + 10.0f          / m_currentScale, vy + 10.0f  / m_currentScale);
-        globalMapButton->moveTo(vx + (20.0f + arbw) / m_currentScale, vy + 10.0f  / m_currentScale);
-        statusbarButton->moveTo(vx + 20.0f          / m_currentScale, vy + 930.0f / m_currentScale);
-        // statusbarButton->setBounds(QRectF((vx + 20.0f) / m_currentScale, (vy + vh - 60.0f) / m_currentScale, (vw - 20.0f) / m_currentScale, 60.0f / m_currentScale));
-        // statusbarButton->update();
-
+        addRegionButton->moveTo(10.0f, 10.0f);
+        globalMapButton->moveTo(20.0f + arbw, 10.0f);
+        statusbarButton->moveTo(20.0f, vh - 70.0f);
     }
 }
 
@@ -533,6 +690,10 @@ void InteractiveMap::makeCanvas()
 {    
     m_scene = new QGraphicsScene (0, 0, WIDTH, HEIGHT, this);    
 
+    // HUD scene has no views: its changes are forwarded to the viewport, and it is drawn in {drawForeground}.
+    m_hud = new QGraphicsScene (0, 0, WIDTH, HEIGHT, this);
+    connect(m_hud, SIGNAL(changed(const QList<QRectF>&)), this, SLOT(onHudChanged(const QList<QRectF>&)));
+
     // View:
     setScene(m_scene);
     setBackgroundBrush(QBrush("#222"));
@@ -546,13 +707,12 @@ void InteractiveMap::makeCanvas()
 void InteractiveMap::makeDetails()
 {
     m_details = new Details();   
-    m_details->setFlag(QGraphicsItem::ItemIgnoresTransformations);
     m_details->setZValue(2.0f);
     m_details->setBackground(QColor(0,0,0,155));
     m_details->setForeground(QColor(255,255,255));
     m_details->setFont(QFont("UKIJ Diwani Kawak", 6)); // "DS UncialFunnyHand", 9)); // ("ATLANTIDA", 7));
 
-    m_scene->addItem(m_details);
+    m_hud->addItem(m_details);
 }
 
 void InteractiveMap::makeButtons()
@@ -573,13 +733,62 @@ void InteractiveMap::makeButtons()
 void InteractiveMap::makeRegions()
 {
     m_regions = new QList<RegionOfInterest*>();
+    m_regionIndex = new QuadTree<RegionOfInterest*>(m_scene->sceneRect());
+    m_regionStore = new RegionStore(m_scene->sceneRect());
+
+    m_regionLayer = new RegionLayer(m_regionStore);
+    m_regionLayer->setZValue(1.0f);
+    m_regionLayer->setVisible(false);
+    m_scene->addItem(m_regionLayer);
+
+    m_labelRaster = new LabelRaster();
+
+    m_maskImporter = new MaskImporter(this);
+    connect(m_maskImporter, SIGNAL(ready()), this, SLOT(onMaskImported()));
+
+    // Panning and zooming produce a lot of events, the items are updated once for all of them.
+    m_virtualizationTimer.setSingleShot(true);
+    m_virtualizationTimer.setInterval(0);
+    connect(&m_virtualizationTimer, SIGNAL(timeout()), this, SLOT(onVirtualizationTimeout()));
+}
+
+void InteractiveMap::makeMapCache()
+{
+    m_mapCache = new MapCache();
+    m_mapPrefetcher = new MapPrefetcher(m_mapCache, this);
+
+    // The maps are written in the order, they were saved.
+    m_savePool.setMaxThreadCount(1);
+
+    m_hierarchy = new HierarchyIndex(this);
+    connect(m_hierarchy, SIGNAL(ready()), this, SLOT(onHierarchyReady()));
+}
+
+void InteractiveMap::makeLegends()
+{
+    m_legendLoader = new LegendLoader(this);
+
+    connect(m_legendLoader, SIGNAL(loaded(const QString&, const QString&)), this, SLOT(onLegendLoaded(const QString&, const QString&)));
 }
 
 void InteractiveMap::defaults()
 {
     m_regions    = nullptr;
+    m_regionIndex = nullptr;
+    m_regionStore = nullptr;
+    m_regionLayer = nullptr;
+    m_labelRaster = nullptr;
+    m_maskImporter = nullptr;
     m_rubberBand = nullptr;
     m_background = nullptr;
+    m_selectedRegion = nullptr;
+    m_selectedItem = nullptr;
+    m_hoveredRegion = nullptr;
+    m_hoveredButton = nullptr;
+    m_legendLoader = nullptr;
+    m_mapCache = nullptr;
+    m_mapPrefetcher = nullptr;
+    m_hierarchy = nullptr;
 
     m_currentShape = RegionOfInterest::ShapeType::CIRCLE;
     m_mode = Mode::VIEW;
@@ -614,15 +823,69 @@ void InteractiveMap::fillWithTestData()
 }
 
 RegionOfInterest *InteractiveMap::addRegion(RegionOfInterest *roi)
+{
+    // The label raster doesn't know the new region (when the document is loaded, the raster comes after the regions).
+    dropLabels();
+
+    // In virtualization mode every new region gets its place in the store.
+    if (b_virtualized)
+    {
+        int id = m_regionStore->add(recordFor(roi));
+        m_regionIds.insert(roi, id);
+        m_liveRegions.insert(id, roi);
+        m_regionLayer->hideRegion(id);
+    }
+
+    return attachRegion(roi);
+}
+
+RegionOfInterest *InteractiveMap::attachRegion(RegionOfInterest *roi)
 {
     roi->setZValue(1.0f);
 
+    // The items come and go all the time in virtualization mode, so their positions are remembered for the fast removal.
+    if (b_virtualized)
+        m_regionSlots.insert(roi, m_regions->size());
+
     m_regions->append(roi);
     m_scene->addItem(roi);
 
+    // From now on the region updates its bounds in the index by itself.
+    roi->setIndex(m_regionIndex);
+
+    // Legend files are watched, so the changed ones are read again without reloading the map.
+    if (roi->hasAttachedFile())
+        m_legendLoader->watch(roi->attachedFile());
+
     return roi;
 }
 
+void InteractiveMap::detachRegion(RegionOfInterest *roi)
+{
+    // In virtualization mode the order of items doesn't matter (the document is made from the store),
+    // so the last item takes the place of the removed one.
+    auto slot = m_regionSlots.find(roi);
+    if (slot != m_regionSlots.end())
+    {
+        int index = slot.value();
+        m_regionSlots.erase(slot);
+
+        RegionOfInterest* last = m_regions->takeLast();
+        if (last != roi)
+        {
+            (*m_regions)[index] = last;
+            m_regionSlots[last] = index;
+        }
+        return;
+    }
+
+    // Otherwise regions are mostly removed from the end of the list (when the map is cleared), so avoid the search there.
+    if (m_regions->last() == roi)
+        m_regions->removeLast();
+    else
+        m_regions->removeOne(roi);
+}
+
 RegionOfInterest *InteractiveMap::addRegion(const QSize &size)
 {
     RegionOfInterest *roi = new RegionOfInterest;
@@ -639,32 +902,150 @@ RegionOfInterest* InteractiveMap::addRegion(const QPointF &topLeft, const QPoint
     return addRegion(roi);
 }
 
-void InteractiveMap::deselectAllRegions()
+RegionOfInterest *InteractiveMap::regionAt(const QPointF &scenePosition)
 {
-    for (int i = 0; i < m_regions->size(); ++i)
+    // In view mode the label raster (if the map has it) answers with a single lookup.
+    // The pixels on the borders of regions and the ones, that the raster doesn't cover, are checked by geometry:
+    // the pixel could cover several regions, and the raster could be scaled down.
+    if (m_mode == Mode::VIEW && m_labelRaster->isValid())
     {
-        RegionOfInterest* roi = m_regions->at(i);
-        if (roi->state() == RegionOfInterest::State::ACTIVE)
-            roi->setState(RegionOfInterest::State::IDLE);
+        bool boundary = false;
+        int index = m_labelRaster->regionAt(scenePosition, &boundary);
+
+        if (!boundary && index == LabelRaster::NO_REGION)
+            return nullptr;
+
+        RegionOfInterest* region = (boundary || index < 0) ? nullptr : labeledRegion(index);
+        if (region)
+            return region;
+    }
+
+    // The regions, that are drawn by the region layer, become items, when the user points at them.
+    materializeRegionAt(scenePosition);
+
+    // Spatial index gives us the regions, which bounding rectangles contain the point.
+    // Then the exact shape of each candidate is checked and the topmost of them is chosen.
+    // When regions have the same Z value, the smallest one wins, so nested regions could be picked
+    // even when they are covered by the larger ones.
+    RegionOfInterest* result = nullptr;
+    qreal resultArea = 0.0f;
+
+    const QList<RegionOfInterest*> candidates = m_regionIndex->query(scenePosition);
+    for (RegionOfInterest* region : candidates)
+    {
+        if (!region->isVisible() || !region->contains(region->mapFromScene(scenePosition)))
+            continue;
+
+        QRectF bounds = region->sceneBoundingRect();
+        qreal area = bounds.width() * bounds.height();
+
+        bool isHigher  = result && region->zValue() > result->zValue();
+        bool isSmaller = result && region->zValue() == result->zValue() && area < resultArea;
+        if (!result || isHigher || isSmaller)
+        {
+            result = region;
+            resultArea = area;
+        }
     }
+
+    return result;
+}
+
+QList<RegionOfInterest *> InteractiveMap::regionsIn(const QRectF &sceneRect) const
+{
+    // Regions, which shapes intersect the rectangle (not only their bounding rectangles).
+    QList<RegionOfInterest*> result;
+
+    const QList<RegionOfInterest*> candidates = m_regionIndex->query(sceneRect);
+    for (RegionOfInterest* region : candidates)
+        if (region->intersects(sceneRect))
+            result.append(region);
+
+    return result;
+}
+
+QList<RegionOfInterest *> InteractiveMap::regionsNear(const QPointF &scenePosition, qreal radius) const
+{
+    // Regions, which bounding rectangles are closer to the point, than radius.
+    return m_regionIndex->query(scenePosition, radius);
+}
+
+void InteractiveMap::setRegionState(RegionOfInterest *region, const RegionOfInterest::State &state)
+{
+    // All the state changes of regions go through this method, so we always know, which regions are active,
+    // and never need to scan all of them to deselect.
+    if (region->state() == state)
+        return;
+
+    region->setState(state);
+
+    if (state == RegionOfInterest::State::ACTIVE)
+        m_activeRegions.insert(region);
+    else
+        m_activeRegions.remove(region);
+}
+
+void InteractiveMap::deselectAllRegions()
+{
+    const QList<RegionOfInterest*> active = m_activeRegions.values();
+    for (RegionOfInterest* roi : active)
+        setRegionState(roi, RegionOfInterest::State::IDLE);
 }
 
 void InteractiveMap::selectRegion(RegionOfInterest *region)
 {
     // Default the regions state
-    for (int i = 0; i < m_regions->size(); ++i)
-        m_regions->at(i)->setState(RegionOfInterest::State::IDLE);
+    deselectAllRegions();
 
     // Select region and make it active
     m_selectedRegion = region;
-    region->setState(RegionOfInterest::State::ACTIVE);
+    setRegionState(region, RegionOfInterest::State::ACTIVE);
 
     // Update details position
-    int shift = 20.0f;
-    QPointF topRight = mapToScene(geometry().topRight().x() - m_details->boundingRect().width() - shift*2, shift);
-    m_details->moveTo(topRight.x(), topRight.y(), true);
+    updateDetailsPositions(true);
     m_details->setRegionOfInterest(region);
     m_details->show();
+
+    // Ask for the legend of this region (it will be shown, when ready) and the legends of its neighbours.
+    requestContents(region);
+    prefetchContentsNear(region);
+}
+
+void InteractiveMap::requestContents(RegionOfInterest *region)
+{
+    // The cached text is shown at once, otherwise the loader reads it (the cache could have dropped it meanwhile,
+    // or never kept it, when the legend is larger, than the budget), and it's shown, when delivered.
+    if (!region || !region->hasAttachedFile())
+        return;
+
+    QString text;
+    if (m_legendLoader->peek(region->attachedFile(), text))
+    {
+        region->setDetailsLoaded();
+        if (region == m_selectedRegion)
+            m_details->setContents(text);
+    }
+    else
+        m_legendLoader->request(region->attachedFile());
+}
+
+void InteractiveMap::prefetchContentsNear(RegionOfInterest *region)
+{
+    // The user will most likely select one of the closest regions next.
+    int prefetched = 0;
+
+    const QList<RegionOfInterest*> neighbours = regionsNear(region->sceneBoundingRect().center(), PREFETCH_RADIUS);
+    for (RegionOfInterest* neighbour : neighbours)
+    {
+        if (prefetched == PREFETCH_COUNT)
+            break;
+
+        if (neighbour == region || !neighbour->hasAttachedFile() || neighbour->hasDetails())
+            continue;
+
+        m_legendLoader->prefetch(neighbour->attachedFile());
+        ++prefetched;
+    }
 }
 
 void InteractiveMap::defaultButtons()
@@ -675,15 +1056,57 @@ void InteractiveMap::defaultButtons()
         QGraphicsButtonItem* button = m_buttons->at(i);
         button->setState(QGraphicsButtonItem::State::IDLE);
     }
+
+    m_hoveredButton = nullptr;
 }
 
 void InteractiveMap::defaultRegions()
 {
-    for (int i = 0; i < m_regions->size(); ++i)
-    {
-        RegionOfInterest *region = m_regions->at(i);
+    const QList<RegionOfInterest*> active = m_activeRegions.values();
+    for (RegionOfInterest* region : active)
         if (region != m_selectedRegion)
-            region->setState(RegionOfInterest::State::IDLE);
+            setRegionState(region, RegionOfInterest::State::IDLE);
+
+    m_hoveredRegion = nullptr;
+}
+
+void InteractiveMap::hoverButton(QGraphicsButtonItem *button)
+{
+    if (button == m_hoveredButton)
+        return;
+
+    // There is no transition from pressed to hovered state (and back):
+    // pressed buttons stay pressed, until the mouse button is released.
+    if (m_hoveredButton && !m_hoveredButton->isPressed())
+        m_hoveredButton->setState(QGraphicsButtonItem::State::IDLE);
+
+    m_hoveredButton = button;
+
+    if (m_hoveredButton && !m_hoveredButton->isPressed())
+        m_hoveredButton->setState(QGraphicsButtonItem::State::HOVERED);
+}
+
+void InteractiveMap::hoverRegion(RegionOfInterest *region)
+{
+    if (region == m_hoveredRegion)
+        return;
+
+    // Selected region stays active, even when the cursor leaves it.
+    if (m_hoveredRegion && m_hoveredRegion != m_selectedRegion)
+        setRegionState(m_hoveredRegion, RegionOfInterest::State::IDLE);
+
+    // The item of previously hovered region could go back to the region layer.
+    scheduleVirtualRegions();
+
+    m_hoveredRegion = region;
+
+    if (m_hoveredRegion)
+    {
+        setRegionState(m_hoveredRegion, RegionOfInterest::State::ACTIVE);
+
+        // The user is likely to open the local map of hovered region, so it goes before the others.
+        if (!m_hoveredRegion->localMap().isEmpty())
+            m_mapPrefetcher->prefetch(m_hoveredRegion->localMap(), MapPrefetcher::HOVERED);
     }
 }
 
@@ -692,14 +1115,13 @@ QGraphicsButtonItem *InteractiveMap::makeButton(const QString& name, const QGrap
     QGraphicsButtonItem *button = new QGraphicsButtonItem(name);
 
     button->setText(name);
-    button->setFlag(QGraphicsItem::ItemIgnoresTransformations);
     button->setBounds(QRectF(0,0,size.width(),size.height()));
     button->setShape(shape);
     button->setPos(position);
     button->setZValue(2.0f);
 
     m_buttons->append(button);
-    m_scene->addItem(button);
+    m_hud->addItem(button);
 
     return button;
 }
@@ -744,6 +1166,7 @@ QGraphicsButtonItem *InteractiveMap::findButton(const QString &name)
 
 void InteractiveMap::setMode(const Mode& mode)
 {
+    // The label raster is dropped by the edits themselves, so it survives switching to the editor and back.
     m_mode = mode;
 }
 
@@ -767,24 +1190,71 @@ void InteractiveMap::setBackground(const QString &filename)
     // - resize the scene to fit it.
     if (isImage)
     {
-        removeBackground();
+        TiledBackground* background = new TiledBackground();
+        background->setMemoryBudget(m_backgroundBudget);
+        if (!background->setSource(filename))
+        {
+            delete background;
+            return;
+        }
+
+        setBackground(background);
+    }
+}
+
+void InteractiveMap::setBackground(TiledBackground *background)
+{
+    // The background could be new or taken from the map cache (already decoded).
+    removeBackground();
 
-        m_backgroundPath = filename;
-        m_background = new QGraphicsPixmapItem(QPixmap(filename));
-        m_background->setZValue(-1.0f);
-        m_scene->addItem(m_background);
+    m_background = background;
+    m_background->setMemoryBudget(m_backgroundBudget);
+    m_backgroundPath = m_background->source();
+    m_background->setZValue(-1.0f);
+    m_scene->addItem(m_background);
 
-        int border = 50, points = 50;
-        m_scene->setSceneRect(m_background->boundingRect().x() - border,       m_background->boundingRect().y() - border,
-                              m_background->boundingRect().width() + border*2, m_background->boundingRect().height() + border*2 + points);
+    int border = 50, points = 50;
+    m_scene->setSceneRect(m_background->boundingRect().x() - border,       m_background->boundingRect().y() - border,
+                          m_background->boundingRect().width() + border*2, m_background->boundingRect().height() + border*2 + points);
+    m_regionIndex->setBounds(m_scene->sceneRect());
+    m_regionStore->setBounds(m_scene->sceneRect());
+    m_regionLayer->setBounds(m_scene->sceneRect());
+
+    update();
+}
 
-        update();
+TiledBackground *InteractiveMap::takeBackground()
+{
+    // Removes the background from the scene without deleting it (with all the decoded tiles).
+    TiledBackground* background = m_background;
+    if (background)
+    {
+        m_scene->removeItem(background);
+        m_background = nullptr;
     }
+
+    return background;
+}
+
+void InteractiveMap::setMapCacheBudget(int megabytes)
+{
+    // Memory budget (in megabytes) for the recently visited maps.
+    m_mapCache->setBudget(megabytes);
+}
+
+void InteractiveMap::setBackgroundBudget(int megabytes)
+{
+    // Memory budget (in megabytes) for the decoded tiles of background map.
+    m_backgroundBudget = megabytes;
+
+    if (m_background)
+        m_background->setMemoryBudget(m_backgroundBudget);
 }
 
 void InteractiveMap::setRegionShape(const RegionOfInterest::ShapeType &shape)
 {
     m_currentShape = shape;
+    dropLabels();
 
     // update all the regions
     for (int i = 0; i < m_regions->size(); ++i)
@@ -793,100 +1263,509 @@ void InteractiveMap::setRegionShape(const RegionOfInterest::ShapeType &shape)
         roi->setShape(m_currentShape, roi->boundingRect());
         roi->update();
     }
+
+    if (b_virtualized)
+    {
+        m_regionStore->setShapeType(m_currentShape);
+        m_regionLayer->update();
+    }
 }
 
-void InteractiveMap::save()
+void InteractiveMap::setRegionLayer(bool enabled)
 {
+    // With the region layer, all the regions of virtualized map are drawn by a single item,
+    // otherwise the regions around the viewport are made into items.
+    b_regionLayer = enabled;
 
-    findButton("Statusbar")->setText(QString("%1: Saved map into file: %2").arg(QDateTime::currentDateTime().time().toString("hh:mm")).arg(m_currentMapFilename));
-    saveAs(m_currentMapFilename);
+    if (b_virtualized)
+    {
+        m_regionLayer->setVisible(b_regionLayer);
+        updateVirtualRegions();
+    }
 }
 
-void InteractiveMap::updateRegions()
+void InteractiveMap::setLabelRaster(bool enabled)
 {
-    for (int i = 0; i < m_regions->size(); ++i)
+    // When enabled, the label raster is generated for every saved map (not only for the maps, that already have it).
+    b_labelRaster = enabled;
+}
+
+bool InteractiveMap::importLabelMask(const QString &filename)
+{
+    // The mask is colour-coded (the colour is the index of the region plus one) and covers the background.
+    QImage mask (filename);
+    if (mask.isNull() || !m_background)
+        return false;
+
+    loadLabels(LabelRaster::fromMask(mask, m_background->sceneBoundingRect()));
+    return m_labelRaster->isValid();
+}
+
+void InteractiveMap::importMask(const QString &filename)
+{
+    // The mask is aligned with the background, so there is nothing to import without it.
+    if (filename.isEmpty() || !m_background)
+        return;
+
+    findButton("Statusbar")->setText(QString("%1: Importing regions from mask: %2").arg(QDateTime::currentDateTime().time().toString("hh:mm")).arg(filename));
+    m_maskImporter->import(filename, m_background->sceneBoundingRect());
+}
+
+void InteractiveMap::loadLabels(const LabelData &labels)
+{
+    dropLabels();
+
+    m_labels = labels;
+    if (m_labels.isEmpty() || !m_labelRaster->load(m_labels))
+        return;
+
+    // The raster holds the indices of the regions in the document:
+    // the regions are listed in the same order, as the items (or the records of the store) are kept.
+    if (b_virtualized)
+        m_labelIds = m_regionStore->ids();
+    else
+        m_labelRegions = m_regions->toVector();
+}
+
+void InteractiveMap::dropLabels()
+{
+    // The labels of the map are kept, so they are generated again on saving.
+    m_labelRaster->clear();
+    m_labelRegions.clear();
+    m_labelIds.clear();
+    ++m_labelsVersion;
+}
+
+bool InteractiveMap::needsLabels() const
+{
+    // The raster is generated again, if the map had it (or it is enabled for all the maps), but the regions were edited.
+    return !m_labelRaster->isValid() && (b_labelRaster || !m_labels.isEmpty());
+}
+
+QRectF InteractiveMap::labelArea(const MapDocument &document) const
+{
+    // The raster covers the background or the regions themselves.
+    if (m_background)
+        return m_background->sceneBoundingRect();
+
+    QRectF area;
+    for (const RegionRecord& record : document.regions)
+        area |= record.bounds.translated(record.position);
+
+    return area;
+}
+
+RegionOfInterest *InteractiveMap::labeledRegion(int index)
+{
+    if (b_virtualized)
+    {
+        if (index < 0 || index >= m_labelIds.size() || !m_regionStore->contains(m_labelIds.at(index)))
+            return nullptr;
+
+        // The region drawn by the region layer becomes an item, when the user points at it.
+        int id = m_labelIds.at(index);
+        RegionOfInterest* region = m_liveRegions.value(id, nullptr);
+        return region ? region : materializeRegion(id);
+    }
+
+    return (index >= 0 && index < m_labelRegions.size()) ? m_labelRegions.at(index) : nullptr;
+}
+
+void InteractiveMap::scheduleVirtualRegions()
+{
+    if (b_virtualized)
+        m_virtualizationTimer.start();
+}
+
+void InteractiveMap::updateVirtualRegions()
+{
+    if (!b_virtualized)
+        return;
+
+    // The items are kept a bit beyond the viewport, so the short moves don't recycle them back and forth.
+    QRectF visible = mapToScene(viewport()->rect()).boundingRect();
+    qreal mx = visible.width()  * VIRTUAL_MARGIN;
+    qreal my = visible.height() * VIRTUAL_MARGIN;
+    QRectF area = visible.adjusted(-mx, -my, mx, my);
+
+    // Recycle the items, that left the area (except the ones, the user interacts with).
+    // When the region layer draws the regions, the items are needed only for those.
+    // The list is walked from the end: a recycled item is replaced by the last one, which is already checked.
+    for (int i = m_regions->size() - 1; i >= 0; --i)
     {
         RegionOfInterest* roi = m_regions->at(i);
-        roi->setContents(roi->attachedFile());
+        if (roi == m_selectedRegion || roi == m_hoveredRegion || roi == m_selectedItem || m_activeRegions.contains(roi))
+            continue;
+
+        if (b_regionLayer || !area.intersects(roi->sceneBoundingRect()))
+            recycleRegion(roi);
     }
 
-    m_details->update();
+    if (b_regionLayer)
+        return;
+
+    // Make the items for the regions, that came into the area.
+    const QList<int> ids = m_regionStore->query(area);
+    for (int id : ids)
+        if (!m_liveRegions.contains(id))
+            materializeRegion(id);
+}
+
+RegionOfInterest *InteractiveMap::materializeRegion(int id)
+{
+    RegionRecord record = m_regionStore->record(id);
+
+    RegionOfInterest* region = m_regionPool.isEmpty() ? new RegionOfInterest() : m_regionPool.takeLast();
+    region->assign(record.shapeType, record.bounds, record.position, record.contents, record.localMap);
+
+    m_regionIds.insert(region, id);
+    m_liveRegions.insert(id, region);
+    m_regionLayer->hideRegion(id);
+
+    return attachRegion(region);
+}
+
+void InteractiveMap::materializeRegionAt(const QPointF &scenePosition)
+{
+    if (!b_virtualized || !b_regionLayer)
+        return;
+
+    const QList<int> ids = m_regionStore->query(scenePosition);
+    for (int id : ids)
+        if (!m_liveRegions.contains(id) && m_regionStore->hitTest(id, scenePosition))
+            materializeRegion(id);
+}
+
+void InteractiveMap::materializeRegionsIn(const QRectF &sceneRect)
+{
+    if (!b_virtualized || !b_regionLayer)
+        return;
+
+    const QList<int> ids = m_regionStore->query(sceneRect);
+    for (int id : ids)
+        if (!m_liveRegions.contains(id) && m_regionStore->intersects(id, sceneRect))
+            materializeRegion(id);
+}
+
+void InteractiveMap::recycleRegion(RegionOfInterest *region)
+{
+    // The item could have been moved or edited, so its state goes back to the store.
+    int id = m_regionIds.take(region);
+    m_liveRegions.remove(id);
+    m_regionStore->setRecord(id, recordFor(region));
+    m_regionLayer->showRegion(id);
+
+    m_regionIndex->remove(region);
+    region->setIndex(nullptr);
+    detachRegion(region);
+    m_scene->removeItem(region);
+
+    if (m_regionPool.size() < REGION_POOL_SIZE)
+        m_regionPool.append(region);
+    else
+        delete region;
+}
+
+void InteractiveMap::setVirtualizationThreshold(int regions)
+{
+    // The maps with at least this count of regions are loaded in virtualization mode.
+    m_virtualizationThreshold = regions;
+}
+
+bool InteractiveMap::isVirtualized() const
+{
+    return b_virtualized;
+}
+
+void InteractiveMap::save()
+{
+    // The status bar is updated, when the file is written.
+    saveAs(m_currentMapFilename);
+}
+
+void InteractiveMap::showStatus(const QString &message)
+{
+    // The messages are stamped with the time, like the ones of the map itself.
+    if (QGraphicsButtonItem* statusbar = findButton("Statusbar"))
+        statusbar->setText(QString("%1: %2").arg(QDateTime::currentDateTime().time().toString("hh:mm")).arg(message));
+}
+
+void InteractiveMap::updateRegions()
+{
+    // Changed legend files are normally caught by the watcher, but some of the changes could be missed
+    // (e.g. on network drives), so compare the files with the loaded versions and read again only the changed ones.
+    m_legendLoader->refresh();
 }
 
 void InteractiveMap::saveAs(const QString &filename)
 {
-    QFile file (filename);
-    if (file.open(QIODevice::WriteOnly))
-    {
-        QDataStream stream (&file);
-        stream << *this;
+    // The regions are taken on GUI thread, the raster is generated and the file is written by the job.
+    MapDocument current = document();
+    QRectF area = needsLabels() ? labelArea(current) : QRectF();
 
-        file.close();
+    showStatus(QString("Saving map into file: %1").arg(filename));
+    m_savePool.start(new SaveJob(this, filename, current, area, m_labelsVersion));
+}
+
+void InteractiveMap::onSaved(const QString &filename, const MapDocument &saved, bool written, int version)
+{
+    if (!written)
+    {
+        showStatus(QString("Can't save map into file: %1").arg(filename));
+        return;
     }
+
+    // The cached version of this file is outdated now.
+    m_mapCache->remove(filename);
+    if (filename == m_currentMapFilename)
+        m_currentDocument = saved;
+
+    // The saved raster describes the regions, as they were taken for saving, so it is used only,
+    // if they weren't edited meanwhile.
+    if (version == m_labelsVersion && !m_labelRaster->isValid() && !saved.labels.isEmpty())
+        loadLabels(saved.labels);
+
+    showStatus(QString("Saved map into file: %1").arg(filename));
 }
 
 void InteractiveMap::loadFrom(const QString &filename)
 {
-    QFile file (filename);
-    if (file.open(QIODevice::ReadOnly))
+    // Bundle is mounted (once), then its root map is opened, the other files are resolved from the bundle.
+    if (QFileInfo(filename).suffix() == "imb")
+    {
+        QString root = MapBundle::mount(filename);
+        if (!root.isEmpty())
+            loadFrom(root);
+
+        return;
+    }
+
+    // Recently visited maps are taken from the cache (with decoded background), the others are read from disk.
+    // Loading the current map again always reads it from disk.
+    MapDocument loaded;
+    TiledBackground* background = nullptr;
+
+    // Local maps of the previous map are not needed anymore.
+    m_mapPrefetcher->clear();
+
+    // The files, that are read from here until the map is loaded, are reported.
+    m_readsBeforeLoad = ImfFormat::readCount() + LegendLoader::readCount();
+
+    bool cached = filename != m_currentMapFilename && m_mapCache->take(filename, loaded, background);
+
+    if (cached || ImfFormat::readFile(filename, loaded))
     {
-        QDataStream stream (&file);
+        // The map, that is left, goes to the cache, so returning to it doesn't touch the disk.
+        if (!m_currentMapFilename.isEmpty() && filename != m_currentMapFilename)
+            m_mapCache->insert(m_currentMapFilename, m_currentDocument, takeBackground());
 
         // Store the filename of current map.
         m_currentMapFilename = filename;
+        m_currentDocument = loaded;
 
         // Special case for global maps:
+        // the global map is the root of the tree, so its hierarchy is indexed (only the changed maps are parsed again).
         if (QFileInfo(filename).fileName().startsWith("g_"))
+        {
             m_globalIMF.clear();
+            m_hierarchy->build(filename);
+        }
 
-        // Push the filename of loading map into the history list.
+        // The maps, that are known to the hierarchy index, get their breadcrumb (the path from the global map),
+        // so any map deep in the tree could be opened directly.
+        // Otherwise push the filename of loading map into the history list.
         // It will be used to move across local maps in both directions:
         // - from global to local or from local to global.
-        ++m_currentLevel;
-        m_globalIMF.append(filename);
+        if (m_hierarchy->contains(filename))
+        {
+            m_globalIMF = m_hierarchy->breadcrumb(filename);
+            m_currentLevel = m_globalIMF.size();
+        }
+        else
+        {
+            ++m_currentLevel;
+            m_globalIMF.append(filename);
+        }
 
         // Clear all the objects, that are in the scene currently.
         defaultButtons();
-        clearObjects();
-
-        stream >> *this;
+        loadDocument(loaded, background);
 
-        file.close();
+        prefetchLocalMaps();
     }
 
     m_details->setRegionOfInterest(nullptr);
     m_details->hide();
 }
 
-// Serialization friend functions
-QDataStream& operator<<(QDataStream& out, const InteractiveMap& im)
+void InteractiveMap::prefetchLocalMaps()
 {
-    out << im.m_backgroundPath;
+    // Local maps of the regions in the viewport go first, the others are prepared, while the budget allows.
+    const QList<RegionOfInterest*> visible = regionsIn(mapToScene(viewport()->rect()).boundingRect());
 
-    out << im.m_regions->size();
-    for (int i = 0; i < im.m_regions->size(); ++i)
-        out << *im.m_regions->at(i);
+    QSet<QString> requested;
+    for (RegionOfInterest* roi : visible)
+    {
+        if (!roi->localMap().isEmpty())
+        {
+            m_mapPrefetcher->prefetch(roi->localMap(), MapPrefetcher::VIEWPORT);
+            requested.insert(roi->localMap());
+        }
+    }
 
-    return out;
+    // In virtualization mode most of the regions have no items, so their local maps are taken from the store.
+    QStringList nearby;
+    if (b_virtualized)
+    {
+        nearby = m_regionStore->localMaps(PREFETCH_MAPS);
+    }
+    else
+    {
+        for (int i = 0; i < m_regions->size() && nearby.size() < PREFETCH_MAPS; ++i)
+            if (!m_regions->at(i)->localMap().isEmpty())
+                nearby.append(m_regions->at(i)->localMap());
+    }
+
+    for (int i = 0; i < nearby.size() && requested.size() < PREFETCH_MAPS; ++i)
+    {
+        if (requested.contains(nearby.at(i)))
+            continue;
+
+        m_mapPrefetcher->prefetch(nearby.at(i), MapPrefetcher::NEARBY);
+        requested.insert(nearby.at(i));
+    }
 }
 
-QDataStream& operator>>(QDataStream& in, InteractiveMap& im)
+MapDocument InteractiveMap::document() const
+{
+    MapDocument document;
+    document.backgroundPath = m_backgroundPath;
+
+    if (b_virtualized)
+    {
+        // Items hold the latest state of their regions, the others are in the store.
+        // The store itself isn't touched: the items write their state back, when they are recycled.
+        const QVector<int> ids = m_regionStore->ids();
+        document.regions.reserve(ids.size());
+        for (int id : ids)
+        {
+            RegionOfInterest* region = m_liveRegions.value(id);
+            document.regions.append(region ? recordFor(region) : m_regionStore->record(id));
+        }
+    }
+    else
+    {
+        document.regions.reserve(m_regions->size());
+        for (int i = 0; i < m_regions->size(); ++i)
+            document.regions.append(recordFor(m_regions->at(i)));
+    }
+
+    // The label raster is kept, while the regions are placed as it describes them (it could be imported from the mask),
+    // otherwise it is left to the caller to generate it again (see {needsLabels}).
+    if (m_labelRaster->isValid())
+        document.labels = m_labels;
+
+    return document;
+}
+
+RegionRecord InteractiveMap::recordFor(RegionOfInterest *roi) const
 {
-    QString backgroundPath;
-    int countOfRegions;
+    RegionRecord record;
+    record.shapeType = roi->shapeType();
+    record.position  = roi->pos();
+    record.bounds    = roi->boundingRect();
+    record.contents  = roi->attachedFile();
+    record.localMap  = roi->localMap();
+
+    return record;
+}
 
-    in >> backgroundPath >> countOfRegions;
+void InteractiveMap::loadDocument(const MapDocument &document, TiledBackground* background)
+{
+    clearObjects();
 
-    im.clearObjects();
-    im.setBackground(backgroundPath);
+    // Cached background is used as is, otherwise the image is decoded again.
+    if (background && background->source() == document.backgroundPath)
+        setBackground(background);
+    else
+    {
+        delete background;
+        setBackground(document.backgroundPath);
+    }
 
-    RegionOfInterest currentRegion;
-    for (int i = 0; i < countOfRegions; ++i)
+    // Large maps are virtualized: the regions go to the store, only the visible ones become items.
+    b_virtualized = document.regions.size() >= m_virtualizationThreshold;
+    if (b_virtualized)
     {
-        in >> currentRegion;
-        im.addRegion(new RegionOfInterest(currentRegion));
+        m_regionStore->reserve(document.regions.size());
+        for (const RegionRecord& record : document.regions)
+            m_regionStore->add(record);
+
+        m_regionLayer->setVisible(b_regionLayer);
+        m_regionLayer->update();
+
+        loadLabels(document.labels);
+        updateVirtualRegions();
+        reportStats();
+        return;
     }
 
+    // Each region is built once from its record (strings are shared, not copied),
+    // so every legend file is read once per load.
+    m_regions->reserve(m_regions->size() + document.regions.size());
+    for (const RegionRecord& record : document.regions)
+        addRegion(new RegionOfInterest(record.shapeType, record.bounds, record.position, record.contents, record.localMap));
+
+    loadLabels(document.labels);
+    reportStats();
+}
+
+void InteractiveMap::reportStats()
+{
+    // The memory of the regions is measured by the benchmark (see benchmarks/regionmemory),
+    // here only the estimate of the store is shown, it's counted from its arrays without touching the heap.
+    int filesRead = ImfFormat::readCount() + LegendLoader::readCount() - m_readsBeforeLoad;
+    m_readsBeforeLoad += filesRead;
+
+    QString stats = QString("%1: ").arg(QDateTime::currentDateTime().time().toString("hh:mm"));
+    if (b_virtualized)
+        stats += QString("Regions: %1 (virtualized, %2 bytes per region)")
+                .arg(m_regionStore->size())
+                .arg(m_regionStore->memoryUsage() / qMax(1, m_regionStore->size()));
+    else
+        stats += QString("Regions: %1").arg(m_regions->size());
+
+    stats += QString(", %1 files read").arg(filesRead);
+
+    // The map could be loaded, before the HUD is made.
+    if (QGraphicsButtonItem* statusbar = findButton("Statusbar"))
+        statusbar->setText(stats);
+}
+
+// Serialization friend functions
+// The map is always written in the current IMF version, but both current and legacy versions could be read.
+QDataStream& operator<<(QDataStream& out, const InteractiveMap& im)
+{
+    // The stream is written at once, so the raster is generated right here.
+    MapDocument document = im.document();
+    if (im.needsLabels())
+        document.labels = LabelRaster::generate(document.regions, im.labelArea(document));
+
+    QByteArray data = ImfFormat::write(document);
+    out.writeRawData(data.constData(), data.size());
+
+    return out;
+}
+
+QDataStream& operator>>(QDataStream& in, InteractiveMap& im)
+{
+    // The rest of the stream is read at once, then parsed from memory.
+    MapDocument document;
+    if (in.device() && ImfFormat::read(in.device()->readAll(), document))
+        im.loadDocument(document);
+    else
+        in.setStatus(QDataStream::ReadCorruptData);
+
     return in;
 }
 
@@ -898,12 +1777,14 @@ void InteractiveMap::onAddRegion()
 
     QGraphicsButtonItem* makeRegionButton = findButton("Add region");
 
+    // The button is in HUD, so its position is mapped to the scene.
     qreal size  = 50.0f;
     qreal shift = 20.0f;
-    qreal x = makeRegionButton->pos().x() + 0.0f;
-    qreal y = makeRegionButton->pos().y() + makeRegionButton->boundingRect().height() + shift;
+    QPointF below = mapToScene(QPoint(makeRegionButton->pos().x(), makeRegionButton->pos().y() + makeRegionButton->boundingRect().height() + shift));
+    qreal x = below.x();
+    qreal y = below.y();
 
-    RegionOfInterest* regionExists = dynamic_cast<RegionOfInterest*>(m_scene->itemAt(x + size/2.0f, y + size/2.0f, QTransform()));
+    RegionOfInterest* regionExists = regionAt(QPointF(x + size/2.0f, y + size/2.0f));
     if (!regionExists)
     {
         RegionOfInterest* region = addRegion(QSize(size, size));
@@ -911,6 +1792,68 @@ void InteractiveMap::onAddRegion()
     }
 }
 
+void InteractiveMap::onLegendLoaded(const QString &filename, const QString &text)
+{
+    // Only the selected region needs the text right now, the others will take it from the loader, when selected.
+    // The delivered text is passed to the details as is, so it's shown, even if the cache doesn't keep it.
+    if (m_selectedRegion && m_selectedRegion->attachedFile() == filename)
+    {
+        m_selectedRegion->setDetailsLoaded();
+        m_details->setContents(text);
+    }
+}
+
+void InteractiveMap::onVirtualizationTimeout()
+{
+    updateVirtualRegions();
+}
+
+void InteractiveMap::onMaskImported()
+{
+    MaskImporter::Result result = m_maskImporter->takeResult();
+    findButton("Statusbar")->setText(QString("%1: Imported regions from mask: %2").arg(QDateTime::currentDateTime().time().toString("hh:mm")).arg(result.regions.size()));
+
+    if (result.regions.isEmpty())
+        return;
+
+    // The imported regions are added to the document, which is loaded again,
+    // so the map is virtualized, if it has become large enough.
+    // The mask is put over the label raster of the map (the imported regions are listed after the present ones),
+    // without the raster of the map (e.g. the regions were edited since it was made) the present regions stay UNCOVERED,
+    // so they are picked by geometry.
+    MapDocument merged = document();
+    merged.labels = LabelRaster::merge(merged.labels, result.labels, quint32(merged.regions.size()));
+    merged.regions += result.regions;
+    loadDocument(merged, takeBackground());
+}
+
+void InteractiveMap::onHudChanged(const QList<QRectF> &rects)
+{
+    // HUD coordinates are the viewport ones.
+    for (const QRectF& rect : rects)
+        viewport()->update(rect.toAlignedRect().adjusted(-1, -1, 1, 1));
+}
+
+void InteractiveMap::onHierarchyReady()
+{
+    // Replace the history of current map with its breadcrumb.
+    if (m_hierarchy->contains(m_currentMapFilename))
+    {
+        m_globalIMF = m_hierarchy->breadcrumb(m_currentMapFilename);
+        m_currentLevel = m_globalIMF.size();
+    }
+}
+
+const HierarchyIndex *InteractiveMap::hierarchy() const
+{
+    return m_hierarchy;
+}
+
+const QStringList &InteractiveMap::breadcrumb() const
+{
+    return m_globalIMF;
+}
+
 void InteractiveMap::onGlobalMap()
 {
     qDebug() << "Global map button reaction";
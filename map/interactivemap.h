@@ -9,13 +9,27 @@
 #include <QRubberBand>
 #include <QPixmap>
 #include <QList>
+#include <QSet>
 
 #include <QTimer>
+#include <QThreadPool>
 
 #include "regionofinterest.h"
 #include "dialogs/legendinfodialog.h"
 #include "helpers/qgraphicsbuttonitem.h"
 #include "details/details.h"
+#include "background/tiledbackground.h"
+#include "helpers/quadtree.h"
+#include "io/mapdocument.h"
+#include "io/mapcache.h"
+#include "io/mapprefetcher.h"
+#include "io/hierarchyindex.h"
+#include "io/mapbundle.h"
+#include "regions/regionstore.h"
+#include "regions/regionlayer.h"
+#include "regions/labelraster.h"
+#include "regions/maskimporter.h"
+#include "legend/legendloader.h"
 
 // 1. We could collapse both images and draw them on widget using paint event or something like that,
 //    but for simplicity reasons the canvas will be used. Besides, this would allow to easily make
@@ -46,18 +60,35 @@ public:
     void mouseMoveEvent(QMouseEvent *event) override;
     void mouseReleaseEvent(QMouseEvent *event) override;
     void mouseDoubleClickEvent(QMouseEvent *event) override;    
+    void resizeEvent(QResizeEvent *event) override;
+    void scrollContentsBy(int dx, int dy) override;
+    void drawForeground(QPainter *painter, const QRectF &rect) override;
+    bool viewportEvent(QEvent *event) override;
 
     void setBackground (const QString& filename);
+    void setBackgroundBudget (int megabytes);
+    void setMapCacheBudget (int megabytes);
+    void setVirtualizationThreshold (int regions);
+    bool isVirtualized() const;
+    void setRegionLayer (bool enabled);
+    void setLabelRaster (bool enabled);
+    bool importLabelMask (const QString& filename);
+    void importMask (const QString& filename);
     void setRegionShape (const RegionOfInterest::ShapeType& pathType);
 
     // Serialization methods
     void save();
     void saveAs   (const QString& filename);
     void loadFrom (const QString& filename);
+    MapDocument document() const;
+    const HierarchyIndex* hierarchy() const;
+    const QStringList& breadcrumb() const;
+    void loadDocument (const MapDocument& document, TiledBackground* background = nullptr);
 
     // Helper methods
     void fillWithTestData();
     void updateRegions();
+    void showStatus (const QString& message);
 
 
 protected:
@@ -71,6 +102,8 @@ private:
     void makeDetails();
     void makeButtons();
     void makeRegions();
+    void makeLegends();
+    void makeMapCache();
     void defaults();
 
     // Cleaning methods
@@ -85,6 +118,10 @@ private:
     void defaultButtons();
     void defaultRegions();
 
+    // Hover methods (change the state of previous and new hovered items only)
+    void hoverButton (QGraphicsButtonItem* button);
+    void hoverRegion (RegionOfInterest* region);
+
     // Update methods
     void updateDetailsPositions(bool updateText);
     void updateButtons();
@@ -97,25 +134,94 @@ private:
     const int HEIGHT = 1000;
     QGraphicsScene *m_scene;
 
+    // HUD (buttons and details) lives in its own scene in viewport coordinates and is drawn over the map,
+    // so panning and zooming never move its items or touch the index of the map scene.
+    QGraphicsScene *m_hud;
+
     // Background and foreground:
-    // - background image used a map
+    // - background image used a map (it is split into tiles, that are decoded only when visible)
     // - generated  image used to represent roi, that could be collapsed with background and saved for other purposes
     // - filename for background map, used to store the IMF file
     // collapse the regions with background and store it as a separate pixmap
     // QGraphicsPixmapItem *m_foreground;
-    QGraphicsPixmapItem *m_background;
-    QString              m_backgroundPath;
+    TiledBackground *m_background;
+    QString          m_backgroundPath;
+    int              m_backgroundBudget = TiledBackground::DEFAULT_BUDGET;
+    void setBackground (TiledBackground* background);
+    TiledBackground* takeBackground();
 
     // Regions of interest:
     // - methods to add\remove roi
     // - methods to change\remove connected legend file
+    // - methods to find roi using spatial index (instead of scanning all of them)
     RegionOfInterest* addRegion (RegionOfInterest* rhs);
     RegionOfInterest* addRegion (const QSize& size);
     RegionOfInterest* addRegion (const QPointF& topLeft, const QPointF& bottomRight);
+    RegionOfInterest* regionAt (const QPointF& scenePosition);
+    QList<RegionOfInterest*> regionsIn (const QRectF& sceneRect) const;
+    QList<RegionOfInterest*> regionsNear (const QPointF& scenePosition, qreal radius) const;
+    void setRegionState (RegionOfInterest* region, const RegionOfInterest::State& state);
     void deselectAllRegions ();
     void selectRegion (RegionOfInterest* region);
     QList<RegionOfInterest*> *m_regions;
+    QuadTree<RegionOfInterest*> *m_regionIndex;
+    QSet<RegionOfInterest*> m_activeRegions;
     RegionOfInterest* m_selectedRegion;
+    RegionOfInterest* m_hoveredRegion;
+    RegionOfInterest* attachRegion (RegionOfInterest* roi);
+    void detachRegion (RegionOfInterest* roi);
+    RegionRecord recordFor (RegionOfInterest* roi) const;
+
+    // Virtualization mode (for the maps with many regions):
+    // - all the regions are kept in the store as plain data;
+    // - the region layer draws them all in one item, the regions become items only, when the user points at them;
+    // - without the layer, the regions around the viewport are made into items, the items are recycled, when they leave it;
+    // - the regions, the user interacts with (selected, hovered, moving), are never recycled.
+    void scheduleVirtualRegions();
+    void updateVirtualRegions();
+    RegionOfInterest* materializeRegion (int id);
+    void materializeRegionAt (const QPointF& scenePosition);
+    void materializeRegionsIn (const QRectF& sceneRect);
+    void recycleRegion (RegionOfInterest* region);
+    RegionStore* m_regionStore;
+    QHash<RegionOfInterest*, int> m_regionIds;
+    QHash<int, RegionOfInterest*> m_liveRegions;
+    QHash<RegionOfInterest*, int> m_regionSlots; // positions of the items in m_regions
+    QVector<RegionOfInterest*> m_regionPool;
+    RegionLayer* m_regionLayer;
+    bool b_regionLayer = true;
+    QTimer m_virtualizationTimer;
+    bool b_virtualized = false;
+    int m_virtualizationThreshold = 5000;
+    static constexpr qreal VIRTUAL_MARGIN = 0.5; // part of the viewport size
+    static constexpr int REGION_POOL_SIZE = 256;
+
+    // Label raster (region id buffer) gives the region under the cursor with one lookup in view mode:
+    // - it is used, while the regions are placed as the raster describes them (editing the map drops it);
+    // - index of the region in the document is resolved to the item (or to the store id in virtualization mode);
+    // - saving the map generates the raster again (off GUI thread), if the map had it (or it is enabled for all the maps);
+    // - the raster is mapped from the cache file, until it's ready the bands are unpacked, when the user points at them.
+    void loadLabels (const LabelData& labels);
+    void dropLabels();
+    bool needsLabels() const;
+    QRectF labelArea (const MapDocument& document) const;
+    RegionOfInterest* labeledRegion (int index);
+    LabelRaster* m_labelRaster;
+    LabelData m_labels;
+    QVector<RegionOfInterest*> m_labelRegions;
+    QVector<int> m_labelIds;
+    bool b_labelRaster = false;
+    int m_labelsVersion = 0; // changes, when the labels are dropped
+
+    // Regions are made from the colour-coded mask in the background and added to the map at once.
+    MaskImporter* m_maskImporter;
+
+    // Legends of regions are loaded on demand (when the region is selected), neighbours are prefetched.
+    void requestContents (RegionOfInterest* region);
+    void prefetchContentsNear (RegionOfInterest* region);
+    LegendLoader* m_legendLoader;
+    static constexpr qreal PREFETCH_RADIUS = 200.0;
+    static constexpr int PREFETCH_COUNT = 8;
 
     // Buttons:
     // These are used to generate standard regions, when are clicked. And draw some statistics on used objects.    
@@ -123,6 +229,7 @@ private:
     QGraphicsButtonItem* findButton (const QGraphicsButtonItem::State& state);
     QGraphicsButtonItem* findButton (const QString& name);
     QList<QGraphicsButtonItem*> *m_buttons;
+    QGraphicsButtonItem* m_hoveredButton;
 
     // Details:
     Details *m_details;
@@ -133,8 +240,10 @@ private:
     QPoint m_mouseOldPosition;
 
     // Global-local maps
+    // - the history list is replaced by the breadcrumb from the hierarchy index, when the map is known to it.
     int m_currentLevel = 0;
     QStringList m_globalIMF;
+    HierarchyIndex* m_hierarchy;
 
     // Editor:
     RegionOfInterest::ShapeType m_currentShape;
@@ -152,7 +261,24 @@ private:
     float m_scaleFactor = 1.2f;
 
     // Saving, loading
+    // - recently visited maps are kept in memory, so the navigation between global and local maps is instant;
+    // - the document of current map (as it was loaded or saved) goes to the cache, when another map is opened.
     QString m_currentMapFilename;
+    MapDocument m_currentDocument;
+    MapCache* m_mapCache;
+
+    // Maps are written off GUI thread (with the label raster, that is generated for them), one at a time.
+    QThreadPool m_savePool;
+
+    // The size of loaded map is shown in the status bar,
+    // together with the count of files, that were read (by any thread) to load it.
+    void reportStats();
+    int m_readsBeforeLoad = 0;
+
+    // Local maps, linked to the regions, are prepared in the background, so opening them is instant.
+    void prefetchLocalMaps();
+    MapPrefetcher* m_mapPrefetcher;
+    static constexpr int PREFETCH_MAPS = 8;
 
 signals:
     void modeChanged (const QString& mode);
@@ -161,6 +287,12 @@ signals:
 public slots:
     void onAddRegion();
     void onGlobalMap();
+    void onHierarchyReady();
+    void onHudChanged (const QList<QRectF>& rects);
+    void onMaskImported();
+    void onVirtualizationTimeout();
+    void onLegendLoaded (const QString& filename, const QString& text);
+    void onSaved (const QString& filename, const MapDocument& saved, bool written, int version);
 };
 
 #endif // INTERACTIVEMAP_H
@@ -0,0 +1,349 @@
+#include "hierarchyindex.h"
+
+#include <QCoreApplication>
+#include <QImageReader>
+#include <QDataStream>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QPointer>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QFile>
+#include <QSet>
+
+#include <functional>
+
+#include "imfformat.h"
+#include "mapbundle.h"
+
+namespace
+{
+    const quint32 INDEX_MAGIC = 0x494D4649; // "IMFI"
+    const quint16 INDEX_VERSION = 1;
+
+    qint64 modifiedTime(const QString& filename)
+    {
+        // Bundled files change together with their bundle.
+        QFileInfo info (MapBundle::container(filename));
+        return info.exists() ? info.lastModified().toMSecsSinceEpoch() : 0;
+    }
+
+    // ScanJob makes the node of a single map (or takes the previous one, if neither map nor background has changed).
+    class ScanJob : public QRunnable
+    {
+    public:
+        ScanJob(const QString& filename, const HierarchyIndex::Nodes* previous, HierarchyIndex::Nodes* nodes, QMutex* mutex)
+            : m_filename(filename), m_previous(previous), m_nodes(nodes), m_mutex(mutex)
+        {
+        }
+
+        void run() override
+        {
+            qint64 modified = modifiedTime(m_filename);
+            if (modified == 0)
+                return;
+
+            MapNode node;
+            auto previous = m_previous->constFind(m_filename);
+            if (previous != m_previous->constEnd() && previous->modified == modified &&
+                previous->backgroundModified == modifiedTime(previous->backgroundPath))
+            {
+                node = previous.value();
+            }
+            else
+            {
+                MapDocument document;
+                if (!ImfFormat::readFile(m_filename, document))
+                    return;
+
+                node.filename = m_filename;
+                node.backgroundPath = document.backgroundPath;
+                QScopedPointer<QIODevice> device (MapBundle::openResource(document.backgroundPath));
+                node.backgroundSize = QImageReader(device.data()).size();
+                node.regionCount = document.regions.size();
+                node.modified = modified;
+                node.backgroundModified = modifiedTime(document.backgroundPath);
+
+                for (const RegionRecord& record : qAsConst(document.regions))
+                    if (!record.localMap.isEmpty() && !node.children.contains(record.localMap))
+                        node.children.append(record.localMap);
+            }
+
+            // Parents are restored from the children after the scan.
+            node.parents.clear();
+
+            QMutexLocker locker (m_mutex);
+            m_nodes->insert(m_filename, node);
+        }
+
+    private:
+        QString m_filename;
+        const HierarchyIndex::Nodes* m_previous;
+        HierarchyIndex::Nodes* m_nodes;
+        QMutex* m_mutex;
+    };
+
+    // BuildJob loads the stored index, scans the tree and stores the updated index.
+    class BuildJob : public QRunnable
+    {
+    public:
+        BuildJob(const QString& root, std::function<void(const HierarchyIndex::Nodes&)> done)
+            : m_root(root), m_done(done)
+        {
+        }
+
+        void run() override
+        {
+            HierarchyIndex::Nodes previous;
+            HierarchyIndex::load(m_root, previous);
+
+            HierarchyIndex::Nodes nodes = HierarchyIndex::scan(m_root, previous);
+
+            // Don't rewrite the index, if nothing has changed.
+            bool changed = nodes.size() != previous.size();
+            for (auto it = nodes.constBegin(); !changed && it != nodes.constEnd(); ++it)
+            {
+                auto old = previous.constFind(it.key());
+                changed = old == previous.constEnd() || old->modified != it->modified || old->backgroundModified != it->backgroundModified;
+            }
+
+            if (changed)
+                HierarchyIndex::save(m_root, nodes);
+
+            std::function<void(const HierarchyIndex::Nodes&)> done = m_done;
+            QMetaObject::invokeMethod(QCoreApplication::instance(), [done, nodes]() { done(nodes); }, Qt::QueuedConnection);
+        }
+
+    private:
+        QString m_root;
+        std::function<void(const HierarchyIndex::Nodes&)> m_done;
+    };
+}
+
+// Serialization of the nodes
+QDataStream& operator<<(QDataStream& out, const MapNode& node)
+{
+    out << node.filename << node.backgroundPath << node.backgroundSize << qint32(node.regionCount)
+        << node.children << node.modified << node.backgroundModified;
+    return out;
+}
+
+QDataStream& operator>>(QDataStream& in, MapNode& node)
+{
+    qint32 regionCount = 0;
+    in >> node.filename >> node.backgroundPath >> node.backgroundSize >> regionCount
+       >> node.children >> node.modified >> node.backgroundModified;
+    node.regionCount = regionCount;
+    return in;
+}
+
+HierarchyIndex::HierarchyIndex(QObject *parent)
+    : QObject(parent)
+{
+    // Builds are rare and the scan itself is parallel, so one thread is enough.
+    m_pool.setMaxThreadCount(1);
+}
+
+HierarchyIndex::~HierarchyIndex()
+{
+    ++m_generation;
+    m_pool.waitForDone();
+}
+
+void HierarchyIndex::build(const QString &root)
+{
+    m_root = root;
+    b_ready = false;
+
+    QPointer<HierarchyIndex> self (this);
+    int generation = ++m_generation;
+    m_pool.start(new BuildJob(root, [self, generation](const Nodes& nodes)
+    {
+        if (!self || self->m_generation != generation)
+            return;
+
+        self->m_nodes = nodes;
+        self->b_ready = true;
+        emit self->ready();
+    }));
+}
+
+bool HierarchyIndex::isReady() const
+{
+    return b_ready;
+}
+
+const QString &HierarchyIndex::root() const
+{
+    return m_root;
+}
+
+bool HierarchyIndex::contains(const QString &filename) const
+{
+    return m_nodes.contains(filename);
+}
+
+MapNode HierarchyIndex::node(const QString &filename) const
+{
+    return m_nodes.value(filename);
+}
+
+QStringList HierarchyIndex::maps() const
+{
+    return m_nodes.keys();
+}
+
+QStringList HierarchyIndex::breadcrumb(const QString &filename) const
+{
+    // Follow the closest parents up to the root (maps could link each other, so stop on cycles).
+    QStringList path;
+    QSet<QString> visited;
+
+    QString current = filename;
+    while (m_nodes.contains(current) && !visited.contains(current))
+    {
+        visited.insert(current);
+        path.prepend(current);
+
+        const MapNode& node = m_nodes[current];
+        if (node.parents.isEmpty())
+            break;
+
+        current = node.parents.first();
+    }
+
+    return path;
+}
+
+QStringList HierarchyIndex::descendants(const QString &filename) const
+{
+    QStringList result;
+    QSet<QString> visited {filename};
+
+    QStringList queue = m_nodes.value(filename).children;
+    while (!queue.isEmpty())
+    {
+        QString current = queue.takeFirst();
+        if (visited.contains(current) || !m_nodes.contains(current))
+            continue;
+
+        visited.insert(current);
+        result.append(current);
+        queue.append(m_nodes[current].children);
+    }
+
+    return result;
+}
+
+int HierarchyIndex::totalRegions() const
+{
+    int total = 0;
+    for (auto it = m_nodes.constBegin(); it != m_nodes.constEnd(); ++it)
+        total += it->regionCount;
+
+    return total;
+}
+
+QString HierarchyIndex::indexFilename(const QString &root)
+{
+    QFileInfo info (root);
+    return info.absolutePath() + "/" + info.completeBaseName() + ".imfindex";
+}
+
+bool HierarchyIndex::load(const QString &root, Nodes &nodes)
+{
+    QFile file (indexFilename(root));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream in (&file);
+
+    quint32 magic = 0;
+    quint16 version = 0;
+    in >> magic >> version;
+    if (magic != INDEX_MAGIC || version != INDEX_VERSION)
+        return false;
+
+    quint32 count = 0;
+    in >> count;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i)
+    {
+        MapNode node;
+        in >> node;
+        nodes.insert(node.filename, node);
+    }
+
+    // Damaged index is just ignored, the tree will be scanned from scratch.
+    if (in.status() != QDataStream::Ok)
+    {
+        nodes.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool HierarchyIndex::save(const QString &root, const Nodes &nodes)
+{
+    QFile file (indexFilename(root));
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    QDataStream out (&file);
+    out << INDEX_MAGIC << INDEX_VERSION << quint32(nodes.size());
+    for (auto it = nodes.constBegin(); it != nodes.constEnd(); ++it)
+        out << it.value();
+
+    return out.status() == QDataStream::Ok;
+}
+
+HierarchyIndex::Nodes HierarchyIndex::scan(const QString &root, const Nodes &previous)
+{
+    // The tree is scanned level by level (breadth first), the maps of the same level are handled in parallel.
+    Nodes nodes;
+    QMutex mutex;
+    QThreadPool pool;
+
+    QStringList level {root};
+    QSet<QString> seen {root};
+    QStringList order;
+
+    while (!level.isEmpty())
+    {
+        for (const QString& filename : qAsConst(level))
+            pool.start(new ScanJob(filename, &previous, &nodes, &mutex));
+        pool.waitForDone();
+
+        QStringList next;
+        for (const QString& filename : qAsConst(level))
+        {
+            auto it = nodes.constFind(filename);
+            if (it == nodes.constEnd())
+                continue;
+
+            order.append(filename);
+            for (const QString& child : it->children)
+            {
+                if (!seen.contains(child))
+                {
+                    seen.insert(child);
+                    next.append(child);
+                }
+            }
+        }
+
+        level = next;
+    }
+
+    // Parents are added in the breadth first order, so the first parent of each map is the closest to the root.
+    // Local maps often link back to the global one, but the root never gets parents.
+    for (const QString& filename : qAsConst(order))
+    {
+        const QStringList children = nodes[filename].children;
+        for (const QString& child : children)
+            if (nodes.contains(child) && child != filename && child != root)
+                nodes[child].parents.append(filename);
+    }
+
+    return nodes;
+}
@@ -0,0 +1,74 @@
+#ifndef HIERARCHYINDEX_H
+#define HIERARCHYINDEX_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QStringList>
+#include <QString>
+#include <QHash>
+#include <QSize>
+
+// MapNode is the summary of one map in the tree, as it is stored in the hierarchy index.
+struct MapNode
+{
+    QString filename;
+    QString backgroundPath;
+    QSize   backgroundSize;
+    int     regionCount = 0;
+    QStringList children;   // linked local maps
+    QStringList parents;    // maps, that link this one (the first one is the closest to the root)
+
+    // Modification times (ms since epoch), the node is rebuilt, when any of them changes.
+    qint64 modified = 0;
+    qint64 backgroundModified = 0;
+};
+
+// HierarchyIndex describes the whole tree of global and local maps, starting from the root (global) map.
+// - the tree is scanned once off the GUI thread, the maps of each level are parsed in parallel;
+// - the index is stored next to the root map, so the next scan only checks modification times
+//   and parses the maps (or reads the backgrounds), that were changed since then;
+// - when the scan is finished, {ready} signal is emitted on GUI thread.
+// It allows to open any map of the tree with its breadcrumb (path from the root) and query the tree without touching the disk.
+
+class HierarchyIndex : public QObject
+{
+    Q_OBJECT
+
+public:
+    typedef QHash<QString, MapNode> Nodes;
+
+    HierarchyIndex(QObject* parent = nullptr);
+    ~HierarchyIndex();
+
+    void build (const QString& root);
+    bool isReady() const;
+    const QString& root() const;
+
+    // Queries
+    bool contains (const QString& filename) const;
+    MapNode node (const QString& filename) const;
+    QStringList maps() const;
+    QStringList breadcrumb (const QString& filename) const;
+    QStringList descendants (const QString& filename) const;
+    int totalRegions() const;
+
+    // Persistence
+    static QString indexFilename (const QString& root);
+    static bool load (const QString& root, Nodes& nodes);
+    static bool save (const QString& root, const Nodes& nodes);
+    static Nodes scan (const QString& root, const Nodes& previous);
+
+private:
+    QThreadPool m_pool;
+    QString m_root;
+    Nodes m_nodes;
+    bool b_ready = false;
+
+    // Results of the scans, started before the last {build}, are dropped.
+    int m_generation = 0;
+
+signals:
+    void ready();
+};
+
+#endif // HIERARCHYINDEX_H
@@ -0,0 +1,551 @@
+#include "imfformat.h"
+
+#include <QDataStream>
+#include <QAtomicInt>
+#include <QtEndian>
+#include <QSaveFile>
+#include <QFile>
+#include <QHash>
+
+#include <QDebug>
+
+#include <cstring>
+
+#include "mapbundle.h"
+
+namespace
+{
+    // PNG-like signature: the first byte is non-ASCII and the line endings catch text mode transfers.
+    // Legacy files start with the length of background path, that could never be equal to it.
+    const char MAGIC[] = "\x89IMF\r\n\x1a\n";
+    const int MAGIC_SIZE = 8;
+    const quint16 VERSION = 2;
+    const int HEADER_SIZE = MAGIC_SIZE + 2 + 2 + 4;
+    const int SECTION_ENTRY_SIZE = 4 + 4 + 8 + 8;
+    const int ALIGNMENT = 8;
+
+    const quint8 MAX_SHAPE_TYPE = static_cast<quint8>(RegionOfInterest::ShapeType::CIRCLE);
+
+    // Maps are read by GUI thread and by the background jobs at the same time, all of them are counted.
+    QAtomicInt filesRead;
+
+    // Writer appends little endian values to the growing buffer.
+    class Writer
+    {
+    public:
+        void u8  (quint8  value) { m_data.append(char(value)); }
+        void u16 (quint16 value) { append<quint16>(value); }
+        void u32 (quint32 value) { append<quint32>(value); }
+        void u64 (quint64 value) { append<quint64>(value); }
+
+        void f64 (double value)
+        {
+            quint64 bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            append<quint64>(bits);
+        }
+
+        void bytes (const QByteArray& value) { m_data.append(value); }
+
+        void align()
+        {
+            while (m_data.size() % ALIGNMENT)
+                m_data.append('\0');
+        }
+
+        const QByteArray& data() const { return m_data; }
+
+    private:
+        template <typename T>
+        void append (T value)
+        {
+            char buffer[sizeof(T)];
+            qToLittleEndian<T>(value, buffer);
+            m_data.append(buffer, sizeof(T));
+        }
+
+        QByteArray m_data;
+    };
+
+    // Reader walks over the section of the file. Any read past the end marks it as failed.
+    class Reader
+    {
+    public:
+        Reader(const char* data, qint64 size)
+            : m_data(data), m_size(size)
+        {
+        }
+
+        bool ok() const { return m_ok; }
+        qint64 remaining() const { return m_size - m_position; }
+
+        quint8  u8 () { const char* p = take(1); return p ? quint8(*p) : 0; }
+        quint16 u16() { return fetch<quint16>(); }
+        quint32 u32() { return fetch<quint32>(); }
+        quint64 u64() { return fetch<quint64>(); }
+
+        double f64()
+        {
+            quint64 bits = fetch<quint64>();
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        const char* take (qint64 size)
+        {
+            if (!m_ok || size < 0 || size > remaining())
+            {
+                m_ok = false;
+                return nullptr;
+            }
+
+            const char* result = m_data + m_position;
+            m_position += size;
+            return result;
+        }
+
+        void align()
+        {
+            qint64 padding = (ALIGNMENT - m_position % ALIGNMENT) % ALIGNMENT;
+            take(qMin(padding, remaining()));
+        }
+
+    private:
+        template <typename T>
+        T fetch()
+        {
+            const char* p = take(sizeof(T));
+            return p ? qFromLittleEndian<T>(p) : T(0);
+        }
+
+        const char* m_data;
+        qint64 m_size;
+        qint64 m_position = 0;
+        bool m_ok = true;
+    };
+
+    // StringTable deduplicates the paths: the same legend file is often attached to many regions.
+    class StringTable
+    {
+    public:
+        StringTable()
+        {
+            add(QString());
+        }
+
+        quint32 add (const QString& value)
+        {
+            auto it = m_indices.constFind(value);
+            if (it != m_indices.constEnd())
+                return it.value();
+
+            quint32 index = quint32(m_strings.size());
+            m_strings.append(value);
+            m_indices.insert(value, index);
+
+            return index;
+        }
+
+        QByteArray serialize() const
+        {
+            Writer writer;
+            writer.u32(quint32(m_strings.size()));
+            for (const QString& value : m_strings)
+            {
+                QByteArray utf8 = value.toUtf8();
+                writer.u32(quint32(utf8.size()));
+                writer.bytes(utf8);
+            }
+
+            return writer.data();
+        }
+
+    private:
+        QVector<QString> m_strings;
+        QHash<QString, quint32> m_indices;
+    };
+}
+
+ImfFormat::Version ImfFormat::version(const QByteArray &data)
+{
+    if (data.isEmpty())
+        return Version::UNKNOWN;
+
+    if (data.startsWith(QByteArray(MAGIC, MAGIC_SIZE)))
+        return Version::V2;
+
+    return Version::LEGACY;
+}
+
+bool ImfFormat::read(const QByteArray &data, MapDocument &document)
+{
+    document = MapDocument();
+
+    switch (version(data))
+    {
+        case Version::V2:
+        return readV2(data, document);
+
+        case Version::LEGACY:
+        return readLegacy(data, document);
+
+        case Version::UNKNOWN:
+        break;
+    }
+
+    return false;
+}
+
+bool ImfFormat::readFile(const QString &filename, MapDocument &document)
+{
+    filesRead.ref();
+
+    // Bundled maps are parsed right from the mapped bundle.
+    QByteArray data;
+    if (MapBundle::resource(filename, data))
+        return read(data, document);
+
+    // The whole file is read at once, then the sections are parsed from memory.
+    QFile file (filename);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    data = file.readAll();
+    file.close();
+
+    return read(data, document);
+}
+
+int ImfFormat::readCount()
+{
+    return filesRead.loadAcquire();
+}
+
+QByteArray ImfFormat::write(const MapDocument &document)
+{
+    StringTable strings;
+    int count = document.regions.size();
+
+    Writer background;
+    background.u32(strings.add(document.backgroundPath));
+
+    // Geometry is stored as separate arrays (shape types, positions, bounds),
+    // so each of them could be read in one pass.
+    Writer geometry;
+    geometry.u32(quint32(count));
+    geometry.align();
+    for (const RegionRecord& record : document.regions)
+        geometry.u8(static_cast<quint8>(record.shapeType));
+    geometry.align();
+    for (const RegionRecord& record : document.regions)
+    {
+        geometry.f64(record.position.x());
+        geometry.f64(record.position.y());
+    }
+    for (const RegionRecord& record : document.regions)
+    {
+        geometry.f64(record.bounds.x());
+        geometry.f64(record.bounds.y());
+        geometry.f64(record.bounds.width());
+        geometry.f64(record.bounds.height());
+    }
+
+    Writer content;
+    content.u32(quint32(count));
+    for (const RegionRecord& record : document.regions)
+        content.u32(strings.add(record.contents));
+
+    Writer hierarchy;
+    hierarchy.u32(quint32(count));
+    for (const RegionRecord& record : document.regions)
+        hierarchy.u32(strings.add(record.localMap));
+
+    // Strings are collected by the other sections, so this one is serialized last.
+    QVector<QPair<Section, QByteArray>> sections;
+    sections.append(qMakePair(Section::STRINGS,    strings.serialize()));
+    sections.append(qMakePair(Section::BACKGROUND, background.data()));
+    sections.append(qMakePair(Section::GEOMETRY,   geometry.data()));
+    sections.append(qMakePair(Section::CONTENT,    content.data()));
+    sections.append(qMakePair(Section::HIERARCHY,  hierarchy.data()));
+
+    // Label raster is optional and written only, if the map has it.
+    if (!document.labels.isEmpty())
+    {
+        Writer labels;
+        labels.f64(document.labels.area.x());
+        labels.f64(document.labels.area.y());
+        labels.f64(document.labels.area.width());
+        labels.f64(document.labels.area.height());
+        labels.u32(quint32(document.labels.size.width()));
+        labels.u32(quint32(document.labels.size.height()));
+        labels.u32(quint32(document.labels.bandHeight));
+        labels.u32(quint32(document.labels.bands.size()));
+        for (const QByteArray& band : document.labels.bands)
+        {
+            labels.u32(quint32(band.size()));
+            labels.bytes(band);
+        }
+        sections.append(qMakePair(Section::LABELS, labels.data()));
+    }
+
+    // Header and section table.
+    Writer file;
+    file.bytes(QByteArray(MAGIC, MAGIC_SIZE));
+    file.u16(VERSION);
+    file.u16(0);
+    file.u32(quint32(sections.size()));
+
+    quint64 offset = HEADER_SIZE + SECTION_ENTRY_SIZE * sections.size();
+    for (const auto& section : sections)
+    {
+        offset = (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+        file.u32(static_cast<quint32>(section.first));
+        file.u32(0);
+        file.u64(offset);
+        file.u64(quint64(section.second.size()));
+
+        offset += section.second.size();
+    }
+
+    for (const auto& section : sections)
+    {
+        file.align();
+        file.bytes(section.second);
+    }
+
+    return file.data();
+}
+
+bool ImfFormat::writeFile(const QString &filename, const MapDocument &document)
+{
+    // The map is written into a temporary file, which replaces the old map only when everything is written,
+    // so a failed save never leaves a truncated map on disk.
+    QSaveFile file (filename);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    QByteArray data = write(document);
+    if (file.write(data) != data.size())
+    {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+bool ImfFormat::readV2(const QByteArray &data, MapDocument &document)
+{
+    Reader header (data.constData(), data.size());
+    header.take(MAGIC_SIZE);
+
+    quint16 version = header.u16();
+    header.u16(); // flags
+    quint32 sectionCount = header.u32();
+
+    if (!header.ok() || version != VERSION)
+    {
+        qDebug() << "Unsupported IMF version: " << version;
+        return false;
+    }
+
+    // Locate all the known sections, the unknown ones are just skipped.
+    QHash<quint32, QPair<quint64, quint64>> sections;
+    for (quint32 i = 0; i < sectionCount && header.ok(); ++i)
+    {
+        quint32 id = header.u32();
+        header.u32(); // reserved
+        quint64 offset = header.u64();
+        quint64 size = header.u64();
+
+        if (offset > quint64(data.size()) || size > quint64(data.size()) - offset)
+            return false;
+
+        sections.insert(id, qMakePair(offset, size));
+    }
+
+    if (!header.ok())
+        return false;
+
+    auto sectionReader = [&data, &sections](Section id)
+    {
+        QPair<quint64, quint64> location = sections.value(static_cast<quint32>(id), qMakePair(quint64(0), quint64(0)));
+        return Reader(data.constData() + location.first, qint64(location.second));
+    };
+
+    // Strings
+    QVector<QString> strings;
+    Reader stringsReader = sectionReader(Section::STRINGS);
+    quint32 stringCount = stringsReader.u32();
+    if (stringCount > quint32(stringsReader.remaining() / 4))
+        return false;
+
+    strings.reserve(int(stringCount));
+    for (quint32 i = 0; i < stringCount && stringsReader.ok(); ++i)
+    {
+        quint32 length = stringsReader.u32();
+        const char* utf8 = stringsReader.take(length);
+        strings.append(utf8 ? QString::fromUtf8(utf8, int(length)) : QString());
+    }
+
+    if (!stringsReader.ok())
+        return false;
+
+    bool stringsOk = true;
+    auto string = [&strings, &stringsOk](quint32 index)
+    {
+        if (index >= quint32(strings.size()))
+        {
+            stringsOk = false;
+            return QString();
+        }
+
+        return strings.at(int(index));
+    };
+
+    // Background
+    if (sections.contains(static_cast<quint32>(Section::BACKGROUND)))
+    {
+        Reader background = sectionReader(Section::BACKGROUND);
+        document.backgroundPath = string(background.u32());
+        if (!background.ok())
+            return false;
+    }
+
+    // Geometry
+    Reader geometry = sectionReader(Section::GEOMETRY);
+    quint32 count = geometry.u32();
+    geometry.align();
+
+    // Each region takes at least 1 + 6*8 bytes, so the count could be validated before allocation.
+    if (!geometry.ok() || count > quint32(geometry.remaining() / 49))
+        return false;
+
+    document.regions.resize(int(count));
+    const char* shapes = geometry.take(count);
+    geometry.align();
+    const char* positions = geometry.take(qint64(count) * 2 * 8);
+    const char* bounds = geometry.take(qint64(count) * 4 * 8);
+
+    if (!geometry.ok())
+        return false;
+
+    Reader positionsReader (positions, qint64(count) * 2 * 8);
+    Reader boundsReader (bounds, qint64(count) * 4 * 8);
+    for (quint32 i = 0; i < count; ++i)
+    {
+        RegionRecord& record = document.regions[int(i)];
+
+        quint8 shape = quint8(shapes[i]);
+        if (shape > MAX_SHAPE_TYPE)
+            return false;
+
+        record.shapeType = static_cast<RegionOfInterest::ShapeType>(shape);
+
+        qreal x = positionsReader.f64();
+        qreal y = positionsReader.f64();
+        record.position = QPointF(x, y);
+
+        qreal bx = boundsReader.f64();
+        qreal by = boundsReader.f64();
+        qreal bw = boundsReader.f64();
+        qreal bh = boundsReader.f64();
+        record.bounds = QRectF(bx, by, bw, bh);
+    }
+
+    // Content and hierarchy links (optional, but if present, should describe the same regions).
+    if (sections.contains(static_cast<quint32>(Section::CONTENT)))
+    {
+        Reader content = sectionReader(Section::CONTENT);
+        if (content.u32() != count)
+            return false;
+
+        for (quint32 i = 0; i < count && content.ok(); ++i)
+            document.regions[int(i)].contents = string(content.u32());
+
+        if (!content.ok())
+            return false;
+    }
+
+    if (sections.contains(static_cast<quint32>(Section::HIERARCHY)))
+    {
+        Reader hierarchy = sectionReader(Section::HIERARCHY);
+        if (hierarchy.u32() != count)
+            return false;
+
+        for (quint32 i = 0; i < count && hierarchy.ok(); ++i)
+            document.regions[int(i)].localMap = string(hierarchy.u32());
+
+        if (!hierarchy.ok())
+            return false;
+    }
+
+    // Label raster. It is only an accelerator, so the damaged one is dropped instead of failing the map.
+    if (sections.contains(static_cast<quint32>(Section::LABELS)))
+    {
+        Reader labels = sectionReader(Section::LABELS);
+        qreal x = labels.f64();
+        qreal y = labels.f64();
+        qreal width = labels.f64();
+        qreal height = labels.f64();
+        quint32 columns = labels.u32();
+        quint32 rows = labels.u32();
+        quint32 bandHeight = labels.u32();
+        quint32 bandCount = labels.u32();
+
+        bool valid = labels.ok() && columns > 0 && rows > 0 && columns <= 0x10000 && rows <= 0x10000
+                  && bandHeight > 0 && bandHeight <= 0x10000 && bandCount == (rows + bandHeight - 1) / bandHeight;
+
+        QVector<QByteArray> bands;
+        for (quint32 i = 0; valid && i < bandCount; ++i)
+        {
+            quint32 size = labels.u32();
+            const char* band = labels.take(size);
+            valid = labels.ok() && band;
+
+            if (valid)
+                bands.append(QByteArray(band, int(size)));
+        }
+
+        if (valid)
+        {
+            document.labels.area = QRectF(x, y, width, height);
+            document.labels.size = QSize(int(columns), int(rows));
+            document.labels.bandHeight = int(bandHeight);
+            document.labels.bands = bands;
+        }
+    }
+
+    return stringsOk;
+}
+
+bool ImfFormat::readLegacy(const QByteArray &data, MapDocument &document)
+{
+    // Legacy layout: background path, count of regions and the records,
+    // that were written by operator<< of RegionOfInterest.
+    QDataStream in (data);
+
+    int countOfRegions = 0;
+    in >> document.backgroundPath >> countOfRegions;
+
+    if (in.status() != QDataStream::Ok || countOfRegions < 0)
+        return false;
+
+    for (int i = 0; i < countOfRegions; ++i)
+    {
+        int typeIndex;
+        RegionRecord record;
+
+        in >> typeIndex >> record.position >> record.bounds >> record.contents >> record.localMap;
+
+        if (in.status() != QDataStream::Ok || typeIndex < 0 || typeIndex > MAX_SHAPE_TYPE)
+            return false;
+
+        record.shapeType = static_cast<RegionOfInterest::ShapeType>(typeIndex);
+        document.regions.append(record);
+    }
+
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef IMFFORMAT_H
+#define IMFFORMAT_H
+
+#include <QByteArray>
+#include <QString>
+
+#include "mapdocument.h"
+
+// ImfFormat reads and writes the Interactive Map Format files.
+//
+// Version 2 is a binary container:
+// 1. Header: magic bytes, version, flags and count of sections.
+// 2. Section table: {id, offset, size} for each section, so any section could be found (or skipped) without parsing the others.
+// 3. Sections (aligned to 8 bytes, little endian):
+//    - STRINGS:    table of unique strings (paths), that are referenced by index from other sections;
+//    - BACKGROUND: index of the background image path;
+//    - GEOMETRY:   packed arrays of shape types, positions and bounds of all regions;
+//    - CONTENT:    index of the legend file for each region;
+//    - HIERARCHY:  index of the linked local map for each region;
+//    - LABELS:     optional label raster (covered area, size, height of bands and the compressed bands of rows).
+// Unknown sections are skipped, so older readers could open the files with new sections.
+//
+// Version 1 (legacy) is an unversioned QDataStream of background path and region records.
+// It is still recognized and read, but never written.
+
+class ImfFormat
+{
+public:
+    enum class Version {UNKNOWN = 0, LEGACY = 1, V2 = 2};
+    enum class Section : quint32 {STRINGS = 1, BACKGROUND = 2, GEOMETRY = 3, CONTENT = 4, HIERARCHY = 5, LABELS = 6};
+
+    static Version version (const QByteArray& data);
+
+    static bool read (const QByteArray& data, MapDocument& document);
+    static bool readFile (const QString& filename, MapDocument& document);
+
+    // Count of the maps, read by {readFile} on all the threads (for the load statistics).
+    static int readCount();
+
+    static QByteArray write (const MapDocument& document);
+    static bool writeFile (const QString& filename, const MapDocument& document);
+
+private:
+    static bool readV2 (const QByteArray& data, MapDocument& document);
+    static bool readLegacy (const QByteArray& data, MapDocument& document);
+};
+
+#endif // IMFFORMAT_H
@@ -0,0 +1,401 @@
+#include "mapbundle.h"
+
+#include <QReadWriteLock>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QtEndian>
+#include <QBuffer>
+#include <QDebug>
+#include <QList>
+
+#include <cstring>
+#include <limits>
+
+#include "imfformat.h"
+
+namespace
+{
+    const char MAGIC[8] = {'\x89', 'I', 'M', 'B', '\r', '\n', '\x1a', '\n'};
+    const quint16 VERSION = 1;
+
+    const int HEADER_SIZE = 16;
+    const int ENTRY_SIZE = 32;
+    const int ALIGNMENT = 8;
+
+    // Entries are passed around as QByteArray, which can't be bigger.
+    const qint64 MAX_ENTRY_SIZE = std::numeric_limits<int>::max();
+
+    qint64 aligned(qint64 offset)
+    {
+        return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    template<typename T>
+    T readValue(const uchar* data)
+    {
+        return qFromLittleEndian<T>(data);
+    }
+
+    template<typename T>
+    void writeValue(QByteArray& out, T value)
+    {
+        uchar buffer[sizeof(T)];
+        qToLittleEndian<T>(value, buffer);
+        out.append(reinterpret_cast<const char*>(buffer), sizeof(T));
+    }
+
+    // All the bundles, mounted by the application.
+    struct Mounts
+    {
+        QReadWriteLock lock;
+        QList<MapBundle*> bundles;
+
+        ~Mounts() { qDeleteAll(bundles); }
+    };
+}
+
+Q_GLOBAL_STATIC(Mounts, mounts)
+
+MapBundle::MapBundle()
+{
+}
+
+MapBundle::~MapBundle()
+{
+    close();
+}
+
+bool MapBundle::open(const QString &filename)
+{
+    close();
+
+    m_file.setFileName(filename);
+    if (!m_file.open(QIODevice::ReadOnly))
+        return false;
+
+    m_size = m_file.size();
+    m_data = m_file.map(0, m_size);
+    if (!m_data || m_size < HEADER_SIZE || memcmp(m_data, MAGIC, sizeof(MAGIC)) != 0 || readValue<quint16>(m_data + 8) != VERSION)
+    {
+        qDebug() << "Can't open map bundle: " << filename;
+        close();
+        return false;
+    }
+
+    // Only the entry table is parsed, the data is accessed on demand.
+    quint32 count = readValue<quint32>(m_data + 12);
+    if (HEADER_SIZE + qint64(count) * ENTRY_SIZE > m_size)
+    {
+        close();
+        return false;
+    }
+
+    m_entries.reserve(int(count));
+    for (quint32 i = 0; i < count; ++i)
+    {
+        const uchar* entry = m_data + HEADER_SIZE + i * ENTRY_SIZE;
+
+        Entry e;
+        e.kind = static_cast<Kind>(readValue<quint32>(entry));
+        quint32 nameOffset = readValue<quint32>(entry + 4);
+        quint32 nameSize = readValue<quint32>(entry + 8);
+        e.offset = qint64(readValue<quint64>(entry + 16));
+        e.size   = qint64(readValue<quint64>(entry + 24));
+
+        // The values come from the file, so the sum is never computed: it could overflow.
+        if (qint64(nameOffset) + nameSize > m_size || e.offset < 0 || e.size < 0 || e.offset > m_size || e.size > m_size - e.offset)
+        {
+            close();
+            return false;
+        }
+
+        if (e.size > MAX_ENTRY_SIZE)
+        {
+            qDebug() << "Can't open map bundle, the entry is too large: " << filename << e.size;
+            close();
+            return false;
+        }
+
+        QString name = QString::fromUtf8(reinterpret_cast<const char*>(m_data + nameOffset), int(nameSize));
+        if (i == 0)
+            m_root = name;
+
+        m_entries.insert(name, e);
+    }
+
+    return true;
+}
+
+void MapBundle::close()
+{
+    if (m_data)
+        m_file.unmap(m_data);
+
+    m_data = nullptr;
+    m_size = 0;
+    m_root.clear();
+    m_entries.clear();
+
+    if (m_file.isOpen())
+        m_file.close();
+}
+
+bool MapBundle::isOpen() const
+{
+    return m_data != nullptr;
+}
+
+QString MapBundle::filename() const
+{
+    return m_file.fileName();
+}
+
+const QString &MapBundle::root() const
+{
+    return m_root;
+}
+
+QStringList MapBundle::entries() const
+{
+    return m_entries.keys();
+}
+
+bool MapBundle::contains(const QString &path) const
+{
+    return m_entries.contains(path);
+}
+
+QByteArray MapBundle::data(const QString &path) const
+{
+    // The data isn't copied, it points right into the mapped file.
+    auto it = m_entries.constFind(path);
+    if (it == m_entries.constEnd() || it->offset > m_size || it->size > m_size - it->offset)
+        return QByteArray();
+
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(m_data + it->offset), int(it->size));
+}
+
+bool MapBundle::pack(const QString &rootMap, const QString &bundleFilename, QString* error)
+{
+    auto fail = [error](const QString& reason)
+    {
+        if (error)
+            *error = reason;
+
+        return false;
+    };
+
+    // Collect all the files of the tree, starting from the root map.
+    QStringList files;
+    QHash<QString, Kind> kinds;
+
+    QStringList queue {rootMap};
+    while (!queue.isEmpty())
+    {
+        QString map = queue.takeFirst();
+        if (kinds.contains(map))
+            continue;
+
+        MapDocument document;
+        if (!ImfFormat::readFile(map, document))
+        {
+            if (map == rootMap)
+                return fail(QString("Can't read the root map: %1").arg(map));
+
+            qDebug() << "Can't read local map, it is not bundled: " << map;
+            continue;
+        }
+
+        kinds.insert(map, Kind::MAP);
+        files.append(map);
+
+        if (!document.backgroundPath.isEmpty() && !kinds.contains(document.backgroundPath))
+        {
+            kinds.insert(document.backgroundPath, Kind::IMAGE);
+            files.append(document.backgroundPath);
+        }
+
+        for (const RegionRecord& record : qAsConst(document.regions))
+        {
+            if (!record.contents.isEmpty() && !kinds.contains(record.contents))
+            {
+                kinds.insert(record.contents, Kind::LEGEND);
+                files.append(record.contents);
+            }
+
+            if (!record.localMap.isEmpty())
+                queue.append(record.localMap);
+        }
+    }
+
+    // Missing files (e.g. legends, that were never written) are skipped.
+    QList<QByteArray> names;
+    QList<qint64> sizes;
+    for (int i = 0; i < files.size(); )
+    {
+        QFileInfo info (files[i]);
+        if (!info.exists())
+        {
+            qDebug() << "Can't find the file, it is not bundled: " << files[i];
+            files.removeAt(i);
+            continue;
+        }
+
+        if (info.size() > MAX_ENTRY_SIZE)
+        {
+            qDebug() << "The file is too large, it is not bundled: " << files[i];
+            files.removeAt(i);
+            continue;
+        }
+
+        names.append(files[i].toUtf8());
+        sizes.append(info.size());
+        ++i;
+    }
+
+    // Header, entry table and names.
+    QByteArray head;
+    head.append(MAGIC, sizeof(MAGIC));
+    writeValue<quint16>(head, VERSION);
+    writeValue<quint16>(head, 0);
+    writeValue<quint32>(head, quint32(files.size()));
+
+    qint64 nameOffset = HEADER_SIZE + qint64(files.size()) * ENTRY_SIZE;
+    qint64 dataOffset = nameOffset;
+    for (const QByteArray& name : qAsConst(names))
+        dataOffset += name.size();
+
+    for (int i = 0; i < files.size(); ++i)
+    {
+        dataOffset = aligned(dataOffset);
+
+        writeValue<quint32>(head, quint32(kinds.value(files[i])));
+        writeValue<quint32>(head, quint32(nameOffset));
+        writeValue<quint32>(head, quint32(names[i].size()));
+        writeValue<quint32>(head, 0);
+        writeValue<quint64>(head, quint64(dataOffset));
+        writeValue<quint64>(head, quint64(sizes[i]));
+
+        nameOffset += names[i].size();
+        dataOffset += sizes[i];
+    }
+
+    for (const QByteArray& name : qAsConst(names))
+        head.append(name);
+
+    // The bundle is written into a temporary file, which replaces the target only when everything is written,
+    // so a failure halfway never leaves a truncated bundle on disk.
+    QSaveFile out (bundleFilename);
+    if (!out.open(QIODevice::WriteOnly))
+        return fail(QString("Can't write the bundle: %1").arg(out.errorString()));
+
+    if (out.write(head) != head.size())
+    {
+        out.cancelWriting();
+        return fail(QString("Can't write the bundle: %1").arg(out.errorString()));
+    }
+
+    // The files are copied one by one, so the whole tree is never held in memory.
+    for (int i = 0; i < files.size(); ++i)
+    {
+        QByteArray padding (int(aligned(out.pos()) - out.pos()), '\0');
+        if (out.write(padding) != padding.size())
+        {
+            out.cancelWriting();
+            return fail(QString("Can't write the bundle: %1").arg(out.errorString()));
+        }
+
+        QFile in (files[i]);
+        if (!in.open(QIODevice::ReadOnly))
+        {
+            out.cancelWriting();
+            return fail(QString("Can't read the file, the bundle is not written: %1").arg(files[i]));
+        }
+
+        // The entry table already holds the size of the file, so it shouldn't change meanwhile.
+        qint64 copied = 0;
+        while (!in.atEnd())
+        {
+            QByteArray chunk = in.read(1024 * 1024);
+            if (chunk.isEmpty() || out.write(chunk) != chunk.size())
+                break;
+
+            copied += chunk.size();
+        }
+
+        if (copied != sizes[i])
+        {
+            out.cancelWriting();
+            return fail(QString("Can't copy the file, the bundle is not written: %1").arg(files[i]));
+        }
+    }
+
+    if (!out.commit())
+        return fail(QString("Can't write the bundle: %1").arg(out.errorString()));
+
+    return true;
+}
+
+QString MapBundle::mount(const QString &bundleFilename)
+{
+    QWriteLocker locker (&mounts()->lock);
+
+    for (MapBundle* bundle : qAsConst(mounts()->bundles))
+        if (bundle->filename() == bundleFilename)
+            return bundle->root();
+
+    MapBundle* bundle = new MapBundle();
+    if (!bundle->open(bundleFilename))
+    {
+        delete bundle;
+        return QString();
+    }
+
+    // Bundles, that are mounted later, override the earlier ones.
+    mounts()->bundles.prepend(bundle);
+    return bundle->root();
+}
+
+bool MapBundle::resource(const QString &path, QByteArray &data)
+{
+    QReadLocker locker (&mounts()->lock);
+
+    for (MapBundle* bundle : qAsConst(mounts()->bundles))
+    {
+        if (bundle->contains(path))
+        {
+            data = bundle->data(path);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+QIODevice *MapBundle::openResource(const QString &path)
+{
+    // Bundled files are read from memory, the others from disk.
+    QByteArray data;
+    if (resource(path, data))
+    {
+        QBuffer* buffer = new QBuffer();
+        buffer->setData(data);
+        buffer->open(QIODevice::ReadOnly);
+        return buffer;
+    }
+
+    QFile* file = new QFile(path);
+    file->open(QIODevice::ReadOnly);
+    return file;
+}
+
+QString MapBundle::container(const QString &path)
+{
+    QReadLocker locker (&mounts()->lock);
+
+    for (MapBundle* bundle : qAsConst(mounts()->bundles))
+        if (bundle->contains(path))
+            return bundle->filename();
+
+    return path;
+}
@@ -0,0 +1,70 @@
+#ifndef MAPBUNDLE_H
+#define MAPBUNDLE_H
+
+#include <QStringList>
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+#include <QFile>
+#include <QHash>
+
+// MapBundle is a single file, that holds the whole tree of maps:
+// the IMF files, their background images, legend files and nested local maps.
+//
+// Layout (little endian, blobs aligned to 8 bytes):
+// 1. Header: magic bytes, version, flags and count of entries.
+// 2. Entry table: {kind, name offset, name size, data offset, data size} for each file.
+// 3. Names: original paths of the files (UTF-8), the first entry is the root map.
+// 4. Data: the files as they are.
+//
+// The bundle is read via QFile::map, so the entries are accessed on demand without copying.
+// Mounted bundles are used as a resource resolver: the paths, stored in the maps and legends, are looked up
+// in the mounted bundles first, then on disk, so the maps don't need to be rewritten to be bundled.
+// Bundles stay mounted until the application quits, since the data of their entries is shared, not copied.
+
+class MapBundle
+{
+public:
+    enum class Kind : quint32 {MAP = 1, IMAGE = 2, LEGEND = 3};
+
+    MapBundle();
+    ~MapBundle();
+
+    bool open (const QString& filename);
+    void close();
+    bool isOpen() const;
+
+    QString filename() const;
+    const QString& root() const;
+    QStringList entries() const;
+
+    bool contains (const QString& path) const;
+    QByteArray data (const QString& path) const;
+
+    // Packer: builds the bundle from the existing tree of maps (it takes a while, so it's called off GUI thread).
+    // The reason of the failure is passed back via {error}.
+    static bool pack (const QString& rootMap, const QString& bundleFilename, QString* error = nullptr);
+
+    // Resource resolver
+    static QString mount (const QString& bundleFilename);
+    static bool resource (const QString& path, QByteArray& data);
+    static QIODevice* openResource (const QString& path);
+    static QString container (const QString& path);
+
+private:
+    struct Entry
+    {
+        Kind kind;
+        qint64 offset;
+        qint64 size;
+    };
+
+    QFile m_file;
+    uchar* m_data = nullptr;
+    qint64 m_size = 0;
+
+    QString m_root;
+    QHash<QString, Entry> m_entries;
+};
+
+#endif // MAPBUNDLE_H
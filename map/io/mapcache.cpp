@@ -0,0 +1,70 @@
+#include "mapcache.h"
+
+MapCache::MapCache()
+{
+    setBudget(DEFAULT_BUDGET);
+}
+
+MapCache::~MapCache()
+{
+    clear();
+}
+
+void MapCache::insert(const QString &filename, const MapDocument &document, TiledBackground *background)
+{
+    Entry* entry = new Entry();
+    entry->document = document;
+    entry->background = background;
+
+    // Decoded background takes almost all the memory, the regions are counted roughly.
+    int cost = 1 + document.regions.size() * int(sizeof(RegionRecord)) / 1024 + int(document.labels.compressedSize() / 1024);
+    if (background)
+    {
+        // The preview and a few tiles are enough to show the map instantly, the rest is decoded again, when needed.
+        background->trim(qMin(int(BACKGROUND_BUDGET), qMax(1, budget() / 4)));
+        cost += background->memoryUsage();
+    }
+
+    // QCache takes the ownership and may delete the entry immediately, if it doesn't fit into budget.
+    m_maps.insert(filename, entry, cost);
+}
+
+bool MapCache::take(const QString &filename, MapDocument &document, TiledBackground *&background)
+{
+    Entry* entry = m_maps.take(filename);
+    if (!entry)
+        return false;
+
+    document = entry->document;
+    background = entry->background;
+
+    entry->background = nullptr;
+    delete entry;
+
+    return true;
+}
+
+bool MapCache::contains(const QString &filename) const
+{
+    return m_maps.contains(filename);
+}
+
+void MapCache::remove(const QString &filename)
+{
+    m_maps.remove(filename);
+}
+
+void MapCache::clear()
+{
+    m_maps.clear();
+}
+
+void MapCache::setBudget(int megabytes)
+{
+    m_maps.setMaxCost(qMax(1, megabytes) * 1024);
+}
+
+int MapCache::budget() const
+{
+    return m_maps.maxCost() / 1024;
+}
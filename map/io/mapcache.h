@@ -0,0 +1,55 @@
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include <QString>
+#include <QCache>
+
+#include "mapdocument.h"
+#include "../background/tiledbackground.h"
+
+// MapCache keeps the recently visited maps in memory, so moving between global and local maps
+// (in both directions) doesn't read the IMF file and doesn't decode the background again.
+// Each entry holds:
+// - parsed document of the map (as it was loaded or saved, not the unsaved changes);
+// - background item with its preview and decoded tiles (detached from the scene).
+// Least recently used maps are dropped, when the total size of the entries exceeds the budget.
+// Backgrounds are trimmed to a smaller tile budget before caching, otherwise a well browsed map
+// would cost as much as the whole cache, and QCache would reject exactly the most visited one.
+// The backgrounds are graphics items, so the cache lives on GUI thread.
+
+class MapCache
+{
+public:
+    static constexpr int DEFAULT_BUDGET = 256; // megabytes
+    static constexpr int BACKGROUND_BUDGET = 32; // megabytes of tiles, that are kept for each cached background
+
+    MapCache();
+    ~MapCache();
+
+    // The cache takes the ownership of background (it could be null, if the map has no background).
+    void insert (const QString& filename, const MapDocument& document, TiledBackground* background);
+
+    // Removes the map from the cache and passes its background to the caller.
+    bool take (const QString& filename, MapDocument& document, TiledBackground*& background);
+
+    bool contains (const QString& filename) const;
+    void remove (const QString& filename);
+    void clear();
+
+    void setBudget (int megabytes);
+    int budget() const;
+
+private:
+    struct Entry
+    {
+        ~Entry() { delete background; }
+
+        MapDocument document;
+        TiledBackground* background = nullptr;
+    };
+
+    // Cost is measured in kilobytes.
+    QCache<QString, Entry> m_maps;
+};
+
+#endif // MAPCACHE_H
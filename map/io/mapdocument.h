@@ -0,0 +1,53 @@
+#ifndef MAPDOCUMENT_H
+#define MAPDOCUMENT_H
+
+#include <QVector>
+#include <QString>
+#include <QPointF>
+#include <QRectF>
+#include <QSize>
+#include <QByteArray>
+
+#include "../regionofinterest.h"
+
+// MapDocument is the plain data of interactive map, as it is stored in the IMF file.
+// It doesn't touch the scene or the disk, so it could be parsed, cached or passed between threads freely.
+
+struct RegionRecord
+{
+    RegionOfInterest::ShapeType shapeType = RegionOfInterest::ShapeType::RECTANGLE;
+    QPointF position;
+    QRectF  bounds;
+    QString contents;
+    QString localMap;
+};
+
+// Label raster of the map: each pixel holds the index of the region (plus one) under it, 0 is no region.
+// The pixels are kept compressed by bands of rows, as they are stored in the file (see LabelRaster).
+struct LabelData
+{
+    QRectF area;
+    QSize  size;
+    int bandHeight = 0;
+    QVector<QByteArray> bands;
+
+    bool isEmpty() const { return bands.isEmpty() || size.isEmpty() || bandHeight <= 0; }
+
+    qint64 compressedSize() const
+    {
+        qint64 total = 0;
+        for (const QByteArray& band : bands)
+            total += band.size();
+
+        return total;
+    }
+};
+
+struct MapDocument
+{
+    QString backgroundPath;
+    QVector<RegionRecord> regions;
+    LabelData labels;
+};
+
+#endif // MAPDOCUMENT_H
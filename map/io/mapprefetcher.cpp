@@ -0,0 +1,153 @@
+#include "mapprefetcher.h"
+
+#include <QCoreApplication>
+#include <QImageReader>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QPointer>
+#include <QThread>
+#include <QScopedPointer>
+
+#include "imfformat.h"
+#include "mapbundle.h"
+
+namespace
+{
+    // PrefetchJob parses the map and decodes the preview of its background,
+    // then passes the result back to GUI thread, where the background item could be made.
+    class PrefetchJob : public QRunnable
+    {
+    public:
+        PrefetchJob(const QString& filename, std::function<void(bool, const MapDocument&, const QSize&, const QImage&)> done)
+            : m_filename(filename), m_done(done)
+        {
+        }
+
+        void run() override
+        {
+            // Prefetching should never slow down the map, that is shown.
+            QThread::currentThread()->setPriority(QThread::LowestPriority);
+
+            MapDocument document;
+            QSize imageSize;
+            QImage preview;
+
+            bool read = ImfFormat::readFile(m_filename, document);
+            if (read && !document.backgroundPath.isEmpty())
+            {
+                QScopedPointer<QIODevice> device (MapBundle::openResource(document.backgroundPath));
+                QImageReader reader (device.data());
+                imageSize = reader.size();
+                if (imageSize.isValid())
+                {
+                    reader.setScaledSize(imageSize.scaled(TiledBackground::PREVIEW_SIZE, TiledBackground::PREVIEW_SIZE, Qt::KeepAspectRatio));
+                    preview = reader.read();
+                }
+            }
+
+            std::function<void(bool, const MapDocument&, const QSize&, const QImage&)> done = m_done;
+            QMetaObject::invokeMethod(QCoreApplication::instance(), [done, read, document, imageSize, preview]() { done(read, document, imageSize, preview); }, Qt::QueuedConnection);
+        }
+
+    private:
+        QString m_filename;
+        std::function<void(bool, const MapDocument&, const QSize&, const QImage&)> m_done;
+    };
+}
+
+MapPrefetcher::MapPrefetcher(MapCache *cache, QObject *parent)
+    : QObject(parent), m_cache(cache)
+{
+    m_pool.setMaxThreadCount(1);
+}
+
+MapPrefetcher::~MapPrefetcher()
+{
+    clear();
+    m_pool.waitForDone();
+}
+
+void MapPrefetcher::prefetch(const QString &filename, int priority)
+{
+    if (filename.isEmpty() || filename == m_current || m_cache->contains(filename))
+        return;
+
+    // The map, that couldn't be read, is tried again only after its file is changed.
+    auto failed = m_failed.constFind(filename);
+    if (failed != m_failed.constEnd())
+    {
+        if (failed.value() == QFileInfo(filename).lastModified())
+            return;
+
+        m_failed.remove(filename);
+    }
+
+    // The priority of pending map could only be raised.
+    if (m_pending.value(filename, -1) < priority)
+        m_pending.insert(filename, priority);
+
+    startNext();
+}
+
+void MapPrefetcher::clear()
+{
+    m_pending.clear();
+    m_current.clear();
+    ++m_generation;
+}
+
+bool MapPrefetcher::isIdle() const
+{
+    return m_current.isEmpty() && m_pending.isEmpty();
+}
+
+void MapPrefetcher::startNext()
+{
+    if (!m_current.isEmpty() || m_pending.isEmpty())
+        return;
+
+    // Take the pending map with the highest priority.
+    auto next = m_pending.begin();
+    for (auto it = m_pending.begin(); it != m_pending.end(); ++it)
+        if (it.value() > next.value())
+            next = it;
+
+    m_current = next.key();
+    m_pending.erase(next);
+
+    QPointer<MapPrefetcher> self (this);
+    int generation = m_generation;
+    QString filename = m_current;
+    m_pool.start(new PrefetchJob(filename, [self, generation, filename](bool read, const MapDocument& document, const QSize& imageSize, const QImage& preview)
+    {
+        if (!self || self->m_generation != generation)
+            return;
+
+        self->onPrefetched(filename, read, document, imageSize, preview);
+    }));
+}
+
+void MapPrefetcher::onPrefetched(const QString &filename, bool read, const MapDocument &document, const QSize &imageSize, const QImage &preview)
+{
+    m_current.clear();
+
+    // Otherwise the regions would request it again and again.
+    if (!read)
+        m_failed.insert(filename, QFileInfo(filename).lastModified());
+
+    // The map could have been opened (and cached) in the meantime.
+    // Without the preview the document is cached alone, the background is decoded, when the map is opened.
+    else if (!m_cache->contains(filename))
+    {
+        TiledBackground* background = nullptr;
+        if (!document.backgroundPath.isEmpty() && !preview.isNull())
+        {
+            background = new TiledBackground();
+            background->setSource(document.backgroundPath, imageSize, preview);
+        }
+
+        m_cache->insert(filename, document, background);
+    }
+
+    startNext();
+}
@@ -0,0 +1,57 @@
+#ifndef MAPPREFETCHER_H
+#define MAPPREFETCHER_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QString>
+#include <QImage>
+#include <QHash>
+#include <QDateTime>
+#include <QSize>
+
+#include "mapdocument.h"
+#include "mapcache.h"
+
+// MapPrefetcher prepares the local maps, that the user could open next (the regions know their linked maps).
+// For each requested map it parses the IMF file and decodes the background at preview resolution,
+// then puts the result into MapCache, so opening the map takes it from memory.
+// - only one map is prepared at a time, on a single low priority thread, so it doesn't compete with the visible map;
+// - the pending maps are ordered by priority: hovered regions go first, then the regions in the viewport, then the others;
+// - the priority of already pending map could be raised (e.g. when its region is hovered);
+// - the maps without background (or with the background, that can't be decoded) are cached without it,
+//   the maps, that can't be read, aren't requested again, until their files are changed.
+
+class MapPrefetcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Priority {NEARBY = 0, VIEWPORT = 1, HOVERED = 2};
+
+    MapPrefetcher(MapCache* cache, QObject* parent = nullptr);
+    ~MapPrefetcher();
+
+    void prefetch (const QString& filename, int priority);
+    void clear();
+
+    bool isIdle() const;
+
+private:
+    void startNext();
+    void onPrefetched (const QString& filename, bool read, const MapDocument& document, const QSize& imageSize, const QImage& preview);
+
+    MapCache* m_cache;
+    QThreadPool m_pool;
+
+    // Pending maps with their priorities and the map, that is being prepared now.
+    QHash<QString, int> m_pending;
+    QString m_current;
+
+    // Maps, that couldn't be read, with the modification time of their files.
+    QHash<QString, QDateTime> m_failed;
+
+    // Results of the jobs, started before {clear}, are dropped.
+    int m_generation = 0;
+};
+
+#endif // MAPPREFETCHER_H
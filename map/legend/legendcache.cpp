@@ -0,0 +1,172 @@
+#include "legendcache.h"
+
+#include <QMutexLocker>
+#include <QDateTime>
+#include <QFileInfo>
+
+#include <limits>
+
+#include "legendloader.h"
+#include "../io/mapbundle.h"
+
+Q_GLOBAL_STATIC(LegendCache, globalLegendCache)
+
+LegendCache::Entry::Entry(QHash<QString, QString> *latestKeys, const QString &key, const QString &text)
+    : latestKeys(latestKeys), key(key), text(text)
+{
+}
+
+LegendCache::Entry::~Entry()
+{
+    // The cache deletes the entries under the lock. The path could lead to the newer entry already, then it's kept.
+    for (const QString& filename : qAsConst(filenames))
+        if (latestKeys->value(filename) == key)
+            latestKeys->remove(filename);
+}
+
+LegendCache::LegendCache()
+{
+    setBudget(DEFAULT_BUDGET);
+}
+
+LegendCache *LegendCache::instance()
+{
+    return globalLegendCache();
+}
+
+QString LegendCache::text(const QString &filename)
+{
+    QString key = keyFor(filename);
+    if (key.isEmpty())
+        return QString();
+
+    {
+        QMutexLocker locker (&m_mutex);
+
+        Entry* entry = m_entries.object(key);
+        if (entry)
+        {
+            ++m_hits;
+            if (!entry->filenames.contains(filename))
+                entry->filenames.append(filename);
+
+            m_latestKeys.insert(filename, key);
+            return entry->text;
+        }
+
+        ++m_misses;
+    }
+
+    // The file is read without the lock, so the other threads could use the cache meanwhile.
+    QString text = LegendLoader::readFile(filename);
+    int cost = qMax(1, int(text.size() * sizeof(QChar) / 1024));
+
+    // The text, that is larger, than the whole budget, is rejected by the cache, so it's only returned.
+    QMutexLocker locker (&m_mutex);
+    Entry* entry = new Entry (&m_latestKeys, key, text);
+    entry->filenames.append(filename);
+
+    if (m_entries.insert(key, entry, cost))
+        m_latestKeys.insert(filename, key);
+
+    return text;
+}
+
+bool LegendCache::peek(const QString &filename, QString &text)
+{
+    QMutexLocker locker (&m_mutex);
+
+    auto it = m_latestKeys.constFind(filename);
+    if (it == m_latestKeys.constEnd())
+        return false;
+
+    // The paths of the dropped entries are forgotten together with them.
+    Entry* entry = m_entries.object(it.value());
+    if (!entry)
+        return false;
+
+    text = entry->text;
+    return true;
+}
+
+bool LegendCache::isStale(const QString &filename)
+{
+    QString latest;
+    {
+        QMutexLocker locker (&m_mutex);
+        latest = m_latestKeys.value(filename);
+    }
+
+    // The files, that were never read, can't be stale, so the disk isn't touched for them.
+    return !latest.isEmpty() && keyFor(filename) != latest;
+}
+
+void LegendCache::invalidate(const QString &filename)
+{
+    QMutexLocker locker (&m_mutex);
+
+    QString key = m_latestKeys.take(filename);
+    if (!key.isEmpty())
+        m_entries.remove(key);
+}
+
+void LegendCache::clear()
+{
+    QMutexLocker locker (&m_mutex);
+
+    m_entries.clear();
+    m_latestKeys.clear();
+}
+
+void LegendCache::setBudget(qint64 bytes)
+{
+    QMutexLocker locker (&m_mutex);
+
+    m_entries.setMaxCost(int(qBound<qint64>(1, bytes / 1024, std::numeric_limits<int>::max())));
+}
+
+qint64 LegendCache::budget() const
+{
+    QMutexLocker locker (&m_mutex);
+
+    return qint64(m_entries.maxCost()) * 1024;
+}
+
+qint64 LegendCache::size() const
+{
+    QMutexLocker locker (&m_mutex);
+
+    return qint64(m_entries.totalCost()) * 1024;
+}
+
+quint64 LegendCache::hits() const
+{
+    QMutexLocker locker (&m_mutex);
+
+    return m_hits;
+}
+
+quint64 LegendCache::misses() const
+{
+    QMutexLocker locker (&m_mutex);
+
+    return m_misses;
+}
+
+QString LegendCache::keyFor(const QString &filename)
+{
+    // Bundled files change only together with their bundle.
+    QString container = MapBundle::container(filename);
+    if (container != filename)
+    {
+        QFileInfo bundle (container);
+        return filename + QLatin1Char('|') + QString::number(bundle.lastModified().toMSecsSinceEpoch());
+    }
+
+    // Different paths to the same file (relative, with links) share the same entry.
+    QFileInfo info (filename);
+    if (!info.exists())
+        return QString();
+
+    return info.canonicalFilePath() + QLatin1Char('|') + QString::number(info.lastModified().toMSecsSinceEpoch());
+}
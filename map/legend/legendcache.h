@@ -0,0 +1,75 @@
+#ifndef LEGENDCACHE_H
+#define LEGENDCACHE_H
+
+#include <QStringList>
+#include <QString>
+#include <QCache>
+#include <QMutex>
+#include <QHash>
+
+// LegendCache is the process-wide storage of legend texts.
+// The same legend file is often attached to many regions (and to the regions of different local maps),
+// so it is read once and all of them share one immutable (implicitly shared) buffer.
+// - entries are keyed by canonical path and modification time, so the changed file is never taken from the cache;
+// - least recently used entries are dropped, when the total size exceeds the budget,
+//   together with the paths, that lead to them;
+// - hits and misses are counted to tune the budget.
+// The cache is thread safe: the files are read by the loader threads, and the texts are taken on GUI thread.
+
+class LegendCache
+{
+public:
+    static constexpr qint64 DEFAULT_BUDGET = 64 * 1024 * 1024; // bytes
+
+    LegendCache();
+
+    static LegendCache* instance();
+
+    // Returns the text of the file, reading it only when it isn't cached or has changed on disk.
+    // It checks the file on disk, so better call it outside of GUI thread.
+    QString text (const QString& filename);
+
+    // Returns the last cached text of the file without touching the disk.
+    bool peek (const QString& filename, QString& text);
+
+    // Checks, whether the cached text of the file is older, than the file on disk (touches the disk).
+    bool isStale (const QString& filename);
+
+    void invalidate (const QString& filename);
+    void clear();
+
+    void setBudget (qint64 bytes);
+    qint64 budget() const;
+    qint64 size() const;
+
+    quint64 hits() const;
+    quint64 misses() const;
+
+private:
+    // The entry knows the paths, that lead to it, and forgets them, when the cache deletes it.
+    struct Entry
+    {
+        Entry (QHash<QString, QString>* latestKeys, const QString& key, const QString& text);
+        ~Entry();
+
+        QHash<QString, QString>* latestKeys;
+        QString key;
+        QString text;
+        QStringList filenames;
+    };
+
+    static QString keyFor (const QString& filename);
+
+    mutable QMutex m_mutex;
+
+    // The latest keys of the paths outlive the entries, that refer to them.
+    QHash<QString, QString> m_latestKeys;
+
+    // Cost is measured in kilobytes, since QCache counts it in int.
+    QCache<QString, Entry> m_entries;
+
+    quint64 m_hits = 0;
+    quint64 m_misses = 0;
+};
+
+#endif // LEGENDCACHE_H
@@ -0,0 +1,268 @@
+#include "legendloader.h"
+
+#include <QTextStream>
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QFileInfo>
+#include <QFile>
+
+#include "legendcache.h"
+#include "../io/mapbundle.h"
+
+namespace
+{
+    const int REQUEST_PRIORITY  = 1;
+    const int PREFETCH_PRIORITY = 0;
+
+    // Legends are read by GUI thread and by the jobs, all of them are counted for the load statistics.
+    QAtomicInt filesRead;
+
+    // ReadJob takes the legend text from the cache (reading the file, if needed) and passes it back to the loader on its thread.
+    class ReadJob : public QRunnable
+    {
+    public:
+        ReadJob(LegendLoader* loader, const QString& filename)
+            : m_loader(loader), m_filename(filename)
+        {
+        }
+
+        void run() override
+        {
+            QString text = LegendCache::instance()->text(m_filename);
+
+            QMetaObject::invokeMethod(m_loader, "onRead", Qt::QueuedConnection,
+                                      Q_ARG(QString, m_filename), Q_ARG(QString, text));
+        }
+
+    private:
+        LegendLoader* m_loader;
+        QString m_filename;
+    };
+
+    // RefreshJob compares the watched files with their cached versions and reports the changed ones.
+    class RefreshJob : public QRunnable
+    {
+    public:
+        RefreshJob(LegendLoader* loader, const QStringList& filenames)
+            : m_loader(loader), m_filenames(filenames)
+        {
+        }
+
+        void run() override
+        {
+            QStringList changed;
+            for (const QString& filename : qAsConst(m_filenames))
+                if (LegendCache::instance()->isStale(filename))
+                    changed.append(filename);
+
+            if (!changed.isEmpty())
+                QMetaObject::invokeMethod(m_loader, "onFilesChanged", Qt::QueuedConnection, Q_ARG(QStringList, changed));
+        }
+
+    private:
+        LegendLoader* m_loader;
+        QStringList m_filenames;
+    };
+}
+
+LegendLoader::LegendLoader(QObject *parent)
+    : QObject(parent)
+{
+    // Reading text files is mostly waiting for the disk, a couple of threads is enough.
+    m_pool.setMaxThreadCount(2);
+
+    m_debounce.setSingleShot(true);
+    m_debounce.setInterval(DEBOUNCE_INTERVAL);
+
+    connect(&m_watcher,  SIGNAL(fileChanged(const QString&)), this, SLOT(onFileChanged(const QString&)));
+    connect(&m_watcher,  SIGNAL(directoryChanged(const QString&)), this, SLOT(onDirectoryChanged(const QString&)));
+    connect(&m_debounce, SIGNAL(timeout()), this, SLOT(onDebounced()));
+}
+
+LegendLoader::~LegendLoader()
+{
+    // Jobs refer to the loader, so they should be finished before it is gone.
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+bool LegendLoader::isLoaded(const QString &filename) const
+{
+    QString text;
+    return LegendCache::instance()->peek(filename, text);
+}
+
+bool LegendLoader::peek(const QString &filename, QString &text) const
+{
+    return LegendCache::instance()->peek(filename, text);
+}
+
+void LegendLoader::request(const QString &filename)
+{
+    start(filename, REQUEST_PRIORITY);
+}
+
+void LegendLoader::prefetch(const QString &filename)
+{
+    start(filename, PREFETCH_PRIORITY);
+}
+
+void LegendLoader::invalidate(const QString &filename)
+{
+    LegendCache::instance()->invalidate(filename);
+}
+
+void LegendLoader::clear()
+{
+    LegendCache::instance()->clear();
+}
+
+void LegendLoader::watch(const QString &filename)
+{
+    // Bundled files never change, so they aren't watched.
+    if (filename.isEmpty() || m_watched.contains(filename) || MapBundle::container(filename) != filename)
+        return;
+
+    m_watched.insert(filename);
+
+    // Many legends share the same directory, so it's watched once.
+    QString directory = QFileInfo(filename).absolutePath();
+    auto it = m_directories.find(directory);
+    if (it == m_directories.end())
+    {
+        it = m_directories.insert(directory, QStringList());
+        m_watcher.addPath(directory);
+    }
+
+    it.value().append(filename);
+}
+
+void LegendLoader::unwatchAll()
+{
+    QStringList paths = m_directories.keys() + m_watchedFiles.values();
+    if (!paths.isEmpty())
+        m_watcher.removePaths(paths);
+
+    m_watched.clear();
+    m_directories.clear();
+    m_watchedFiles.clear();
+    m_changed.clear();
+    m_changedDirectories.clear();
+    m_debounce.stop();
+}
+
+void LegendLoader::refresh()
+{
+    if (!m_watched.isEmpty())
+        m_pool.start(new RefreshJob(this, m_watched.values()));
+}
+
+QString LegendLoader::readFile(const QString &filename)
+{
+    filesRead.ref();
+    QString text;
+
+    // Bundled legends are decoded right from the mapped bundle.
+    QByteArray data;
+    if (MapBundle::resource(filename, data))
+    {
+        QTextStream stream (data);
+        return stream.readAll();
+    }
+
+    QFile file (filename);
+    if (file.open(QIODevice::ReadOnly))
+    {
+        QTextStream stream (&file);
+        text = stream.readAll();
+
+        file.close();
+    }
+
+    return text;
+}
+
+int LegendLoader::readCount()
+{
+    return filesRead.loadAcquire();
+}
+
+void LegendLoader::watchFile(const QString &filename)
+{
+    if (!m_watched.contains(filename) || m_watchedFiles.contains(filename))
+        return;
+
+    m_watchedFiles.insert(filename);
+    m_watcher.addPath(filename);
+}
+
+void LegendLoader::start(const QString &filename, int priority)
+{
+    if (filename.isEmpty() || m_pending.contains(filename) || isLoaded(filename))
+        return;
+
+    m_pending.insert(filename);
+    m_pool.start(new ReadJob(this, filename), priority);
+}
+
+void LegendLoader::onRead(const QString &filename, const QString &text)
+{
+    m_pending.remove(filename);
+    watchFile(filename);
+
+    emit loaded(filename, text);
+}
+
+void LegendLoader::onFileChanged(const QString &filename)
+{
+    // Editors often save the file in several steps, so wait a bit, before reading it.
+    m_changed.insert(filename);
+    m_debounce.start();
+}
+
+void LegendLoader::onDirectoryChanged(const QString &directory)
+{
+    m_changedDirectories.insert(directory);
+    m_debounce.start();
+}
+
+void LegendLoader::onDebounced()
+{
+    QStringList changed = m_changed.values();
+    m_changed.clear();
+
+    // Files, that were saved by replacing, may be dropped by the watcher, so they are watched again.
+    for (const QString& filename : qAsConst(changed))
+    {
+        if (m_watchedFiles.contains(filename) && QFileInfo::exists(filename))
+        {
+            m_watcher.removePath(filename);
+            m_watcher.addPath(filename);
+        }
+    }
+
+    // The directory doesn't tell, which of its files were changed, so its legends are compared with the cache.
+    QStringList candidates;
+    for (const QString& directory : qAsConst(m_changedDirectories))
+        candidates += m_directories.value(directory);
+    m_changedDirectories.clear();
+
+    if (!candidates.isEmpty())
+        m_pool.start(new RefreshJob(this, candidates));
+
+    onFilesChanged(changed);
+}
+
+void LegendLoader::onFilesChanged(const QStringList &filenames)
+{
+    // Only the files, that were already loaded, are read again.
+    // The others are just forgotten, they will be read, when needed.
+    for (const QString& filename : filenames)
+    {
+        bool wasLoaded = isLoaded(filename);
+        invalidate(filename);
+
+        if (wasLoaded)
+            request(filename);
+    }
+}
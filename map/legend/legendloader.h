@@ -0,0 +1,81 @@
+#ifndef LEGENDLOADER_H
+#define LEGENDLOADER_H
+
+#include <QObject>
+#include <QFileSystemWatcher>
+#include <QThreadPool>
+#include <QStringList>
+#include <QString>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+
+// LegendLoader reads the legend files of regions on demand and off the GUI thread.
+// Regions keep only the path of their legend, the text itself is requested, when the region is selected
+// (and a few of its neighbours are prefetched with lower priority, since they are likely to be selected next).
+// When the file is read, {loaded} signal is emitted on GUI thread.
+// The texts themselves are kept in the process-wide LegendCache, so they are shared between regions and maps.
+//
+// Legend files of the current map are watched: when some of them are changed on disk (they are often edited
+// while the map is open), the changes are collected for a short while and only the changed files are read again.
+// Maps have thousands of legends, so the directories are watched instead of the files (each watch takes
+// an inotify watch and, on some systems, a file descriptor). When a directory is changed, its legends are compared
+// with the cached versions off the GUI thread. Editors mostly save by replacing the file, which changes the directory;
+// the legends, that were loaded, are watched individually as well, so writing them in place is noticed too.
+// {refresh} does the same check on demand for all the legends.
+
+class LegendLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    LegendLoader(QObject* parent = nullptr);
+    ~LegendLoader();
+
+    bool isLoaded (const QString& filename) const;
+    bool peek (const QString& filename, QString& text) const;
+
+    void request  (const QString& filename);
+    void prefetch (const QString& filename);
+    void invalidate (const QString& filename);
+    void clear();
+
+    void watch (const QString& filename);
+    void unwatchAll ();
+    void refresh ();
+
+    static QString readFile (const QString& filename);
+
+    // Count of the legends, read by {readFile} on all the threads (for the load statistics).
+    static int readCount();
+
+private:
+    void start (const QString& filename, int priority);
+
+    QThreadPool m_pool;
+    QSet<QString> m_pending;
+
+    void watchFile (const QString& filename);
+
+    // Watching the files
+    static constexpr int DEBOUNCE_INTERVAL = 300; // ms
+    QFileSystemWatcher m_watcher;
+    QSet<QString> m_watched;                    // legends of the map
+    QHash<QString, QStringList> m_directories;  // watched directories and the legends in them
+    QSet<QString> m_watchedFiles;               // loaded legends, that are watched individually
+    QSet<QString> m_changed;
+    QSet<QString> m_changedDirectories;
+    QTimer m_debounce;
+
+signals:
+    void loaded (const QString& filename, const QString& text);
+
+private slots:
+    void onRead (const QString& filename, const QString& text);
+    void onFileChanged (const QString& filename);
+    void onDirectoryChanged (const QString& directory);
+    void onDebounced ();
+    void onFilesChanged (const QStringList& filenames);
+};
+
+#endif // LEGENDLOADER_H
@@ -0,0 +1,54 @@
+# Sources of the map itself (without the desktop window), shared by the application and the benchmarks.
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    $$PWD/background/tiledbackground.cpp \
+    $$PWD/details/details.cpp \
+    $$PWD/details/detailstext.cpp \
+    $$PWD/dialogs/legendinfodialog.cpp \
+    $$PWD/helpers/animationclock.cpp \
+    $$PWD/helpers/qgraphicsbuttonitem.cpp \
+    $$PWD/helpers/spritesheet.cpp \
+    $$PWD/helpers/stringpool.cpp \
+    $$PWD/helpers/texteditor.cpp \
+    $$PWD/interactivemap.cpp \
+    $$PWD/io/hierarchyindex.cpp \
+    $$PWD/io/imfformat.cpp \
+    $$PWD/io/mapbundle.cpp \
+    $$PWD/io/mapcache.cpp \
+    $$PWD/io/mapprefetcher.cpp \
+    $$PWD/legend/legendcache.cpp \
+    $$PWD/legend/legendloader.cpp \
+    $$PWD/regionofinterest.cpp \
+    $$PWD/regions/labelraster.cpp \
+    $$PWD/regions/maskimporter.cpp \
+    $$PWD/regions/regionlayer.cpp \
+    $$PWD/regions/regionstore.cpp
+
+HEADERS += \
+    $$PWD/background/tiledbackground.h \
+    $$PWD/details/details.h \
+    $$PWD/details/detailstext.h \
+    $$PWD/dialogs/legendinfodialog.h \
+    $$PWD/helpers/animationclock.h \
+    $$PWD/helpers/qgraphicsbuttonitem.h \
+    $$PWD/helpers/quadtree.h \
+    $$PWD/helpers/shapegeometry.h \
+    $$PWD/helpers/spritesheet.h \
+    $$PWD/helpers/stringpool.h \
+    $$PWD/helpers/texteditor.h \
+    $$PWD/interactivemap.h \
+    $$PWD/io/hierarchyindex.h \
+    $$PWD/io/imfformat.h \
+    $$PWD/io/mapbundle.h \
+    $$PWD/io/mapcache.h \
+    $$PWD/io/mapprefetcher.h \
+    $$PWD/io/mapdocument.h \
+    $$PWD/legend/legendcache.h \
+    $$PWD/legend/legendloader.h \
+    $$PWD/regionofinterest.h \
+    $$PWD/regions/labelraster.h \
+    $$PWD/regions/maskimporter.h \
+    $$PWD/regions/regionlayer.h \
+    $$PWD/regions/regionstore.h
@@ -5,30 +5,47 @@
 #include <QFile>
 
 #include <QPainter>
-#include <QBrush>
 #include <QPen>
 
 #include <QDebug>
 
+#include "helpers/shapegeometry.h"
+#include "helpers/stringpool.h"
+
 RegionOfInterest::RegionOfInterest(QGraphicsItem *parent)
-    : QGraphicsPathItem (parent)
+    : QGraphicsItem (parent)
 {
+    setFlag(QGraphicsItem::ItemSendsGeometryChanges);
     setState(State::IDLE);
     setShape(ShapeType::RECTANGLE, QRectF(0,0,0,0));
-
-    prepareAnimation();
 }
 
 RegionOfInterest::RegionOfInterest(const RegionOfInterest &rhs, QGraphicsItem *parent)
-    : QGraphicsPathItem (parent)
+    : QGraphicsItem (parent)
 {
+    setFlag(QGraphicsItem::ItemSendsGeometryChanges);
     setState(State::IDLE);
     setShape(rhs.shapeType(), rhs.boundingRect());
     setPos(rhs.pos());
-    setContents(rhs.attachedFile());
-    setLocalMap(rhs.localMap());
 
-    prepareAnimation();
+    // The contents were already read by the original region, so just share them instead of reading the file again.
+    m_contentsId = rhs.m_contentsId;
+    m_localMapId = rhs.m_localMapId;
+    m_textLoaded = rhs.m_textLoaded;
+}
+
+RegionOfInterest::RegionOfInterest(const ShapeType &type, const QRectF &bounds, const QPointF &position,
+                                   QString contents, QString localMap, QGraphicsItem *parent)
+    : QGraphicsItem (parent)
+{
+    // Used when loading the maps: the region is built at once from the loaded data.
+    setFlag(QGraphicsItem::ItemSendsGeometryChanges);
+    setState(State::IDLE);
+    setShape(type, bounds);
+    setPos(position);
+
+    m_localMapId = StringPool::paths()->intern(localMap);
+    setContents(contents);
 }
 
 RegionOfInterest::~RegionOfInterest()
@@ -40,18 +57,60 @@ void RegionOfInterest::paint(QPainter *painter, const QStyleOptionGraphicsItem *
     Q_UNUSED(option);
     Q_UNUSED(widget);
 
-    painter->setPen(m_pen);
-    painter->drawPath(m_shape);    
+    painter->setPen(QPen(m_state == State::ACTIVE ? Qt::green : Qt::white, m_penWidth));
+
+    // The shapes are drawn from the bounds, so the path isn't needed.
+    switch (m_shapeType)
+    {
+        case ShapeType::RECTANGLE:
+        painter->drawRect(m_bounds);
+        break;
+
+        case ShapeType::ROUNDED_RECTANGLE:
+        painter->drawRoundedRect(m_bounds, 10, 10);
+        break;
+
+        case ShapeType::ELLIPSE:
+        case ShapeType::CIRCLE:
+        painter->drawEllipse(outlineFor(m_shapeType, m_bounds));
+        break;
+    }
 }
 
 QRectF RegionOfInterest::boundingRect() const
 {
-    return m_shape.boundingRect();
+    return outlineFor(m_shapeType, m_bounds);
 }
 
 QPainterPath RegionOfInterest::shape() const
 {
-    return m_shape;
+    // Built on demand: the scene asks for it only in rare cases (e.g. selection by arbitrary path).
+    return makeShapeFor(m_shapeType, m_bounds);
+}
+
+bool RegionOfInterest::contains(const QPointF &point) const
+{
+    // Built-in shapes are tested in closed form, the path is used only for painting.
+    return ShapeGeometry::contains(m_shapeType, m_bounds, point);
+}
+
+bool RegionOfInterest::intersects(const QRectF &sceneRect) const
+{
+    // Regions are only moved around the scene, so the rectangle is just shifted into the item coordinates.
+    QTransform transform = sceneTransform();
+    if (transform.type() > QTransform::TxTranslate)
+        return mapToScene(shape()).intersects(sceneRect);
+
+    return ShapeGeometry::intersects(m_shapeType, m_bounds, sceneRect.translated(-transform.dx(), -transform.dy()));
+}
+
+QVariant RegionOfInterest::itemChange(QGraphicsItem::GraphicsItemChange change, const QVariant &value)
+{
+    // Keep the spatial index in sync, when the region is moved around the scene.
+    if (change == ItemPositionHasChanged || change == ItemTransformHasChanged)
+        updateIndex();
+
+    return QGraphicsItem::itemChange(change, value);
 }
 
 const RegionOfInterest::State &RegionOfInterest::state() const
@@ -59,33 +118,36 @@ const RegionOfInterest::State &RegionOfInterest::state() const
     return m_state;
 }
 
-const QString &RegionOfInterest::details() const
+QString RegionOfInterest::name() const
 {
-    return m_text;
+    return m_contentsId == 0 ? QString() : generateNameFor(attachedFile());
+}
+
+bool RegionOfInterest::hasDetails() const
+{
+    return m_textLoaded;
 }
 
 bool RegionOfInterest::hasAttachedFile()
 {
-    return !m_attachedContents.isEmpty();
+    return m_contentsId != 0;
 }
 
 bool RegionOfInterest::hasLocalMap()
 {
-    qDebug() << "This ROI has ALC: " << m_attachedLocalMap;
-
-    return !m_attachedLocalMap.isEmpty();
+    return m_localMapId != 0;
 }
 
 void RegionOfInterest::setLocalMap(const QString &localMap)
 {
-    m_attachedLocalMap = localMap;
+    m_localMapId = StringPool::paths()->intern(localMap);
 
-    qDebug() << "New local map has been set for " << attachedFile() << ": " << m_attachedLocalMap;
+    qDebug() << "New local map has been set for " << attachedFile() << ": " << localMap;
 }
 
-const QString &RegionOfInterest::attachedFile() const
+QString RegionOfInterest::attachedFile() const
 {
-    return m_attachedContents;
+    return StringPool::paths()->string(m_contentsId);
 }
 
 const RegionOfInterest::ShapeType& RegionOfInterest::shapeType() const
@@ -93,40 +155,29 @@ const RegionOfInterest::ShapeType& RegionOfInterest::shapeType() const
     return m_shapeType;
 }
 
-const QString &RegionOfInterest::localMap() const
+QString RegionOfInterest::localMap() const
 {
-    return m_attachedLocalMap;
+    return StringPool::paths()->string(m_localMapId);
 }
 
 void RegionOfInterest::setContents(const QString &filename)
 {
     if (filename.isEmpty())
     {
-        m_attachedContents = "";
-        m_name = "";
-        m_text = "";
-
-        setToolTip("");
+        m_contentsId = 0;
+        m_textLoaded = true;
         return;
     }
 
-    m_attachedContents = filename;
-    m_name = generateNameFor(filename);
-    setToolTip(m_name);
-
-    QFile file (filename);
-    if (file.open(QIODevice::ReadOnly))
-    {
-        QTextStream stream (&file);
-        m_text = stream.readAll();
-
-        file.close();
-    }
+    // Only the path is stored here. The text is loaded on demand (see LegendLoader), when the region is selected,
+    // then it is passed to Details, and the region is marked using {setDetailsLoaded}.
+    m_contentsId = StringPool::paths()->intern(filename);
+    m_textLoaded = false;
 }
 
-void RegionOfInterest::loadDataFormString(const QString &details)
+void RegionOfInterest::setDetailsLoaded()
 {
-    m_text = details;
+    m_textLoaded = true;
 }
 
 void RegionOfInterest::setState(const RegionOfInterest::State &state)
@@ -135,12 +186,14 @@ void RegionOfInterest::setState(const RegionOfInterest::State &state)
     {
         case State::IDLE:
         m_state = State::IDLE;
-        m_pen = QPen(Qt::white);
+        m_penWidth = 1;
+        stopAnimation();
         break;
 
         case State::ACTIVE:
         m_state = State::ACTIVE;
-        m_pen = QPen(Qt::green, 3);
+        m_penWidth = 3;
+        startAnimation(FPS);
         break;
     }
 
@@ -149,16 +202,43 @@ void RegionOfInterest::setState(const RegionOfInterest::State &state)
 
 void RegionOfInterest::setShape(const RegionOfInterest::ShapeType &type, const QRectF& bounds)
 {
+    prepareGeometryChange();
+
     m_shapeType = type;
-    m_shape = makeShapeFor(m_shapeType, bounds);
+    m_bounds = bounds;
+
+    updateIndex();
+}
+
+void RegionOfInterest::assign(const ShapeType &type, const QRectF &bounds, const QPointF &position,
+                              const QString &contents, const QString &localMap)
+{
+    // Used, when the item is reused for another region (see virtualization mode of InteractiveMap).
+    setState(State::IDLE);
+    setShape(type, bounds);
+    setPos(position);
+
+    m_localMapId = StringPool::paths()->intern(localMap);
+    setContents(contents);
+}
+
+void RegionOfInterest::setIndex(QuadTree<RegionOfInterest *> *index)
+{
+    m_index = index;
+
+    updateIndex();
+}
+
+void RegionOfInterest::updateIndex()
+{
+    if (m_index)
+        m_index->update(this, sceneBoundingRect());
 }
 
 QString RegionOfInterest::generateNameFor(const QString &fullPath)
 {
+    // The name is made from the path only, so there is no need to touch the disk for every region.
     QFileInfo fi (fullPath);
-    if (!fi.exists())
-        return "";
-
     QString suffix = fi.suffix();
     QString name = fi.fileName();
     name.truncate(name.indexOf(suffix) - 1);
@@ -206,12 +286,16 @@ QPainterPath RegionOfInterest::makeShapeFor(const RegionOfInterest::ShapeType &t
     return path;
 }
 
-void RegionOfInterest::prepareAnimation()
+QRectF RegionOfInterest::outlineFor(const RegionOfInterest::ShapeType &type, const QRectF &bounds)
 {
-    int fps = 14;
+    // Only the circle doesn't fill its bounds: it's made the same way, as in {makeShapeFor}.
+    if (type != ShapeType::CIRCLE)
+        return bounds;
+
+    QPoint center = bounds.center().toPoint();
+    int radius = qMin(int(bounds.width() / 2), int(bounds.height() / 2));
 
-    connect (&m_animationTimer, SIGNAL(timeout()), this, SLOT(onAnimationTick()));
-    m_animationTimer.start(1000/fps);
+    return QRectF(center.x() - radius, center.y() - radius, radius * 2, radius * 2);
 }
 
 void RegionOfInterest::onAnimationTick()
@@ -221,14 +305,14 @@ void RegionOfInterest::onAnimationTick()
 
     if (forward)
     {
-        m_pen.setWidth(m_pen.width() + 1);
-        if (m_pen.width() == 7)
+        ++m_penWidth;
+        if (m_penWidth == 7)
             forward = false;
     }
     else
     {
-        m_pen.setWidth(m_pen.width() - 1);
-        if (m_pen.width() == 1)
+        --m_penWidth;
+        if (m_penWidth == 1)
             forward = true;
     }   
 
@@ -252,8 +336,8 @@ QDataStream& operator<< (QDataStream &out, const RegionOfInterest &roi)
     out << static_cast<int>(roi.m_shapeType)
         << roi.pos()
         << roi.boundingRect()
-        << roi.m_attachedContents
-        << roi.m_attachedLocalMap;
+        << roi.attachedFile()
+        << roi.localMap();
 
     return out;
 }
@@ -1,75 +1,94 @@
 #ifndef REGIONOFINTEREST_H
 #define REGIONOFINTEREST_H
 
-#include <QGraphicsPathItem>
+#include <QGraphicsItem>
+#include <QPainterPath>
 #include <QString>
 
-#include <QTimer>
-#include <QPen>
+#include "helpers/quadtree.h"
+#include "helpers/animationclock.h"
 
 // Leave constructor to make ROI with rubber band.
 // Serialize actual bounding rect, when saving the instances.
-
-class RegionOfInterest : public QObject, public QGraphicsPathItem
+//
+// Regions are the most numerous items of the map, so they are kept slim:
+// - plain QGraphicsItem (no QObject, no pen and brush of shape items), the animation is driven by the shared clock;
+// - the pen is derived from the state, only its width is stored;
+// - the paths are interned into the shared pool (see StringPool), only their ids are stored and resolved, when needed;
+// - the name is made from the path, when it is needed, the legend text is passed to Details, when it is loaded;
+// - neither the shape path nor the tooltip is stored: the shape is drawn from the bounds, the path is built only,
+//   when somebody asks for {shape}, and the tooltip is made from the name by InteractiveMap, when it is shown.
+
+class RegionOfInterest : public QGraphicsItem, public Animated
 {
-    Q_OBJECT
-
 public:
     enum class ShapeType  {RECTANGLE, ROUNDED_RECTANGLE, ELLIPSE, CIRCLE};
     enum class State {IDLE, ACTIVE};
 
     RegionOfInterest(QGraphicsItem* parent = nullptr);
     RegionOfInterest(const RegionOfInterest& rhs, QGraphicsItem* parent = nullptr);    
+    RegionOfInterest(const ShapeType& type, const QRectF& bounds, const QPointF& position,
+                     QString contents, QString localMap, QGraphicsItem* parent = nullptr);
     ~RegionOfInterest();
 
     void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget = Q_NULLPTR) override;
     QRectF boundingRect() const override;
     QPainterPath shape() const override;
+    bool contains(const QPointF &point) const override;
+    bool intersects (const QRectF& sceneRect) const;
+    QVariant itemChange(GraphicsItemChange change, const QVariant &value) override;
 
     const State& state() const;
     const ShapeType& shapeType() const;
-    const QString& localMap() const;
-    const QString& attachedFile() const;
-    const QString& details() const;
+    QString localMap() const;
+    QString attachedFile() const;
+    QString name() const;
+    bool hasDetails() const;
 
     bool hasAttachedFile();
     bool hasLocalMap();
     void setLocalMap (const QString& localMap);
     void setContents (const QString& source);
-    void loadDataFormString (const QString& details);
+    void setDetailsLoaded ();
 
     void setState (const State& state);
     void setShape (const ShapeType& type, const QRectF& bounds);
+    void assign (const ShapeType& type, const QRectF& bounds, const QPointF& position,
+                 const QString& contents, const QString& localMap);
+    void setIndex (QuadTree<RegionOfInterest*>* index);
 
 protected:
     friend QDataStream& operator<< (QDataStream&, const RegionOfInterest&);
     friend QDataStream& operator>> (QDataStream&,       RegionOfInterest&);
 
 private:
-    QString generateNameFor (const QString& fullPath);
-    QPainterPath makeShapeFor (const ShapeType& path, const QRectF& bbox);
+    static QString generateNameFor (const QString& fullPath);
+    static QPainterPath makeShapeFor (const ShapeType& path, const QRectF& bbox);
+    static QRectF outlineFor (const ShapeType& type, const QRectF& bbox);
+    void updateIndex();
 
     // Shape
     ShapeType m_shapeType = ShapeType::RECTANGLE;
-    QPainterPath m_shape;
+    QRectF m_bounds;
 
-    // Selection state
-    State m_state = State::IDLE;
-    QPen  m_pen;
+    // Spatial index of the map, that should know about every move of the region
+    QuadTree<RegionOfInterest*>* m_index = nullptr;
 
-    // Legend
-    QString m_name;
-    QString m_attachedLocalMap;
-    QString m_attachedContents;
-    QString m_text;
+    // Selection state (the pen is white for idle regions and green for active ones)
+    State  m_state = State::IDLE;
+    quint8 m_penWidth = 1;
 
-    // Animation
-    void prepareAnimation();
-    QTimer m_animationTimer;
+    // Legend (ids of the paths in the shared pool)
+    quint32 m_localMapId = 0;
+    quint32 m_contentsId = 0;
+    bool m_textLoaded = false;
+
+    // Animation (only active regions are subscribed to the animation clock)
+    static constexpr int FPS = 14;
     bool forward = true;
 
-public slots:
-    void onAnimationTick();
+public:
+    void onAnimationTick() override;
 };
 
 
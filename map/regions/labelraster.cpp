@@ -0,0 +1,511 @@
+#include "labelraster.h"
+
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QScopedPointer>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QThread>
+#include <QMutex>
+#include <QCache>
+#include <QFile>
+#include <QSet>
+#include <QtEndian>
+#include <QtMath>
+#include <QDir>
+
+#include <algorithm>
+#include <limits>
+
+#include "../helpers/shapegeometry.h"
+
+struct LabelRaster::Pixels
+{
+    QMutex mutex;
+
+    // The mapped raster, it is set once by the job (and unmapped, when the file is closed with the raster).
+    QScopedPointer<QFile> file;
+    const uchar* mapped = nullptr;
+
+    // The job stops writing the file, when the raster is cleared.
+    QAtomicInt cancelled;
+
+    // The bands, unpacked before the file is mapped, cost is measured in kilobytes.
+    QCache<int, QByteArray> unpacked {LabelRaster::BAND_BUDGET * 1024};
+
+    // The bands, that can't be unpacked, so they aren't unpacked again.
+    QSet<int> broken;
+};
+
+namespace
+{
+    // BandJob takes the next band, until all of them are done (bands differ a lot in cost, so they aren't split evenly).
+    class BandJob : public QRunnable
+    {
+    public:
+        BandJob(QAtomicInt& next, int count, std::function<void(int)> work)
+            : m_next(next), m_count(count), m_work(work)
+        {
+        }
+
+        void run() override
+        {
+            for (int band = m_next.fetchAndAddRelaxed(1); band < m_count; band = m_next.fetchAndAddRelaxed(1))
+                m_work(band);
+        }
+
+    private:
+        QAtomicInt& m_next;
+        int m_count;
+        std::function<void(int)> m_work;
+    };
+
+    // Runs the work for every band (one job per thread) and waits, until all of them are done.
+    void forEachBand(int count, std::function<void(int)> work)
+    {
+        QThreadPool pool;
+        QAtomicInt next (0);
+
+        int jobs = qBound(1, QThread::idealThreadCount(), qMax(1, count));
+        for (int i = 0; i < jobs; ++i)
+            pool.start(new BandJob(next, count, work));
+
+        pool.waitForDone();
+    }
+
+    int bandRows(const QSize& size, int bandHeight, int band)
+    {
+        return qMin(bandHeight, size.height() - band * bandHeight);
+    }
+
+    // MapJob unpacks the loaded raster into the cache file (unless it's there from the previous loads) and maps it.
+    class MapJob : public QRunnable
+    {
+    public:
+        MapJob(const QSharedPointer<LabelRaster::Pixels>& pixels, const LabelData& labels, std::function<void(const QString&, const QString&)> trim)
+            : m_pixels(pixels), m_labels(labels), m_trim(trim)
+        {
+        }
+
+        void run() override
+        {
+            qint64 rowBytes = qint64(m_labels.size.width()) * 4;
+            qint64 bytes = rowBytes * m_labels.size.height();
+
+            // The unpacked raster is named by the hash of the packed one, so it is unpacked once for all the loads of the map.
+            QString directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/labels";
+            QCryptographicHash hash (QCryptographicHash::Sha1);
+            hash.addData(QByteArray::number(m_labels.size.width()) + "x" + QByteArray::number(m_labels.size.height()));
+            for (const QByteArray& band : m_labels.bands)
+                hash.addData(band);
+
+            QScopedPointer<QFile> file (new QFile(directory + "/" + hash.result().toHex() + ".raw"));
+
+            if (file->exists() && file->size() == bytes)
+            {
+                // The time of the file is the time of its last use, so the rasters of the opened maps are evicted last.
+                if (file->open(QIODevice::ReadWrite))
+                {
+                    file->setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+                    file->close();
+                }
+            }
+            else if (QDir().mkpath(directory))
+            {
+                // The bands are unpacked one by one straight into the file, the file appears only when it's complete.
+                QSaveFile output (file->fileName());
+                bool written = output.open(QIODevice::WriteOnly);
+                for (int band = 0; band < m_labels.bands.size() && written; ++band)
+                {
+                    QByteArray pixels = qUncompress(m_labels.bands.at(band));
+                    qint64 expected = rowBytes * bandRows(m_labels.size, m_labels.bandHeight, band);
+                    written = (!m_pixels->cancelled.loadAcquire() && pixels.size() == expected && output.write(pixels) == expected);
+                }
+
+                if (!written)
+                {
+                    output.cancelWriting();
+                    return;
+                }
+
+                if (output.commit())
+                    m_trim(directory, file->fileName());
+            }
+
+            // If the cache is not writable, the bands stay unpacked on demand.
+            if (file->size() != bytes || !file->open(QIODevice::ReadOnly))
+                return;
+
+            const uchar* mapped = file->map(0, bytes);
+            if (!mapped)
+                return;
+
+            // The bands, unpacked meanwhile, aren't needed anymore.
+            QMutexLocker locker (&m_pixels->mutex);
+            m_pixels->file.swap(file);
+            m_pixels->mapped = mapped;
+            m_pixels->unpacked.clear();
+        }
+
+    private:
+        QSharedPointer<LabelRaster::Pixels> m_pixels;
+        LabelData m_labels;
+        std::function<void(const QString&, const QString&)> m_trim;
+    };
+}
+
+LabelRaster::LabelRaster()
+{
+    m_pixels = QSharedPointer<Pixels>::create();
+
+    // One raster is mapped at a time.
+    m_pool.setMaxThreadCount(1);
+}
+
+LabelRaster::~LabelRaster()
+{
+    clear();
+    m_pool.waitForDone();
+}
+
+QSize LabelRaster::sizeFor(const QRectF &area)
+{
+    // One pixel per scene unit (the pixel grid of the background), unless the area is too large.
+    qreal scale = qMax(1.0, qMax(area.width(), area.height()) / MAX_SIZE);
+    return QSize(qMax(1, qCeil(area.width() / scale)), qMax(1, qCeil(area.height() / scale)));
+}
+
+LabelData LabelRaster::pack(const QSize &size, const QRectF &area, Fill fill)
+{
+    LabelData labels;
+    labels.area = area;
+    labels.size = size;
+    labels.bandHeight = BAND_HEIGHT;
+    labels.bands.resize((size.height() + BAND_HEIGHT - 1) / BAND_HEIGHT);
+
+    // Only one band per thread is unpacked at a time.
+    QByteArray* bands = labels.bands.data();
+    forEachBand(labels.bands.size(), [&](int band)
+    {
+        int rows = bandRows(size, BAND_HEIGHT, band);
+        QByteArray pixels (size.width() * rows * 4, '\0');
+
+        fill(band * BAND_HEIGHT, rows, reinterpret_cast<uchar*>(pixels.data()));
+        bands[band] = qCompress(pixels);
+    });
+
+    return labels;
+}
+
+LabelData LabelRaster::generate(const QVector<RegionRecord> &regions, const QRectF &area)
+{
+    if (area.isEmpty() || regions.isEmpty())
+        return LabelData();
+
+    QSize size = sizeFor(area);
+    qreal sx = area.width()  / size.width();
+    qreal sy = area.height() / size.height();
+
+    // Larger regions are drawn first, so the nested (smaller) ones stay on top of them,
+    // the same as picking by geometry prefers the smallest region.
+    QVector<int> order (regions.size());
+    for (int i = 0; i < order.size(); ++i)
+        order[i] = i;
+
+    std::stable_sort(order.begin(), order.end(), [&regions](int a, int b)
+    {
+        const QRectF& ra = regions.at(a).bounds;
+        const QRectF& rb = regions.at(b).bounds;
+        return ra.width() * ra.height() > rb.width() * rb.height();
+    });
+
+    // Only the pixels, which centers are inside the bounds of the region, are tested against its shape.
+    // The regions smaller than two pixels could miss all the centers, so they mark every pixel, they touch, as UNCOVERED
+    // (they are drawn after the larger regions, so picking checks these pixels by geometry).
+    QVector<QRect> pixelBounds (regions.size());
+    QVector<bool> uncovered (regions.size(), false);
+    for (int i = 0; i < regions.size(); ++i)
+    {
+        const RegionRecord& record = regions.at(i);
+        QRectF scene = record.bounds.translated(record.position).intersected(area);
+        if (scene.isEmpty())
+            continue;
+
+        if (record.bounds.width() < 2 * sx || record.bounds.height() < 2 * sy)
+        {
+            int left   = qMax(0, qFloor((scene.left() - area.left()) / sx));
+            int right  = qMin(size.width() - 1,  qCeil((scene.right()  - area.left()) / sx) - 1);
+            int top    = qMax(0, qFloor((scene.top()  - area.top())  / sy));
+            int bottom = qMin(size.height() - 1, qCeil((scene.bottom() - area.top())  / sy) - 1);
+
+            pixelBounds[i] = QRect(QPoint(left, top), QPoint(right, bottom));
+            uncovered[i] = true;
+            continue;
+        }
+
+        int left   = qMax(0, qCeil((scene.left() - area.left()) / sx - 0.5));
+        int right  = qMin(size.width() - 1,  qFloor((scene.right()  - area.left()) / sx - 0.5));
+        int top    = qMax(0, qCeil((scene.top()  - area.top())  / sy - 0.5));
+        int bottom = qMin(size.height() - 1, qFloor((scene.bottom() - area.top())  / sy - 0.5));
+
+        pixelBounds[i] = QRect(QPoint(left, top), QPoint(right, bottom));
+    }
+
+    // Each band draws the regions, which cross it, so the bands are independent of each other.
+    return pack(size, area, [&](int bandTop, int rows, uchar* pixels)
+    {
+        int bandBottom = bandTop + rows - 1;
+        for (int index : order)
+        {
+            const QRect& bounds = pixelBounds.at(index);
+            if (bounds.isEmpty() || bounds.bottom() < bandTop || bounds.top() > bandBottom)
+                continue;
+
+            const RegionRecord& record = regions.at(index);
+            quint32 label = quint32(index) + 1;
+            for (int y = qMax(bounds.top(), bandTop); y <= qMin(bounds.bottom(), bandBottom); ++y)
+            {
+                uchar* line = pixels + 4 * qint64(y - bandTop) * size.width();
+                if (uncovered.at(index))
+                {
+                    for (int x = bounds.left(); x <= bounds.right(); ++x)
+                        qToLittleEndian<quint32>(UNCOVERED, line + 4 * x);
+
+                    continue;
+                }
+
+                qreal py = area.top() + (y + 0.5) * sy - record.position.y();
+                for (int x = bounds.left(); x <= bounds.right(); ++x)
+                {
+                    qreal px = area.left() + (x + 0.5) * sx - record.position.x();
+                    if (ShapeGeometry::contains(record.shapeType, record.bounds, QPointF(px, py)))
+                        qToLittleEndian<quint32>(label, line + 4 * x);
+                }
+            }
+        }
+    });
+}
+
+LabelData LabelRaster::fromMask(const QImage &mask, const QRectF &area)
+{
+    if (mask.isNull() || area.isEmpty())
+        return LabelData();
+
+    // The mask is sampled with the nearest pixel, so the colours (labels) are never blended.
+    // 32-bit masks are read in place, the others are converted by the rows, that are sampled.
+    QSize size = sizeFor(area);
+    int width  = mask.width();
+    int height = mask.height();
+    bool direct = (mask.format() == QImage::Format_RGB32 || mask.format() == QImage::Format_ARGB32);
+
+    return pack(size, area, [&](int top, int rows, uchar* pixels)
+    {
+        QImage converted;
+        for (int y = top; y < top + rows; ++y)
+        {
+            int my = qMin(height - 1, int((y + 0.5) * height / size.height()));
+
+            const QRgb* source = nullptr;
+            if (direct)
+                source = reinterpret_cast<const QRgb*>(mask.constScanLine(my));
+            else
+            {
+                converted = mask.copy(0, my, width, 1).convertToFormat(QImage::Format_RGB32);
+                source = reinterpret_cast<const QRgb*>(converted.constScanLine(0));
+            }
+
+            uchar* line = pixels + 4 * qint64(y - top) * size.width();
+            for (int x = 0; x < size.width(); ++x)
+            {
+                int mx = qMin(width - 1, int((x + 0.5) * width / size.width()));
+                qToLittleEndian<quint32>(quint32(source[mx] & 0x00FFFFFF), line + 4 * x);
+            }
+        }
+    });
+}
+
+LabelData LabelRaster::merge(const LabelData &base, const LabelData &top, quint32 offset)
+{
+    if (top.isEmpty())
+        return base;
+
+    if (base.isEmpty() && offset == 0)
+        return top;
+
+    // The rasters are put together band by band, so they should be of the same layout;
+    // otherwise the base regions are left to the picking by geometry: the pixels without the top regions are UNCOVERED.
+    bool matching = !base.isEmpty() && base.area == top.area && base.size == top.size
+                 && base.bandHeight == top.bandHeight && base.bands.size() == top.bands.size();
+
+    LabelData labels = top;
+    QByteArray* bands = labels.bands.data();
+    forEachBand(labels.bands.size(), [&](int band)
+    {
+        QByteArray pixels = qUncompress(top.bands.at(band));
+        QByteArray under  = matching ? qUncompress(base.bands.at(band)) : QByteArray();
+
+        uchar* data = reinterpret_cast<uchar*>(pixels.data());
+        const uchar* below = (under.size() == pixels.size()) ? reinterpret_cast<const uchar*>(under.constData()) : nullptr;
+
+        for (int i = 0; i + 4 <= pixels.size(); i += 4)
+        {
+            quint32 label = qFromLittleEndian<quint32>(data + i);
+            if (label == 0)
+                label = below ? qFromLittleEndian<quint32>(below + i) : (offset > 0 ? UNCOVERED : 0);
+            else if (label != UNCOVERED)
+                label += offset;
+
+            qToLittleEndian<quint32>(label, data + i);
+        }
+
+        bands[band] = qCompress(pixels);
+    });
+
+    return labels;
+}
+
+bool LabelRaster::load(const LabelData &labels)
+{
+    clear();
+
+    // Only the layout is checked here, the raster is unpacked into the cache file by the job.
+    int count = labels.isEmpty() ? 0 : (labels.size.height() + labels.bandHeight - 1) / labels.bandHeight;
+    if (count == 0 || labels.bands.size() != count || qint64(labels.size.width()) * labels.bandHeight * 4 > std::numeric_limits<int>::max())
+        return false;
+
+    m_labels = labels;
+    m_pool.start(new MapJob(m_pixels, m_labels, &LabelRaster::trimCache));
+    return true;
+}
+
+void LabelRaster::trimCache(const QString &directory, const QString &keep)
+{
+    // The rasters, which weren't used for the longest time, are removed first.
+    QFileInfoList files = QDir(directory).entryInfoList(QStringList("*.raw"), QDir::Files, QDir::Time | QDir::Reversed);
+
+    qint64 total = 0;
+    for (const QFileInfo& file : files)
+        total += file.size();
+
+    QString kept = QFileInfo(keep).absoluteFilePath();
+    for (int i = 0; i < files.size() && total > CACHE_BUDGET * 1024 * 1024; ++i)
+    {
+        const QFileInfo& file = files.at(i);
+        if (file.absoluteFilePath() != kept && QFile::remove(file.absoluteFilePath()))
+            total -= file.size();
+    }
+}
+
+void LabelRaster::clear()
+{
+    // The queued job is dropped, the running one stops writing and maps into the pixels of the previous raster
+    // (they are unmapped, when the job lets them go).
+    m_pixels->cancelled.storeRelease(1);
+    m_pool.clear();
+    m_labels = LabelData();
+    m_pixels = QSharedPointer<Pixels>::create();
+}
+
+bool LabelRaster::isValid() const
+{
+    return !m_labels.isEmpty();
+}
+
+const uchar* LabelRaster::band(int index, QByteArray &holder)
+{
+    qint64 rowBytes = qint64(m_labels.size.width()) * 4;
+
+    // The mapped file lives as long as the pixels, that aren't replaced during the lookup.
+    QMutexLocker locker (&m_pixels->mutex);
+    if (m_pixels->mapped)
+        return m_pixels->mapped + rowBytes * m_labels.bandHeight * index;
+
+    // The band is copied (it's implicitly shared), so it stays valid, even if the cache drops it meanwhile.
+    if (QByteArray* pixels = m_pixels->unpacked.object(index))
+    {
+        holder = *pixels;
+        return reinterpret_cast<const uchar*>(holder.constData());
+    }
+
+    if (m_pixels->broken.contains(index))
+        return nullptr;
+
+    // A band is small, so it is unpacked right away, that keeps picking a single lookup before the file is mapped.
+    int bytes = int(rowBytes * bandRows(m_labels.size, m_labels.bandHeight, index));
+    holder = qUncompress(m_labels.bands.at(index));
+    if (holder.size() != bytes)
+    {
+        // The broken band is always picked by geometry.
+        m_pixels->broken.insert(index);
+        return nullptr;
+    }
+
+    m_pixels->unpacked.insert(index, new QByteArray(holder), qMax(1, bytes / 1024));
+    return reinterpret_cast<const uchar*>(holder.constData());
+}
+
+quint32 LabelRaster::labelAt(const uchar* band, int row, int x) const
+{
+    return qFromLittleEndian<quint32>(band + 4 * (qint64(row) * m_labels.size.width() + x));
+}
+
+int LabelRaster::regionAt(const QPointF &scenePoint, bool* boundary)
+{
+    if (boundary)
+        *boundary = false;
+
+    if (!isValid())
+        return NO_REGION;
+
+    const QRectF& area = m_labels.area;
+    const QSize& size = m_labels.size;
+    if (!area.contains(scenePoint))
+        return UNCOVERED_REGION;
+
+    int x = qBound(0, int((scenePoint.x() - area.left()) * size.width()  / area.width()),  size.width() - 1);
+    int y = qBound(0, int((scenePoint.y() - area.top())  * size.height() / area.height()), size.height() - 1);
+
+    int height = m_labels.bandHeight;
+    int index = y / height;
+    int row = y - index * height;
+
+    QByteArray holder;
+    const uchar* pixels = band(index, holder);
+    if (!pixels)
+        return UNCOVERED_REGION;
+
+    quint32 label = labelAt(pixels, row, x);
+
+    // The pixel covers the area of the scene, so on the borders of regions it could be taken by either of them.
+    // The neighbours above and below could be in the other bands.
+    if (boundary)
+    {
+        bool differs = (x > 0 && labelAt(pixels, row, x - 1) != label) || (x + 1 < size.width() && labelAt(pixels, row, x + 1) != label);
+
+        if (!differs && y > 0)
+        {
+            QByteArray aboveHolder;
+            const uchar* above = (row > 0) ? pixels : band(index - 1, aboveHolder);
+            differs = !above || labelAt(above, (row > 0) ? row - 1 : height - 1, x) != label;
+        }
+
+        if (!differs && y + 1 < size.height())
+        {
+            bool inside = row + 1 < bandRows(size, height, index);
+            QByteArray belowHolder;
+            const uchar* below = inside ? pixels : band(index + 1, belowHolder);
+            differs = !below || labelAt(below, inside ? row + 1 : 0, x) != label;
+        }
+
+        *boundary = differs;
+    }
+
+    if (label == UNCOVERED)
+        return UNCOVERED_REGION;
+
+    return int(label) - 1;
+}
@@ -0,0 +1,86 @@
+#ifndef LABELRASTER_H
+#define LABELRASTER_H
+
+#include <QSharedPointer>
+#include <QThreadPool>
+#include <QImage>
+#include <QPointF>
+#include <QRectF>
+#include <QSize>
+#include <QByteArray>
+
+#include <functional>
+
+#include "../io/mapdocument.h"
+
+// LabelRaster is the region id buffer of the map: a raster, aligned with the background,
+// which pixels hold the index of the region under them (plus one, 0 is no region).
+// Picking becomes a single lookup, that doesn't depend on the count or the shapes of the regions.
+// The pixels, that the raster can't describe, are marked UNCOVERED, and picking checks them by geometry:
+// the regions smaller than two pixels (on the scaled down raster), and the regions, that were added to the map
+// without the raster (when the imported mask is put over the map of other layout). The scene outside the area is uncovered too.
+// - the raster has the pixel grid of the background (one pixel per scene unit), only the areas
+//   larger than MAX_SIZE pixels on the longer side are scaled down;
+// - the raster is generated from the geometry of regions (smaller regions are on top of the larger ones),
+//   or imported from the colour-coded mask (RGB value of the pixel is the index of the region plus one);
+// - it is made and stored by bands of BAND_HEIGHT rows, each band is compressed by itself,
+//   so the bands are made in parallel and the whole raster is never unpacked in memory;
+// - on load it is unpacked once (off GUI thread) into the cache directory and the file is memory-mapped,
+//   so the pages are brought in only where the user points; the least recently used files are removed,
+//   when the cache exceeds CACHE_BUDGET; the unpacked file is reused by the next loads of the same raster;
+// - until the file is mapped, the band under the cursor is unpacked on the spot (it's small), so picking is
+//   still a lookup; these bands are kept in LRU cache, that is limited by BAND_BUDGET.
+
+class LabelRaster
+{
+public:
+    static constexpr int MAX_SIZE = 32768;
+    static constexpr int BAND_HEIGHT = 64;
+    static constexpr int BAND_BUDGET = 256; // megabytes
+    static constexpr qint64 CACHE_BUDGET = 2048; // megabytes
+    static constexpr quint32 UNCOVERED = 0xFFFFFFFF;
+
+    // Results of {regionAt}, that aren't indices of the regions.
+    enum {NO_REGION = -1, UNCOVERED_REGION = -2};
+
+    // Fills the rows [top, top + rows) of the raw raster (little endian labels, row by row).
+    typedef std::function<void(int top, int rows, uchar* pixels)> Fill;
+
+    LabelRaster();
+    ~LabelRaster();
+
+    static LabelData generate (const QVector<RegionRecord>& regions, const QRectF& area);
+    static LabelData fromMask (const QImage& mask, const QRectF& area);
+
+    // Puts the labels of the top raster over the base one, the top labels are shifted by offset
+    // (the count of regions, which are listed before the top ones). Base of other size is left out.
+    static LabelData merge (const LabelData& base, const LabelData& top, quint32 offset);
+
+    // Size of the raster for the area and packing of the raw pixels band by band (the bands are filled in parallel).
+    static QSize sizeFor (const QRectF& area);
+    static LabelData pack (const QSize& size, const QRectF& area, Fill fill);
+
+    bool load (const LabelData& labels);
+    void clear();
+    bool isValid() const;
+
+    // Index of the region in the document, NO_REGION if there is no region in the point,
+    // UNCOVERED_REGION if the raster doesn't know (the point is outside of the area, the pixel is UNCOVERED
+    // or its band is broken). The pixel is on the boundary, when its neighbours have other labels
+    // (then it could cover several regions) or can't be read.
+    int regionAt (const QPointF& scenePoint, bool* boundary = nullptr);
+
+    // Unpacked pixels (the mapped file or the bands, unpacked before it's ready), shared with the job, that maps the file.
+    struct Pixels;
+
+private:
+    static void trimCache (const QString& directory, const QString& keep);
+    const uchar* band (int index, QByteArray& holder);
+    quint32 labelAt (const uchar* band, int row, int x) const;
+
+    LabelData m_labels;
+    QSharedPointer<Pixels> m_pixels;
+    QThreadPool m_pool;
+};
+
+#endif // LABELRASTER_H
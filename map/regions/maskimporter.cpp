@@ -0,0 +1,377 @@
+#include "maskimporter.h"
+
+#include <QCoreApplication>
+#include <QImageReader>
+#include <QRunnable>
+#include <QPointer>
+#include <QThread>
+#include <QtEndian>
+
+#include <functional>
+
+#include "labelraster.h"
+
+namespace
+{
+    // The masks of other formats than 8-bit palette and 32-bit RGB are converted by bands of this many rows.
+    const int BAND_HEIGHT = 64;
+
+    // Run is the horizontal span [begin, end) of the same colour in a row of the mask.
+    struct Run
+    {
+        int begin;
+        int end;
+        quint32 colour;
+    };
+
+    // Stripe is the part of the mask rows, that is labelled by one thread (runs are numbered locally).
+    struct Stripe
+    {
+        QVector<Run> runs;
+        QVector<int> rowStarts;
+        QVector<int> parent;
+    };
+
+    int find(QVector<int>& parent, int i)
+    {
+        // Path halving keeps the trees flat without recursion.
+        while (parent[i] != i)
+        {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+
+        return i;
+    }
+
+    void unite(QVector<int>& parent, int a, int b)
+    {
+        a = find(parent, a);
+        b = find(parent, b);
+
+        // The smaller index is the root, so the component is named by its topmost run.
+        if (a < b)
+            parent[b] = a;
+        else if (b < a)
+            parent[a] = b;
+    }
+
+    template <typename Pixel, typename Colour>
+    void scanRow(const Pixel* line, int width, Colour colour, QVector<Run>& runs)
+    {
+        int x = 0;
+        while (x < width)
+        {
+            Pixel value = line[x];
+            int begin = x;
+            while (++x < width && line[x] == value) {}
+
+            // Different pixel values could have the same colour (e.g. duplicated palette entries).
+            quint32 c = colour(value);
+            if (c == 0)
+                continue;
+
+            if (!runs.isEmpty() && runs.last().end == begin && runs.last().colour == c)
+                runs.last().end = x;
+            else
+                runs.append({begin, x, c});
+        }
+    }
+
+    // Joins the overlapping runs of the same colour in two neighbouring rows (4-connectivity).
+    void connectRows(const QVector<Run>& runs, QVector<int>& parent, int a, int aEnd, int b, int bEnd)
+    {
+        while (a < aEnd && b < bEnd)
+        {
+            const Run& upper = runs.at(a);
+            const Run& lower = runs.at(b);
+
+            if (upper.begin < lower.end && lower.begin < upper.end && upper.colour == lower.colour)
+                unite(parent, a, b);
+
+            if (upper.end < lower.end)
+                ++a;
+            else
+                ++b;
+        }
+    }
+
+    class StripeJob : public QRunnable
+    {
+    public:
+        StripeJob(std::function<void()> work)
+            : m_work(work)
+        {
+        }
+
+        void run() override
+        {
+            m_work();
+        }
+
+    private:
+        std::function<void()> m_work;
+    };
+
+    // Splits the rows into stripes (one per thread) and waits, until all of them are done.
+    template <typename Body>
+    void inStripes(int rows, int stripes, Body& body)
+    {
+        QThreadPool pool;
+        for (int s = 0; s < stripes; ++s)
+        {
+            int begin = int(qint64(rows) * s / stripes);
+            int end   = int(qint64(rows) * (s + 1) / stripes);
+            pool.start(new StripeJob([&body, s, begin, end]() { body(s, begin, end); }));
+        }
+
+        pool.waitForDone();
+    }
+
+    class ImportJob : public QRunnable
+    {
+    public:
+        ImportJob(const QString& filename, const QRectF& area, std::function<void(const MaskImporter::Result&)> done)
+            : m_filename(filename), m_area(area), m_done(done)
+        {
+        }
+
+        void run() override
+        {
+            QImage mask = QImageReader(m_filename).read();
+            MaskImporter::Result result = MaskImporter::label(mask, m_area);
+
+            std::function<void(const MaskImporter::Result&)> done = m_done;
+            QMetaObject::invokeMethod(QCoreApplication::instance(), [done, result]() { done(result); }, Qt::QueuedConnection);
+        }
+
+    private:
+        QString m_filename;
+        QRectF m_area;
+        std::function<void(const MaskImporter::Result&)> m_done;
+    };
+}
+
+MaskImporter::MaskImporter(QObject *parent)
+    : QObject(parent)
+{
+    // The labelling itself is parallel, so one import at a time is enough.
+    m_pool.setMaxThreadCount(1);
+}
+
+MaskImporter::~MaskImporter()
+{
+    ++m_generation;
+    m_pool.waitForDone();
+}
+
+void MaskImporter::import(const QString &filename, const QRectF &area)
+{
+    b_busy = true;
+
+    QPointer<MaskImporter> self (this);
+    int generation = ++m_generation;
+    m_pool.start(new ImportJob(filename, area, [self, generation](const Result& result)
+    {
+        if (!self || self->m_generation != generation)
+            return;
+
+        self->m_result = result;
+        self->b_busy = false;
+        emit self->ready();
+    }));
+}
+
+bool MaskImporter::isBusy() const
+{
+    return b_busy;
+}
+
+MaskImporter::Result MaskImporter::takeResult()
+{
+    Result result = m_result;
+    m_result = Result();
+
+    return result;
+}
+
+MaskImporter::Result MaskImporter::label(const QImage &mask, const QRectF &area)
+{
+    Result result;
+    if (mask.isNull() || area.isEmpty())
+        return result;
+
+    // Palette masks are labelled by their 8-bit indices, the others by their colours.
+    // Transparent and black pixels are not covered by any region.
+    // 32-bit masks are read in place, the other formats are converted to ARGB32 by bands of rows inside the stripes,
+    // so the mask (which could take a gigabyte) is never copied as a whole.
+    bool indexed = mask.format() == QImage::Format_Indexed8;
+    bool direct  = mask.format() == QImage::Format_ARGB32 || mask.format() == QImage::Format_RGB32;
+
+    auto colourOf = [](QRgb value) { return qAlpha(value) == 0 ? 0u : quint32(value & 0x00FFFFFF); };
+
+    quint32 palette[256] = {};
+    const QVector<QRgb> table = mask.colorTable();
+    for (int i = 0; i < table.size() && i < 256; ++i)
+        palette[i] = colourOf(table.at(i));
+
+    int width  = mask.width();
+    int height = mask.height();
+    int stripeCount = qBound(1, QThread::idealThreadCount(), height);
+    QVector<Stripe> stripes (stripeCount);
+
+    // 1. Each stripe finds its runs and joins them within the stripe.
+    auto labelStripe = [&](int s, int begin, int end)
+    {
+        Stripe& stripe = stripes[s];
+        stripe.rowStarts.reserve(end - begin + 1);
+
+        QImage band;
+        int bandTop = begin;
+
+        for (int y = begin; y < end; ++y)
+        {
+            int start = stripe.runs.size();
+            stripe.rowStarts.append(start);
+
+            const uchar* line;
+            if (indexed || direct)
+                line = mask.constScanLine(y);
+            else
+            {
+                if (band.isNull() || y >= bandTop + band.height())
+                {
+                    bandTop = y;
+                    band = mask.copy(0, y, width, qMin(BAND_HEIGHT, end - y)).convertToFormat(QImage::Format_ARGB32);
+                }
+
+                line = band.constScanLine(y - bandTop);
+            }
+
+            if (indexed)
+                scanRow(line, width, [&palette](uchar value) { return palette[value]; }, stripe.runs);
+            else
+                scanRow(reinterpret_cast<const QRgb*>(line), width, colourOf, stripe.runs);
+
+            stripe.parent.resize(stripe.runs.size());
+            for (int i = start; i < stripe.runs.size(); ++i)
+                stripe.parent[i] = i;
+
+            if (y > begin)
+                connectRows(stripe.runs, stripe.parent, stripe.rowStarts.at(y - begin - 1), start, start, stripe.runs.size());
+        }
+    };
+    inStripes(height, stripeCount, labelStripe);
+
+    // 2. The stripes are put together and joined at their borders.
+    QVector<Run> runs;
+    QVector<int> parent;
+    QVector<int> rowStarts;
+    rowStarts.reserve(height + 1);
+
+    for (const Stripe& stripe : qAsConst(stripes))
+    {
+        int offset = runs.size();
+        for (int start : stripe.rowStarts)
+            rowStarts.append(start + offset);
+        for (int root : stripe.parent)
+            parent.append(root + offset);
+        runs += stripe.runs;
+    }
+    rowStarts.append(runs.size());
+    stripes.clear();
+
+    for (int s = 1; s < stripeCount; ++s)
+    {
+        int y = int(qint64(height) * s / stripeCount);
+        if (y > 0 && y < height)
+            connectRows(runs, parent, rowStarts.at(y - 1), rowStarts.at(y), rowStarts.at(y), rowStarts.at(y + 1));
+    }
+
+    // 3. Components are numbered in the order of their topmost runs and measured.
+    struct Component
+    {
+        int left, top, right, bottom;
+        qint64 pixels;
+    };
+
+    QVector<int> componentOf (runs.size(), -1);
+    QVector<Component> components;
+
+    for (int y = 0; y < height; ++y)
+    {
+        for (int r = rowStarts.at(y); r < rowStarts.at(y + 1); ++r)
+        {
+            int root = find(parent, r);
+            if (componentOf.at(root) < 0)
+            {
+                componentOf[root] = components.size();
+                components.append({runs.at(r).begin, y, runs.at(r).end - 1, y, 0});
+            }
+
+            int index = componentOf.at(root);
+            componentOf[r] = index;
+
+            Component& component = components[index];
+            component.left   = qMin(component.left, runs.at(r).begin);
+            component.right  = qMax(component.right, runs.at(r).end - 1);
+            component.bottom = y;
+            component.pixels += runs.at(r).end - runs.at(r).begin;
+        }
+    }
+
+    // 4. Components become the regions (the noise is skipped).
+    qreal sx = area.width()  / width;
+    qreal sy = area.height() / height;
+
+    QVector<int> regionOf (components.size(), -1);
+    for (int i = 0; i < components.size(); ++i)
+    {
+        const Component& component = components.at(i);
+        if (component.pixels < MINIMUM_AREA)
+            continue;
+
+        int w = component.right - component.left + 1;
+        int h = component.bottom - component.top + 1;
+
+        // The ellipse fills pi/4 of its bounds, the rectangle fills them all.
+        // Irregular components get the rectangle: the label raster picks them exactly anyway.
+        qreal fill = qreal(component.pixels) / (qreal(w) * h);
+
+        RegionRecord record;
+        record.shapeType = (fill > 0.70 && fill < 0.86) ? RegionOfInterest::ShapeType::ELLIPSE : RegionOfInterest::ShapeType::RECTANGLE;
+        record.position  = QPointF(area.left() + component.left * sx, area.top() + component.top * sy);
+        record.bounds    = QRectF(0.0, 0.0, w * sx, h * sy);
+
+        regionOf[i] = result.regions.size();
+        result.regions.append(record);
+    }
+
+    if (result.regions.isEmpty())
+        return result;
+
+    // 5. The label raster is sampled from the runs (nearest pixel of the mask) band by band, in parallel as well.
+    QSize size = LabelRaster::sizeFor(area);
+    result.labels = LabelRaster::pack(size, area, [&](int top, int rows, uchar* pixels)
+    {
+        for (int y = top; y < top + rows; ++y)
+        {
+            int my = qMin(height - 1, int((y + 0.5) * height / size.height()));
+            int r = rowStarts.at(my);
+            int rowEnd = rowStarts.at(my + 1);
+            uchar* line = pixels + 4 * qint64(y - top) * size.width();
+
+            for (int x = 0; x < size.width(); ++x)
+            {
+                int mx = qMin(width - 1, int((x + 0.5) * width / size.width()));
+                while (r < rowEnd && runs.at(r).end <= mx)
+                    ++r;
+
+                int region = (r < rowEnd && runs.at(r).begin <= mx) ? regionOf.at(componentOf.at(r)) : -1;
+                qToLittleEndian<quint32>(quint32(region + 1), line + 4 * x);
+            }
+        }
+    });
+
+    return result;
+}
@@ -0,0 +1,58 @@
+#ifndef MASKIMPORTER_H
+#define MASKIMPORTER_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QVector>
+#include <QString>
+#include <QImage>
+#include <QRectF>
+
+#include "../io/mapdocument.h"
+
+// MaskImporter makes the regions from the colour-coded mask image (each colour is a region, black is no region),
+// so the cartographers don't have to draw them one by one.
+// - the mask is labelled off the GUI thread: the rows are split into stripes, which are labelled in parallel
+//   (as runs of the same colour, joined with union-find), then the stripes are joined at their borders;
+// - each connected component becomes a region with the built-in shape, that fits it best
+//   (rectangle or ellipse, judging by the part of the bounds, that the component fills);
+// - the mask itself becomes the label raster of the map, so picking the regions stays pixel-exact;
+// - the components smaller than MINIMUM_AREA pixels are treated as noise and skipped.
+// When the import is finished, {ready} signal is emitted on GUI thread.
+
+class MaskImporter : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Result
+    {
+        QVector<RegionRecord> regions;
+        LabelData labels;
+    };
+
+    static constexpr int MINIMUM_AREA = 16;
+
+    MaskImporter(QObject* parent = nullptr);
+    ~MaskImporter();
+
+    // The mask covers the area of the scene (usually the background).
+    void import (const QString& filename, const QRectF& area);
+    bool isBusy() const;
+    Result takeResult();
+
+    static Result label (const QImage& mask, const QRectF& area);
+
+private:
+    QThreadPool m_pool;
+    Result m_result;
+    bool b_busy = false;
+
+    // Results of the imports, started before the last {import}, are dropped.
+    int m_generation = 0;
+
+signals:
+    void ready();
+};
+
+#endif // MASKIMPORTER_H
@@ -0,0 +1,120 @@
+#include "regionlayer.h"
+
+#include <QStyleOptionGraphicsItem>
+#include <QPainterPath>
+#include <QPainter>
+#include <QVector>
+
+RegionLayer::RegionLayer(RegionStore *store, QGraphicsItem *parent)
+    : QGraphicsItem(parent), m_store(store), m_pen(Qt::white)
+{
+    // Only the exposed part of the layer is drawn, so the exposed rectangle is needed.
+    setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+}
+
+void RegionLayer::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget)
+{
+    Q_UNUSED(widget);
+
+    const qreal lod = QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform());
+    const qreal minimalSize = 2.0f / qMax(lod, 0.0001);
+
+    QVector<QRectF>  rectangles;
+    QPainterPath     rounded;
+    QPainterPath     ellipses;
+    QVector<QPointF> points;
+
+    // Group the exposed regions by the shape type.
+    const QList<int> ids = m_store->query(option->exposedRect);
+    for (int id : ids)
+    {
+        if (m_hidden.contains(id))
+            continue;
+
+        QRectF rect = m_store->sceneRect(id);
+        if (rect.width() < minimalSize && rect.height() < minimalSize)
+        {
+            points.append(rect.center());
+            continue;
+        }
+
+        switch (m_store->shapeType(id))
+        {
+            case RegionOfInterest::ShapeType::RECTANGLE:
+            rectangles.append(rect);
+            break;
+
+            case RegionOfInterest::ShapeType::ROUNDED_RECTANGLE:
+            rounded.addRoundedRect(rect, 10, 10);
+            break;
+
+            case RegionOfInterest::ShapeType::ELLIPSE:
+            ellipses.addEllipse(rect);
+            break;
+
+            case RegionOfInterest::ShapeType::CIRCLE:
+            {
+                // The same circle, that RegionOfInterest makes: centered in bounds, radius is the half of smaller side.
+                QRectF bounds = m_store->bounds(id);
+                QPointF center = QPointF(bounds.center().toPoint()) + m_store->position(id);
+                int radius = qMin(int(bounds.width() / 2), int(bounds.height() / 2));
+                ellipses.addEllipse(QRectF(center.x() - radius, center.y() - radius, radius * 2, radius * 2));
+            }
+            break;
+        }
+    }
+
+    // All the regions share the same pen, so the state of painter is set once.
+    painter->setPen(m_pen);
+    painter->setBrush(Qt::NoBrush);
+
+    if (!rectangles.isEmpty())
+        painter->drawRects(rectangles.constData(), rectangles.size());
+
+    if (!rounded.isEmpty())
+        painter->drawPath(rounded);
+
+    if (!ellipses.isEmpty())
+        painter->drawPath(ellipses);
+
+    if (!points.isEmpty())
+        painter->drawPoints(points.constData(), points.size());
+}
+
+QRectF RegionLayer::boundingRect() const
+{
+    return m_bounds;
+}
+
+void RegionLayer::setBounds(const QRectF &bounds)
+{
+    prepareGeometryChange();
+    m_bounds = bounds;
+}
+
+void RegionLayer::setPen(const QPen &pen)
+{
+    m_pen = pen;
+    update();
+}
+
+void RegionLayer::hideRegion(int id)
+{
+    if (m_store->contains(id) && !m_hidden.contains(id))
+    {
+        m_hidden.insert(id);
+        update(m_store->sceneRect(id));
+    }
+}
+
+void RegionLayer::showRegion(int id)
+{
+    if (m_hidden.remove(id) && m_store->contains(id))
+        update(m_store->sceneRect(id));
+}
+
+void RegionLayer::showAllRegions()
+{
+    m_hidden.clear();
+    update();
+}
@@ -0,0 +1,44 @@
+#ifndef REGIONLAYER_H
+#define REGIONLAYER_H
+
+#include <QGraphicsItem>
+#include <QPen>
+#include <QSet>
+
+#include "regionstore.h"
+
+// RegionLayer is a single graphics item, that draws all the regions of the store (in virtualization mode).
+// Instead of thousand paint calls (each with its own pen and path), the exposed regions are grouped by shape type
+// and drawn in a few batched calls with the same pen:
+// - rectangles are drawn with a single {drawRects} call;
+// - rounded rectangles and ellipses (with circles) are collected into one path per shape type,
+//   and each path is stroked with a single {drawPath} call;
+// - the regions, that are smaller than a couple of pixels at the current zoom, are drawn as points.
+// The regions, that are made into items (hovered, selected or edited by user), are hidden here,
+// since the items draw them in their own state.
+
+class RegionLayer : public QGraphicsItem
+{
+public:
+    RegionLayer(RegionStore* store, QGraphicsItem* parent = nullptr);
+
+    void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget = Q_NULLPTR) override;
+    QRectF boundingRect() const override;
+
+    void setBounds (const QRectF& bounds);
+    void setPen (const QPen& pen);
+
+    void hideRegion (int id);
+    void showRegion (int id);
+    void showAllRegions ();
+
+private:
+    RegionStore* m_store;
+    QRectF m_bounds;
+    QPen m_pen;
+
+    // Regions, that are drawn by the items
+    QSet<int> m_hidden;
+};
+
+#endif // REGIONLAYER_H
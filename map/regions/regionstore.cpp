@@ -0,0 +1,228 @@
+#include "regionstore.h"
+
+#include <QSet>
+
+#include "../helpers/shapegeometry.h"
+
+RegionStore::RegionStore(const QRectF &bounds)
+    : m_index(bounds)
+{
+}
+
+int RegionStore::add(const RegionRecord &record)
+{
+    int id;
+    if (!m_free.isEmpty())
+    {
+        id = m_free.takeLast();
+        m_alive[id] = true;
+    }
+    else
+    {
+        id = m_alive.size();
+
+        m_shapes.append(0);
+        m_positions.append(QPointF());
+        m_bounds.append(QRectF());
+        m_contents.append(0);
+        m_localMaps.append(0);
+        m_alive.append(true);
+    }
+
+    ++m_count;
+    setRecord(id, record);
+
+    return id;
+}
+
+void RegionStore::remove(int id)
+{
+    if (!contains(id))
+        return;
+
+    m_index.remove(id);
+
+    // The slot is reused later, the interned strings stay in the shared pool.
+    m_alive[id] = false;
+    m_free.append(id);
+    --m_count;
+}
+
+void RegionStore::clear()
+{
+    m_shapes.clear();
+    m_positions.clear();
+    m_bounds.clear();
+    m_contents.clear();
+    m_localMaps.clear();
+    m_alive.clear();
+    m_free.clear();
+    m_count = 0;
+
+    m_index.clear();
+}
+
+void RegionStore::reserve(int count)
+{
+    m_shapes.reserve(count);
+    m_positions.reserve(count);
+    m_bounds.reserve(count);
+    m_contents.reserve(count);
+    m_localMaps.reserve(count);
+    m_alive.reserve(count);
+}
+
+bool RegionStore::contains(int id) const
+{
+    return id >= 0 && id < m_alive.size() && m_alive.at(id);
+}
+
+int RegionStore::size() const
+{
+    return m_count;
+}
+
+RegionRecord RegionStore::record(int id) const
+{
+    RegionRecord record;
+    record.shapeType = static_cast<RegionOfInterest::ShapeType>(m_shapes.at(id));
+    record.position  = m_positions.at(id);
+    record.bounds    = m_bounds.at(id);
+    record.contents  = StringPool::paths()->string(m_contents.at(id));
+    record.localMap  = StringPool::paths()->string(m_localMaps.at(id));
+
+    return record;
+}
+
+QVector<RegionRecord> RegionStore::records() const
+{
+    QVector<RegionRecord> result;
+    result.reserve(m_count);
+
+    for (int id = 0; id < m_alive.size(); ++id)
+        if (m_alive.at(id))
+            result.append(record(id));
+
+    return result;
+}
+
+QVector<int> RegionStore::ids() const
+{
+    // The same order, as the records are listed.
+    QVector<int> result;
+    result.reserve(m_count);
+
+    for (int id = 0; id < m_alive.size(); ++id)
+        if (m_alive.at(id))
+            result.append(id);
+
+    return result;
+}
+
+QStringList RegionStore::localMaps(int limit) const
+{
+    // Many regions share the same local map, so only the ids are compared.
+    QStringList result;
+    QSet<quint32> seen;
+
+    for (int id = 0; id < m_alive.size() && result.size() < limit; ++id)
+    {
+        quint32 localMap = m_localMaps.at(id);
+        if (!m_alive.at(id) || localMap == 0 || seen.contains(localMap))
+            continue;
+
+        seen.insert(localMap);
+        result.append(StringPool::paths()->string(localMap));
+    }
+
+    return result;
+}
+
+void RegionStore::setRecord(int id, const RegionRecord &record)
+{
+    m_shapes[id]    = quint8(record.shapeType);
+    m_positions[id] = record.position;
+    m_bounds[id]    = record.bounds;
+    m_contents[id]  = StringPool::paths()->intern(record.contents);
+    m_localMaps[id] = StringPool::paths()->intern(record.localMap);
+
+    m_index.update(id, sceneRect(id));
+}
+
+void RegionStore::setShapeType(RegionOfInterest::ShapeType type)
+{
+    // Shape type doesn't change the bounds, so the index stays the same.
+    m_shapes.fill(quint8(type));
+}
+
+QRectF RegionStore::sceneRect(int id) const
+{
+    return m_bounds.at(id).translated(m_positions.at(id));
+}
+
+QList<int> RegionStore::query(const QRectF &sceneRect) const
+{
+    return m_index.query(sceneRect);
+}
+
+QList<int> RegionStore::query(const QPointF &scenePoint) const
+{
+    return m_index.query(scenePoint);
+}
+
+RegionOfInterest::ShapeType RegionStore::shapeType(int id) const
+{
+    return static_cast<RegionOfInterest::ShapeType>(m_shapes.at(id));
+}
+
+const QPointF &RegionStore::position(int id) const
+{
+    return m_positions.at(id);
+}
+
+const QRectF &RegionStore::bounds(int id) const
+{
+    return m_bounds.at(id);
+}
+
+bool RegionStore::hitTest(int id, const QPointF &scenePoint) const
+{
+    return ShapeGeometry::contains(shapeType(id), m_bounds.at(id), scenePoint - m_positions.at(id));
+}
+
+bool RegionStore::intersects(int id, const QRectF &sceneRect) const
+{
+    return ShapeGeometry::intersects(shapeType(id), m_bounds.at(id), sceneRect.translated(-m_positions.at(id)));
+}
+
+void RegionStore::setBounds(const QRectF &bounds)
+{
+    m_index.setBounds(bounds);
+}
+
+qint64 RegionStore::memoryUsage() const
+{
+    qint64 bytes = qint64(m_shapes.capacity())    * sizeof(quint8)
+                 + qint64(m_positions.capacity()) * sizeof(QPointF)
+                 + qint64(m_bounds.capacity())    * sizeof(QRectF)
+                 + qint64(m_contents.capacity())  * sizeof(quint32)
+                 + qint64(m_localMaps.capacity()) * sizeof(quint32)
+                 + qint64(m_alive.capacity())     * sizeof(bool)
+                 + qint64(m_free.capacity())      * sizeof(int);
+
+    // Each region has an entry in the node of spatial index and its location in the lookup table.
+    bytes += qint64(m_count) * (sizeof(int) + sizeof(QRectF) + sizeof(int) + 3 * sizeof(void*));
+
+    // The shared pool of paths keeps the paths of all the visited maps, so only the paths of this store are counted.
+    QSet<quint32> paths;
+    for (int id = 0; id < m_alive.size(); ++id)
+    {
+        if (!m_alive.at(id))
+            continue;
+
+        paths.insert(m_contents.at(id));
+        paths.insert(m_localMaps.at(id));
+    }
+
+    return bytes + StringPool::paths()->memoryUsage(paths);
+}
@@ -0,0 +1,75 @@
+#ifndef REGIONSTORE_H
+#define REGIONSTORE_H
+
+#include <QVector>
+#include <QString>
+#include <QStringList>
+#include <QPointF>
+#include <QRectF>
+#include <QList>
+
+#include "../io/mapdocument.h"
+#include "../helpers/quadtree.h"
+#include "../helpers/stringpool.h"
+
+// RegionStore keeps the regions of the map as plain data, without scene items.
+// It is used in virtualization mode, when the map has too many regions to keep them all as QGraphicsItems:
+// only the regions around the viewport are made into items (see InteractiveMap), the others live here.
+// - the data is stored as separate arrays (shapes, positions, bounds, string ids), so the region takes a few dozens of bytes;
+// - paths of legends and local maps are interned into the shared pool (the same, that the items use):
+//   many regions share the same files, so only their ids are stored;
+// - ids are stable: removed slots are reused by the next added regions;
+// - the scene bounds of all the regions are kept in the spatial index.
+
+class RegionStore
+{
+public:
+    RegionStore(const QRectF& bounds = QRectF());
+
+    int add (const RegionRecord& record);
+    void remove (int id);
+    void clear();
+    void reserve (int count);
+
+    bool contains (int id) const;
+    int size() const;
+
+    RegionRecord record (int id) const;
+    QVector<RegionRecord> records() const;
+    QVector<int> ids() const;
+
+    // Distinct local maps of the regions (at most the given number), without making the records.
+    QStringList localMaps (int limit) const;
+    void setRecord (int id, const RegionRecord& record);
+    void setShapeType (RegionOfInterest::ShapeType type);
+
+    QRectF sceneRect (int id) const;
+    QList<int> query (const QRectF& sceneRect) const;
+    QList<int> query (const QPointF& scenePoint) const;
+    RegionOfInterest::ShapeType shapeType (int id) const;
+    const QPointF& position (int id) const;
+    const QRectF& bounds (int id) const;
+
+    // Checks the exact shape of the region (the same, that RegionOfInterest makes), without building the path.
+    bool hitTest (int id, const QPointF& scenePoint) const;
+    bool intersects (int id, const QRectF& sceneRect) const;
+    void setBounds (const QRectF& bounds);
+
+    // Approximate memory, taken by the store (in bytes), including the strings and the spatial index.
+    qint64 memoryUsage() const;
+
+private:
+    QVector<quint8>  m_shapes;
+    QVector<QPointF> m_positions;
+    QVector<QRectF>  m_bounds;
+    QVector<quint32> m_contents;
+    QVector<quint32> m_localMaps;
+    QVector<bool>    m_alive;
+
+    QVector<int> m_free;
+    int m_count = 0;
+
+    QuadTree<int> m_index;
+};
+
+#endif // REGIONSTORE_H